@@ -24,7 +24,10 @@
 
 // IMPORTANT: Any changes here requires a full re-compiling of the source code to propagate them.
 
+// Serial baud rate at power up, and the default of the baud rate setting ($35) that applies from the 
+// first reset on. Rates up to 1000000 are supported, as long as F_CPU/8 divides them closely enough.
 #define BAUD_RATE 9600
+#define MAX_BAUD_ERROR 2.5 // Largest difference of the actual from the set baud rate (percent)
 
 // Define pin-assignments
 // NOTE: All step bit and direction pins must be on the same port.
@@ -102,11 +105,22 @@
 #define DEFAULT_Y_STEPS_PER_MM (94.488188976378*MICROSTEPS)
 #define DEFAULT_Z_STEPS_PER_MM (94.488188976378*MICROSTEPS)
 #define DEFAULT_STEP_PULSE_MICROSECONDS 10
-#define DEFAULT_MM_PER_ARC_SEGMENT 0.1
+#define DEFAULT_MM_PER_ARC_SEGMENT 0.1 // Shortest arc segment (mm)
+#define DEFAULT_ARC_TOLERANCE 0.002 // Largest chord error of arc segments (mm)
+#define DEFAULT_MERGE_ANGLE 5.0 // Largest direction change between merged lines (degrees)
+#define DEFAULT_MERGE_DEVIATION 0.002 // Largest deviation of merged lines from the programmed path (mm)
+#define DEFAULT_MERGE_STEPS 2 // Lines of fewer step events merge whatever their direction
 #define DEFAULT_RAPID_FEEDRATE 500.0 // mm/min
 #define DEFAULT_FEEDRATE 250.0
 #define DEFAULT_ACCELERATION (DEFAULT_FEEDRATE*60*60/10.0) // mm/min^2
+#define DEFAULT_X_MAX_RATE DEFAULT_RAPID_FEEDRATE // mm/min
+#define DEFAULT_Y_MAX_RATE DEFAULT_RAPID_FEEDRATE // mm/min
+#define DEFAULT_Z_MAX_RATE DEFAULT_RAPID_FEEDRATE // mm/min
+#define DEFAULT_X_ACCELERATION DEFAULT_ACCELERATION // mm/min^2
+#define DEFAULT_Y_ACCELERATION DEFAULT_ACCELERATION // mm/min^2
+#define DEFAULT_Z_ACCELERATION DEFAULT_ACCELERATION // mm/min^2
 #define DEFAULT_JUNCTION_DEVIATION 0.05 // mm
+#define DEFAULT_JERK 0.0 // mm/min^3. Trapezoid acceleration.
 #define DEFAULT_STEPPING_INVERT_MASK ((1<<Y_DIRECTION_BIT)|(1<<Z_DIRECTION_BIT))
 #define DEFAULT_REPORT_INCHES 0 // false
 #define DEFAULT_AUTO_START 1 // true
@@ -132,6 +146,27 @@
 #define CMD_FEED_HOLD '!'
 #define CMD_CYCLE_START '~'
 #define CMD_RESET '|' 
+#define CMD_BUFFER_REPORT 0x98 // Reports only the serial read and planner buffer state, for streamers
+
+// Feed rate override commands, as extended ASCII bytes. Each scales the nominal speeds of all queued
+// motions, which are replanned right away. The override is restored to 100% upon a reset.
+#define CMD_FEED_OVR_RESET 0x90         // Restores 100%
+#define CMD_FEED_OVR_COARSE_PLUS 0x91
+#define CMD_FEED_OVR_COARSE_MINUS 0x92
+#define CMD_FEED_OVR_FINE_PLUS 0x93
+#define CMD_FEED_OVR_FINE_MINUS 0x94
+#define MAX_FEED_RATE_OVERRIDE 200      // (percent)
+#define MIN_FEED_RATE_OVERRIDE 10       // (percent)
+#define FEED_OVERRIDE_COARSE_INCREMENT 10 // (percent)
+#define FEED_OVERRIDE_FINE_INCREMENT 1  // (percent)
+
+// Rapid override commands, as extended ASCII bytes. These only scale the seek (G0, G28, G30) motions,
+// which the feed override leaves alone, and select one of three fixed levels.
+#define CMD_RAPID_OVR_RESET 0x95        // Restores 100%
+#define CMD_RAPID_OVR_MEDIUM 0x96
+#define CMD_RAPID_OVR_LOW 0x97
+#define RAPID_OVERRIDE_MEDIUM 50        // (percent)
+#define RAPID_OVERRIDE_LOW 25           // (percent)
 
 // The temporal resolution of the acceleration management subsystem. Higher number give smoother
 // acceleration but may impact performance.
@@ -142,6 +177,8 @@
 // round-off can be great enough to cause problems and/or it's too fast for the Arduino. The correct
 // value for this parameter is machine dependent, so it's advised to set this only as high as needed.
 // Approximate successful values can range from 30L to 100L or more.
+// NOTE: This is the default for the $30 setting, which changes the rate at runtime, and the fixed rate
+// of the homing cycle. Higher rates cut the step segments shorter, so the segment buffer covers less time.
 #define ACCELERATION_TICKS_PER_SECOND 50L
 
 // Minimum planner junction speed. Sets the default minimum speed the planner plans for at the end
@@ -155,6 +192,17 @@
 // never reach its target. This parameter should always be greater than zero.
 #define MINIMUM_STEPS_PER_MINUTE 800 // (steps/min) - Integer value only
 
+// Adaptive multi-axis step smoothing. The Bresenham line tracer only steps the minor axes on step
+// events of the major axis, which at low step rates are far enough apart to step the minor axes 
+// audibly unevenly. Below each of these step event rates, the stepper interrupt runs twice as often
+// per step event and traces the line at that finer resolution. The thresholds are in CPU cycles per
+// step event: the defaults start at 8kHz and double the oversampling at 4kHz and again at 2kHz. 
+// Above the first threshold, the stepper interrupt runs exactly as without smoothing.
+#define ADAPTIVE_MULTI_AXIS_STEP_SMOOTHING // Comment to disable
+#define AMASS_LEVEL1 (F_CPU/8000) // Oversample 2x below this step event rate
+#define AMASS_LEVEL2 (F_CPU/4000) // Oversample 4x
+#define AMASS_LEVEL3 (F_CPU/2000) // Oversample 8x
+
 // Time delay increments performed during a dwell. The default value is set at 50ms, which provides
 // a maximum time delay of roughly 55 minutes, more than enough for most any application. Increasing
 // this delay will increase the maximum dwell time linearly, but also reduces the responsiveness of 
@@ -193,7 +241,27 @@
 // available RAM, like when re-compiling for a Teensy or Sanguino. Or decrease if the Arduino
 // begins to crash due to the lack of available RAM or if the CPU is having trouble keeping
 // up with planning new incoming motions as they are executed. 
-// #define BLOCK_BUFFER_SIZE 18  // Uncomment to override default in planner.h.
+// #define BLOCK_BUFFER_SIZE 20  // Uncomment to override default in planner.h.
+
+// The number of step segments the main program prepares ahead of the stepper interrupt. Each segment
+// lasts at most one acceleration tick, so this also sets how far ahead a feed hold takes effect. 
+// Increase if the main program occasionally takes longer than that and starves the steppers.
+// #define SEGMENT_BUFFER_SIZE 6  // Uncomment to override default in stepper.h.
+
+// Computes the trapezoid step counts (acceleration, plateau and deceleration) with 32-bit integer
+// arithmetic and 64-bit integer products instead of soft-float. Each block stores the reciprocal
+// of its acceleration, taken once in float when the block is planned, so recalculating a trapezoid 
+// needs no division. The reciprocal has 24 significant bits, so results differ from the floating
+// point planner by about one part in 2^24 plus rounding, within a step for distances below 2^24 
+// steps; 'make bench' reports the largest difference seen. Its host timing is no measure of the
+// AVR, where 64-bit products are library calls too; the AVR cycle cost has not been measured.
+// Costs 5 bytes of RAM per planner block.
+// #define PLANNER_FIXED_POINT // Uncomment to enable.
+
+// Parses every g-code line with the general two-pass parser, without the single-pass path for modal
+// G0/G1 lines of axis, F and N words only. Both give the same results; 'make gcode_diff' compares
+// them line by line over a test corpus.
+// #define GCODE_NO_FAST_PATH // Uncomment to disable the fast path.
 
 // Line buffer size from the serial input stream to be executed. Also, governs the size of 
 // each of the startup blocks, as they are each stored as a string of this size. Make sure
@@ -241,6 +309,15 @@
 // successful values for certain setups have ranged from 10 to 20us.
 // #define STEP_PULSE_DELAY 10 // Step pulse delay in microseconds. Default disabled.
 
+// Measures the execution time of every stepper driver interrupt with Timer0, which free-runs at
+// F_CPU/64 (4us per tick at 16MHz) for this purpose. Minimum, mean and maximum times are kept
+// separately for the block load, step segment load and plain Bresenham step paths, together
+// with a histogram of all of them and a count of step interrupts that arrived while the previous
+// one was still running (overruns). The '$T' command prints and restarts the statistics. Times
+// include any serial or I2C interrupts that ran nested inside the stepper interrupt, since those
+// use up the step period just the same. Costs about 80 bytes of RAM.
+#define STEPPER_ISR_TIMING // Comment to disable
+
 // ---------------------------------------------------------------------------------------
 
 // TODO: Install compile-time option to send numeric status codes rather than strings.
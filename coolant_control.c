@@ -22,6 +22,7 @@
 #include "settings.h"
 #include "config.h"
 #include "planner.h"
+#include "motion_control.h"
 
 #include <avr/io.h>
 
@@ -46,10 +47,16 @@ void coolant_stop()
 }
 
 
+uint8_t coolant_current_mode()
+{
+  return(current_coolant_mode);
+}
+
 void coolant_run(uint8_t mode)
 {
   if (mode != current_coolant_mode)
   { 
+    mc_line_flush();
     plan_synchronize(); // Ensure coolant turns on when specified in program.
     if (mode == COOLANT_FLOOD_ENABLE) { 
       COOLANT_FLOOD_PORT |= (1 << COOLANT_FLOOD_BIT);
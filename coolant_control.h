@@ -31,4 +31,7 @@ void coolant_init();
 void coolant_stop();
 void coolant_run(uint8_t mode);
 
+// Returns the coolant mode of the last coolant_run()
+uint8_t coolant_current_mode();
+
 #endif
\ No newline at end of file
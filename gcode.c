@@ -33,6 +33,7 @@
 #include "errno.h"
 #include "protocol.h"
 #include "report.h"
+#include "serial.h"
 
 // Declare gc extern struct
 parser_state_t gc;
@@ -76,18 +77,89 @@ static float to_millimeters(float value)
   return(gc.inches_mode ? (value * MM_PER_INCH) : value);
 }
 
+// Executes a block of axis words, with optional F and N words, in the modal G0 or G1 motion mode,
+// e.g. 'X1.2Y3.4F500', which makes up the bulk of a streamed program. A single G0 or G1 word may
+// repeat or switch between the two, as in 'G1X1.2F300'. It is parsed in a single pass and goes 
+// straight to the motion, with the results of the general path of gc_execute_line(), as no other
+// mode and neither the spindle nor the coolant change. Returns false, having changed nothing, for
+// any other block or any error, which are left to the general path. 'make gcode_diff' checks that
+// against a build with GCODE_NO_FAST_PATH.
+#ifndef GCODE_NO_FAST_PATH
+static uint8_t execute_modal_motion(char *line, uint8_t start)
+{
+  if (gc.motion_mode != MOTION_MODE_SEEK && gc.motion_mode != MOTION_MODE_LINEAR) { return(false); }
+  if (gc.inverse_feed_rate_mode || gc.program_flow) { return(false); } 
+  // A block failing after its M-codes were read leaves them to the next block's general path.
+  if (gc.spindle_direction != spindle_queued_direction() || gc.coolant_mode != coolant_current_mode()) {
+    return(false);
+  }
+  
+  uint8_t char_counter = start;
+  char letter;
+  float value, feed_rate = 0; // Zero for no F word
+  uint8_t axis_words = 0;
+  uint8_t motion_mode = gc.motion_mode, motion_word = false;
+  float target[3];
+  gc.status_code = STATUS_OK;
+  while(next_statement(&letter, &value, line, &char_counter)) {
+    switch(letter) {
+      case 'N': break;
+      case 'G': // Exactly G0 or G1, once. A second motion word is a modal group violation.
+        if (motion_word || (value != 0 && value != 1)) { return(false); }
+        motion_word = true;
+        motion_mode = (value == 0) ? MOTION_MODE_SEEK : MOTION_MODE_LINEAR;
+        break;
+      case 'F': 
+        if (value <= 0) { return(false); }
+        feed_rate = to_millimeters(value); 
+        break;
+      case 'X': target[X_AXIS] = to_millimeters(value); bit_true(axis_words,bit(X_AXIS)); break;
+      case 'Y': target[Y_AXIS] = to_millimeters(value); bit_true(axis_words,bit(Y_AXIS)); break;
+      case 'Z': target[Z_AXIS] = to_millimeters(value); bit_true(axis_words,bit(Z_AXIS)); break;
+      default: return(false);
+    }
+  }
+  if (gc.status_code || !axis_words) { return(false); }
+  
+  gc.motion_mode = motion_mode;
+  if (feed_rate > 0) { gc.feed_rate = feed_rate; }
+  uint8_t i;
+  for (i=0; i<=2; i++) {
+    if ( bit_istrue(axis_words,bit(i)) ) {
+      if (gc.absolute_mode) {
+        target[i] += gc.coord_system[i] + gc.coord_offset[i]; // Absolute mode
+      } else {
+        target[i] += gc.position[i]; // Incremental mode
+      }
+    } else {
+      target[i] = gc.position[i]; // No axis word in block. Keep same axis position.
+    }
+  }
+  mc_line(target[X_AXIS], target[Y_AXIS], target[Z_AXIS], 
+    (gc.motion_mode == MOTION_MODE_SEEK) ? -settings.default_seek_rate : gc.feed_rate, false);
+  memcpy(gc.position, target, sizeof(target)); // gc.position[] = target[];
+  return(true);
+}
+#endif
+
 // Executes one line of 0-terminated G-Code. The line is assumed to contain only uppercase
 // characters and signed floating point values (no whitespace). Comments and block delete
 // characters have been removed. All units and positions are converted and exported to grbl's
 // internal functions in terms of (mm, mm/min) and absolute machine coordinates, respectively.
-uint8_t gc_execute_line(char *line) 
+// The line begins at index start of the buffer and may wrap around the end of the serial
+// read buffer, where it is parsed in place.
+uint8_t gc_execute_line(char *line, uint8_t start) 
 {
 
   // If in alarm state, don't process. Immediately return with error.
   // NOTE: Might not be right place for this, but also prevents $N storing during alarm.
   if (sys.state == STATE_ALARM) { return(STATUS_ALARM_LOCK); }
+  
+  #ifndef GCODE_NO_FAST_PATH
+    if (execute_modal_motion(line, start)) { return(STATUS_OK); }
+  #endif
  
-  uint8_t char_counter = 0;  
+  uint8_t char_counter = start;  
   char letter;
   float value;
   int int_value;
@@ -97,6 +169,7 @@ uint8_t gc_execute_line(char *line)
 
   float inverse_feed_rate = -1; // negative inverse_feed_rate means no inverse_feed_rate specified
   uint8_t absolute_override = false; // true(1) = absolute motion for this block only {G53}
+  uint8_t continuous_mode = false; // true(1) = G64 in block
   uint8_t non_modal_action = NON_MODAL_NONE; // Tracks the actions of modal group 0 (non-modal)
   
   float target[3], offset[3];  
@@ -121,6 +194,7 @@ uint8_t gc_execute_line(char *line)
           case 93: case 94: group_number = MODAL_GROUP_5; break;
           case 20: case 21: group_number = MODAL_GROUP_6; break;
           case 54: case 55: case 56: case 57: case 58: case 59: group_number = MODAL_GROUP_12; break;
+          case 61: case 64: group_number = MODAL_GROUP_13; break;
         }          
         // Set 'G' commands
         switch(int_value) {
@@ -149,6 +223,11 @@ uint8_t gc_execute_line(char *line)
           case 54: case 55: case 56: case 57: case 58: case 59:
             gc.coord_select = int_value-54;
             break;
+          case 61: 
+            if (value != 61) { FAIL(STATUS_UNSUPPORTED_STATEMENT); } // G61.1 not supported
+            gc.path_tolerance = 0; 
+            break;
+          case 64: continuous_mode = true; break; // Tolerance set after the P word is read
           case 80: gc.motion_mode = MOTION_MODE_CANCEL; break;
           case 90: gc.absolute_mode = true; break;
           case 91: gc.absolute_mode = false; break;
@@ -207,7 +286,7 @@ uint8_t gc_execute_line(char *line)
      for different commands. Each will be converted to their proper value upon execution. */
   float p = 0, r = 0;
   uint8_t l = 0;
-  char_counter = 0;
+  char_counter = start;
   while(next_statement(&letter, &value, line, &char_counter)) {
     switch(letter) {
       case 'G': case 'M': case 'N': break; // Ignore command statements and line numbers
@@ -253,6 +332,10 @@ uint8_t gc_execute_line(char *line)
   
   //  ([M6]: Tool change should be executed here.)
   
+  // [G64]: Set continuous path mode tolerance. Without a P word, corners are blended within the
+  // junction deviation.
+  if (continuous_mode) { gc.path_tolerance = (p > 0) ? to_millimeters(p) : settings.junction_deviation; }
+  
   // [M3,M4,M5]: Update spindle state
   if (sys.state != STATE_CHECK_MODE) { spindle_run(gc.spindle_direction); }
   
@@ -322,14 +405,14 @@ uint8_t gc_execute_line(char *line)
             target[i] = gc.position[i];
           }
         }
-        mc_line(target[X_AXIS], target[Y_AXIS], target[Z_AXIS], settings.default_seek_rate, false);
+        mc_line(target[X_AXIS], target[Y_AXIS], target[Z_AXIS], -settings.default_seek_rate, false);
       }
       // Retreive G28/30 go-home position data (in machine coordinates) from EEPROM
       float coord_data[N_AXIS];
       uint8_t home_select = SETTING_INDEX_G28;
       if (non_modal_action == NON_MODAL_GO_HOME_1) { home_select = SETTING_INDEX_G30; }
       if (!settings_read_coord_data(home_select,coord_data)) { return(STATUS_SETTING_READ_FAIL); }
-      mc_line(coord_data[X_AXIS], coord_data[Y_AXIS], coord_data[Z_AXIS], settings.default_seek_rate, false); 
+      mc_line(coord_data[X_AXIS], coord_data[Y_AXIS], coord_data[Z_AXIS], -settings.default_seek_rate, false); 
       axis_words = 0; // Axis words used. Lock out from motion modes by clearing flags.
       break;
     case NON_MODAL_SET_HOME_0: case NON_MODAL_SET_HOME_1:
@@ -399,7 +482,7 @@ uint8_t gc_execute_line(char *line)
         break;
       case MOTION_MODE_SEEK:
         if (!axis_words) { FAIL(STATUS_INVALID_STATEMENT);} 
-        else { mc_line(target[X_AXIS], target[Y_AXIS], target[Z_AXIS], settings.default_seek_rate, false); }
+        else { mc_line(target[X_AXIS], target[Y_AXIS], target[Z_AXIS], -settings.default_seek_rate, false); }
         break;
       case MOTION_MODE_LINEAR:
         // TODO: Inverse time requires F-word with each statement. Need to do a check. Also need
@@ -539,6 +622,8 @@ uint8_t gc_execute_line(char *line)
   // M0,M1,M2,M30: Perform non-running program flow actions. During a program pause, the buffer may 
   // refill and can only be resumed by the cycle start run-time command.
   if (gc.program_flow) {
+    mc_arc_finish(); // Queue the rest of an arc in this block before waiting for the motions.
+    mc_line_flush();
     plan_synchronize(); // Finish all remaining buffered motions. Program paused when complete.
     sys.auto_start = false; // Disable auto cycle start. Forces pause until cycle start issued.
     
@@ -565,7 +650,7 @@ static int next_statement(char *letter, float *float_ptr, char *line, uint8_t *c
     FAIL(STATUS_EXPECTED_COMMAND_LETTER);
     return(0);
   }
-  (*char_counter)++;
+  *char_counter = serial_next_index(*char_counter);
   if (!read_float(line, char_counter, float_ptr)) {
     FAIL(STATUS_BAD_NUMBER_FORMAT); 
     return(0);
@@ -593,5 +678,5 @@ static int next_statement(char *letter, float *float_ptr, char *line, uint8_t *c
    group 6 = {M6} (Tool change)
    group 8 = {*M7} enable mist coolant
    group 9 = {M48, M49} enable/disable feed and speed override switches
-   group 13 = {G61, G61.1, G64} path control mode
+   group 13 = {G61.1} exact stop mode
 */
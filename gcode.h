@@ -39,6 +39,7 @@
 #define MODAL_GROUP_6 7 // [G20,G21] Units
 #define MODAL_GROUP_7 8 // [M3,M4,M5] Spindle turning
 #define MODAL_GROUP_12 9 // [G54,G55,G56,G57,G58,G59] Coordinate system selection
+#define MODAL_GROUP_13 10 // [G61,G64] Path control mode
 
 // Define command actions for within execution-type modal groups (motion, stopping, non-modal). Used
 // internally by the parser to know which command to execute.
@@ -71,6 +72,7 @@ typedef struct {
   uint8_t program_flow;            // {M0, M1, M2, M30}
   int8_t spindle_direction;        // 1 = CW, -1 = CCW, 0 = Stop {M3, M4, M5}
   uint8_t coolant_mode;            // 0 = Disable, 1 = Flood Enable {M8, M9}
+  float path_tolerance;            // Corner blending tolerance in mm. 0 = exact path {G61, G64}
   float feed_rate;                 // Millimeters/min
 //  float seek_rate;                 // Millimeters/min. Will be used in v0.9 when axis independence is installed
   float position[3];               // Where the interpreter considers the tool to be at this point in the code
@@ -91,7 +93,7 @@ extern parser_state_t gc;
 void gc_init();
 
 // Execute one block of rs275/ngc/g-code
-uint8_t gc_execute_line(char *line);
+uint8_t gc_execute_line(char *line, uint8_t start);
 
 // Set g-code parser position. Input in steps.
 void gc_set_current_position(int32_t x, int32_t y, int32_t z); 
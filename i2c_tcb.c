@@ -102,7 +102,8 @@ uint8_t* wellknown_table[8] = {
 
 struct tcb* tcb_in_progress;
 
-// assumption: this is the only way I2C activity gets initiated (no mutexes needed)
+// assumption: this is the only way I2C activity gets initiated. It runs from the TWI interrupt and
+// from queue_TWI(), which keeps interrupts off around it.
 // only call this if you know twi_state is TWI_READY.
 void twi_process_queue() {
   // mark last transaction as complete
@@ -125,7 +126,7 @@ void twi_process_queue() {
     return; // fifo is empty
   }
   transaction = twi_fifo[twi_fifo_read_pointer];
-  if((twi_fifo_read_pointer++)==TWI_FIFO_SIZE) {
+  if((++twi_fifo_read_pointer)==TWI_FIFO_SIZE) {
     twi_fifo_read_pointer=0; // wrap pointer
   }
   start_transaction(transaction);
@@ -211,12 +212,18 @@ void start_transaction(struct tcb* tran) {
   tcb_in_progress = tran; // save tcb pointer for final completion report
 }
 
+// Safe to call from the main program and from interrupts (mc_reset() stops the spindle from the serial
+// and limit interrupts): the fifo update and the transaction start run with interrupts off, so neither
+// another caller nor the TWI interrupt can come in between. Returns without waiting.
 int8_t queue_TWI(struct tcb* control_block) {
+  uint8_t sreg = SREG;
+  cli();
   uint8_t wrt = twi_fifo_write_pointer + 1;
   if(wrt==TWI_FIFO_SIZE) {
     wrt=0;
   }
   if(wrt == twi_fifo_read_pointer) {
+    SREG = sreg;
     return -1; // fail, queue full
   }
   twi_fifo[twi_fifo_write_pointer]=control_block;
@@ -227,6 +234,7 @@ int8_t queue_TWI(struct tcb* control_block) {
   if(twi_state==TWI_READY) {
     twi_process_queue();
   }
+  SREG = sreg;
   return 0; // success
 }
 
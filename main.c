@@ -51,6 +51,7 @@ int main(void)
   settings_init(); // Load grbl settings from EEPROM
   st_init(); // Setup stepper pins and interrupt timers
   sei(); // Enable interrupts
+  serial_set_baud_rate(settings.baud_rate); // Any EEPROM errors have been reported at BAUD_RATE
   
   memset(&sys, 0, sizeof(sys));  // Clear all system variables
   sys.abort = true;   // Set abort to complete initialization
@@ -66,8 +67,10 @@ int main(void)
       #ifdef MCP23017_PRESENT
       MCP23017_begin(MCP23017_UNIT0);
       #endif
+      serial_set_baud_rate(settings.baud_rate); // Apply a changed baud rate setting
       serial_reset_read_buffer(); // Clear serial read buffer
       plan_init(); // Clear block buffer and planner variables
+      mc_init(); // Clear any arc left in progress
       gc_init(); // Set g-code parser to default state
       protocol_init(); // Clear incoming line data and execute startup lines
       spindle_init();
@@ -85,6 +88,9 @@ int main(void)
       // Reset system variables.
       sys.abort = false;
       sys.execute = 0;
+      sys.override = 0;
+      sys.feed_override = 100;
+      sys.rapid_override = 100;
       if (bit_istrue(settings.flags,BITFLAG_AUTO_START)) { sys.auto_start = true; }
       
       // Check for power-up and set system alarm if homing is enabled to force homing cycle
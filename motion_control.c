@@ -24,6 +24,7 @@
 #include <util/delay.h>
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
 #include "settings.h"
 #include "config.h"
 #include "gcode.h"
@@ -36,9 +37,20 @@
 #include "limits.h"
 #include "protocol.h"
 
-// Execute linear motion in absolute millimeter coordinates. Feed rate given in millimeters/second
-// unless invert_feed_rate is true. Then the feed_rate means that the motion should be completed in
-// (1 minute)/feed_rate time.
+// Feed motion held back until the next line shows whether it can be merged into it or how to blend
+// the corner between them. The held line starts at position, the end of the last line given to 
+// the planner.
+typedef struct {
+  float position[3];
+  float target[3];
+  float feed_rate;
+  float deviation; // Largest distance of the lines merged into the held line from it (mm)
+  uint8_t pending; // True if a line is held back
+} mc_t;
+static mc_t mc;
+
+
+// Sends one line to the planner, waiting for room in the buffer as needed.
 // NOTE: This is the primary gateway to the grbl planner. All line motions, including arc line 
 // segments, must pass through this routine before being passed to the planner. The seperation of
 // mc_line and plan_buffer_line is done primarily to make backlash compensation integration simple
@@ -47,7 +59,7 @@
 // However, this keeps the memory requirements lower since it doesn't have to call and hold two 
 // plan_buffer_lines in memory. Grbl only has to retain the original line input variables during a
 // backlash segment(s).
-void mc_line(float x, float y, float z, float feed_rate, uint8_t invert_feed_rate)
+static void buffer_line(float *target, float feed_rate, uint8_t invert_feed_rate)
 {
   // TODO: Backlash compensation may be installed here. Only need direction info to track when
   // to insert a backlash line motion(s) before the intended line motion. Requires its own
@@ -56,16 +68,20 @@ void mc_line(float x, float y, float z, float feed_rate, uint8_t invert_feed_rat
   // i.e. keep the planner independent and do the computations in the status reporting, or let
   // the planner handle the position corrections. The latter may get complicated.
 
-  // If the buffer is full: good! That means we are well ahead of the robot. 
-  // Remain in this loop until there is room in the buffer.
+  // The planner buffers lines too long for a single block one part at a time.
+  uint8_t line_complete;
   do {
-    protocol_execute_runtime(); // Check for any run-time commands
-    if (sys.abort) { return; } // Bail, if system abort.
-  } while ( plan_check_full_buffer() );
+    // If the buffer is full: good! That means we are well ahead of the robot. 
+    // Remain in this loop until there is room in the buffer.
+    do {
+      protocol_execute_runtime(); // Check for any run-time commands
+      if (sys.abort) { return; } // Bail, if system abort.
+    } while ( plan_check_full_buffer() );
 
-  // If in check gcode mode, prevent motion by blocking planner.
-  if (sys.state != STATE_CHECK_MODE) {
-    plan_buffer_line(x, y, z, feed_rate, invert_feed_rate);
+    // If in check gcode mode, prevent motion by blocking planner.
+    if (sys.state == STATE_CHECK_MODE) { return; }
+    line_complete = plan_buffer_line(target[X_AXIS], target[Y_AXIS], target[Z_AXIS], feed_rate, 
+      invert_feed_rate);
     
     // If idle, indicate to the system there is now a planned block in the buffer ready to cycle 
     // start. Otherwise ignore and continue on.
@@ -80,7 +96,221 @@ void mc_line(float x, float y, float z, float feed_rate, uint8_t invert_feed_rat
     // command sent during manual operation; or if a system is prone to buffer starvation, auto-start
     // helps make sure it minimizes any dwelling/motion hiccups and keeps the cycle going. 
     if (sys.auto_start) { st_cycle_start(); }
+  } while (!line_complete);
+  memcpy(mc.position, target, sizeof(mc.position));
+}
+
+
+// Returns the number of segments for an arc. Each chord deviates from the arc by at most 
+// settings.arc_tolerance, but is no shorter than settings.mm_per_arc_segment, so the planner keeps
+// up with the segments. There is always at least one segment.
+static uint16_t arc_segment_count(float angular_travel, float radius, float millimeters_of_travel)
+{
+  // A chord of length 2*sqrt(tol*(2*r-tol)) deviates from the arc by at most tol at its midpoint.
+  uint16_t segments = floor(millimeters_of_travel/settings.mm_per_arc_segment);
+  if (settings.arc_tolerance < radius) {
+    float chord = 2*sqrt(settings.arc_tolerance*(2*radius-settings.arc_tolerance));
+    segments = min(segments, ceil(fabs(angular_travel)*radius/chord));
   }
+  if (segments == 0) { segments = 1; }
+  return(segments);
+}
+
+
+// Merges the line to target into the held line, if the lines are collinear enough. Successive
+// lines are merged while their direction changes by no more than settings.merge_cos_angle, and
+// while the merged line stays within settings.merge_deviation of every corner it replaces. A line
+// of fewer than settings.merge_steps step events is merged whatever its direction, within its own
+// length of the corners. Returns false, changing nothing, if the line cannot be merged.
+// NOTE: A corner at a fraction t along the held line lies t times the deviation of its end corner 
+// from the merged line, so adding the deviations of the end corners bounds that of every corner.
+static uint8_t merge_line(float *target, float feed_rate)
+{
+  if (feed_rate != mc.feed_rate || settings.merge_deviation == 0.0) { return(false); }
+  float held[3], added[3], merged[3];
+  float held_sqr = 0.0, added_sqr = 0.0, merged_sqr = 0.0, dot = 0.0;
+  float step_events = 0.0;
+  uint8_t idx;
+  for (idx=0; idx<N_AXIS; idx++) {
+    held[idx] = mc.target[idx]-mc.position[idx];
+    added[idx] = target[idx]-mc.target[idx];
+    merged[idx] = target[idx]-mc.position[idx];
+    held_sqr += held[idx]*held[idx];
+    added_sqr += added[idx]*added[idx];
+    merged_sqr += merged[idx]*merged[idx];
+    dot += held[idx]*added[idx];
+    step_events = max(step_events, fabs(added[idx])*settings.steps_per_mm[idx]);
+  }
+  if (merged_sqr == 0.0) { return(false); }
+  
+  float max_deviation = settings.merge_deviation;
+  if (step_events < settings.merge_steps) {
+    max_deviation = max(max_deviation, sqrt(added_sqr));
+  } else if (dot < 0.0 || dot*dot < settings.merge_cos_angle*settings.merge_cos_angle*held_sqr*added_sqr) {
+    return(false);
+  }
+  // Distance of the end corner from the merged line: |held x merged|/|merged|
+  float cross_sqr = 0.0;
+  for (idx=0; idx<N_AXIS; idx++) {
+    float cross = held[(idx+1)%N_AXIS]*merged[(idx+2)%N_AXIS] - held[(idx+2)%N_AXIS]*merged[(idx+1)%N_AXIS];
+    cross_sqr += cross*cross;
+  }
+  float deviation = mc.deviation + sqrt(cross_sqr/merged_sqr);
+  if (deviation > max_deviation) { return(false); }
+  mc.deviation = deviation;
+  memcpy(mc.target, target, sizeof(mc.target));
+  return(true);
+}
+
+
+// Replaces the corner at the end of the held line, where the line to target starts, by an arc 
+// tangent to both lines that passes within gc.path_tolerance of the corner. The arc meets each line
+// no further from the corner than the rest of the held line or half the new line, so successive
+// blends never overlap. Sends the held line up to the arc and the arc to the planner, and leaves the
+// rest of the new line to be held. Returns false, sending nothing, for straight corners and near
+// reversals, which are not blended.
+// The corner speed then follows from the arc radius, as it does for any other arc, instead of from
+// the junction deviation at a sharp corner.
+static uint8_t blend_corner(float *target, float feed_rate)
+{
+  float unit_vec_1[3], unit_vec_2[3];
+  float length_1 = 0.0, length_2 = 0.0;
+  uint8_t idx;
+  for (idx=0; idx<N_AXIS; idx++) {
+    unit_vec_1[idx] = mc.target[idx]-mc.position[idx];
+    unit_vec_2[idx] = target[idx]-mc.target[idx];
+    length_1 += unit_vec_1[idx]*unit_vec_1[idx];
+    length_2 += unit_vec_2[idx]*unit_vec_2[idx];
+  }
+  if (length_1 == 0.0 || length_2 == 0.0) { return(false); }
+  length_1 = sqrt(length_1);
+  length_2 = sqrt(length_2);
+  float cos_turn = 0.0; // Cosine of the change of direction at the corner
+  for (idx=0; idx<N_AXIS; idx++) {
+    unit_vec_1[idx] /= length_1;
+    unit_vec_2[idx] /= length_2;
+    cos_turn += unit_vec_1[idx]*unit_vec_2[idx];
+  }
+  if (cos_turn > 0.9999 || cos_turn < -0.95) { return(false); }
+
+  // With theta the angle between the lines, an arc of radius r tangent to both lines touches them
+  // r/tan(theta/2) from the corner and passes r/sin(theta/2)-r from it.
+  float sin_theta_d2 = sqrt(0.5*(1.0+cos_turn)); // Trig half angle identity. Always positive.
+  float cos_theta_d2 = sqrt(0.5*(1.0-cos_turn));
+  float radius = gc.path_tolerance*sin_theta_d2/(1.0-sin_theta_d2);
+  float tangent = radius*cos_theta_d2/sin_theta_d2;
+  float max_tangent = min(length_1, 0.5*length_2);
+  if (tangent > max_tangent) {
+    tangent = max_tangent;
+    radius = tangent*sin_theta_d2/cos_theta_d2;
+  }
+
+  // The arc center lies on the corner bisector, r/sin(theta/2) from the corner. The turn angle of the
+  // arc equals the change of direction. Its segments are found by spherical interpolation between 
+  // the radius vectors to the two tangent points, which is exact in any plane.
+  float angular_travel = acos(cos_turn);
+  float inverse_sin_travel = 1.0/sin(angular_travel);
+  float arc_start[3], r_start[3], r_end[3];
+  for (idx=0; idx<N_AXIS; idx++) {
+    float center = mc.target[idx] + (unit_vec_2[idx]-unit_vec_1[idx])*radius*inverse_sin_travel;
+    arc_start[idx] = mc.target[idx] - unit_vec_1[idx]*tangent;
+    r_start[idx] = arc_start[idx] - center;
+    r_end[idx] = mc.target[idx] + unit_vec_2[idx]*tangent - center;
+  }
+  feed_rate = min(feed_rate, mc.feed_rate);
+  uint16_t segments = arc_segment_count(angular_travel, radius, angular_travel*radius);
+
+  buffer_line(arc_start, mc.feed_rate, false);
+  uint16_t i;
+  float arc_target[3];
+  for (i = 1; i <= segments; i++) {
+    if (sys.abort) { return(true); }
+    float weight_start = sin((segments-i)*angular_travel/segments)*inverse_sin_travel;
+    float weight_end = sin(i*angular_travel/segments)*inverse_sin_travel;
+    for (idx=0; idx<N_AXIS; idx++) {
+      arc_target[idx] = arc_start[idx] - r_start[idx] + weight_start*r_start[idx] + weight_end*r_end[idx];
+    }
+    buffer_line(arc_target, feed_rate, false);
+  }
+  return(true);
+}
+
+
+// Execute linear motion in absolute millimeter coordinates. Feed rate given in millimeters/second
+// unless invert_feed_rate is true. Then the feed_rate means that the motion should be completed in
+// (1 minute)/feed_rate time. A negative feed rate marks a seek motion at its absolute value.
+// Feed motions are held back one line, so that nearly collinear lines can be merged into one
+// planner block and, in continuous path mode (G64), each corner between them can be blended. Seek
+// and inverse time motions are never held.
+void mc_line(float x, float y, float z, float feed_rate, uint8_t invert_feed_rate)
+{
+  float target[3];
+  target[X_AXIS] = x;
+  target[Y_AXIS] = y;
+  target[Z_AXIS] = z;
+  uint8_t hold = ((gc.path_tolerance > 0.0 || settings.merge_deviation > 0.0) && feed_rate > 0.0 && 
+                  !invert_feed_rate && sys.state != STATE_CHECK_MODE);
+  if (mc.pending) {
+    if (hold && merge_line(target, feed_rate)) { return; }
+    if (hold && gc.path_tolerance > 0.0 && blend_corner(target, feed_rate)) { mc.pending = false; }
+    else { mc_line_flush(); }
+    if (sys.abort) { return; }
+  }
+  if (hold) {
+    memcpy(mc.target, target, sizeof(target));
+    mc.feed_rate = feed_rate;
+    mc.deviation = 0.0;
+    mc.pending = true;
+  } else {
+    buffer_line(target, feed_rate, invert_feed_rate);
+  }
+}
+
+
+// Sends the held line to the planner, if any.
+void mc_line_flush()
+{
+  if (mc.pending) {
+    mc.pending = false;
+    buffer_line(mc.target, mc.feed_rate, false);
+  }
+}
+
+
+// Sets the position the next line starts from. Input in steps. Called by the system abort and 
+// homing routines.
+void mc_set_current_position(int32_t x, int32_t y, int32_t z)
+{
+  mc.position[X_AXIS] = x/settings.steps_per_mm[X_AXIS];
+  mc.position[Y_AXIS] = y/settings.steps_per_mm[Y_AXIS];
+  mc.position[Z_AXIS] = z/settings.steps_per_mm[Z_AXIS];
+}
+
+
+// Arc in progress. mc_arc() only sets this up; the segments are queued by mc_arc_continue() as the
+// planner frees space, so the main program keeps reading serial input during long arcs.
+typedef struct {
+  float center_axis0, center_axis1;
+  float r_axis0, r_axis1; // Radius vector from center to the last queued segment
+  float offset_axis0, offset_axis1; // Offset from the arc start to the center, for arc correction
+  float theta_per_segment, linear_per_segment;
+  float cos_T, sin_T; // Vector rotation matrix values
+  float arc_target[3];
+  float target[3];
+  float feed_rate;
+  uint16_t segments; // Number of segments, or zero when no arc is in progress
+  uint16_t i; // Last queued segment
+  int8_t count;
+  uint8_t axis_0, axis_1, axis_linear;
+  uint8_t invert_feed_rate;
+} arc_t;
+static arc_t arc;
+
+
+void mc_init()
+{
+  arc.segments = 0; // Drop any arc or held line left in progress by a system abort.
+  mc.pending = false;
 }
 
 
@@ -88,11 +318,17 @@ void mc_line(float x, float y, float z, float feed_rate, uint8_t invert_feed_rat
 // offset == offset from current xyz, axis_XXX defines circle plane in tool space, axis_linear is
 // the direction of helical travel, radius == circle radius, isclockwise boolean. Used
 // for vector transformation direction.
-// The arc is approximated by generating a huge number of tiny, linear segments. The length of each 
-// segment is configured in settings.mm_per_arc_segment.  
+// The arc is approximated by generating a huge number of tiny, linear segments (see 
+// arc_segment_count()).
+// NOTE: Returns once the segments that fit in the planner buffer are queued. The rest follow
+// through mc_arc_continue(). Any arc still in progress is finished first.
 void mc_arc(float *position, float *target, float *offset, uint8_t axis_0, uint8_t axis_1, 
   uint8_t axis_linear, float feed_rate, uint8_t invert_feed_rate, float radius, uint8_t isclockwise)
 {      
+  mc_arc_finish();
+  mc_line_flush();
+  if (sys.abort) { return; }
+
   float center_axis0 = position[axis_0] + offset[axis_0];
   float center_axis1 = position[axis_1] + offset[axis_1];
   float linear_travel = target[axis_linear] - position[axis_linear];
@@ -111,14 +347,14 @@ void mc_arc(float *position, float *target, float *offset, uint8_t axis_0, uint8
   
   float millimeters_of_travel = hypot(angular_travel*radius, fabs(linear_travel));
   if (millimeters_of_travel == 0.0) { return; }
-  uint16_t segments = floor(millimeters_of_travel/settings.mm_per_arc_segment);
+  uint16_t segments = arc_segment_count(angular_travel, radius, millimeters_of_travel);
   // Multiply inverse feed_rate to compensate for the fact that this movement is approximated
   // by a number of discrete segments. The inverse feed_rate should be correct for the sum of 
   // all segments.
   if (invert_feed_rate) { feed_rate *= segments; }
  
-  float theta_per_segment = angular_travel/segments;
-  float linear_per_segment = linear_travel/segments;
+  arc.theta_per_segment = angular_travel/segments;
+  arc.linear_per_segment = linear_travel/segments;
   
   /* Vector rotation by transformation matrix: r is the original vector, r_T is the rotated vector,
      and phi is the angle of rotation. Solution approach by Jens Geisler.
@@ -134,7 +370,7 @@ void mc_arc(float *position, float *target, float *offset, uint8_t axis_0, uint8
      tool precision in some cases. Therefore, arc path correction is implemented. 
 
      Small angle approximation may be used to reduce computation overhead further. This approximation
-     holds for everything, but very small circles and large mm_per_arc_segment values. In other words,
+     holds for everything, but very small circles and large arc tolerances. In other words,
      theta_per_segment would need to be greater than 0.1 rad and N_ARC_CORRECTION would need to be large
      to cause an appreciable drift error. N_ARC_CORRECTION~=25 is more than small enough to correct for 
      numerical drift error. N_ARC_CORRECTION may be on the order a hundred(s) before error becomes an
@@ -145,49 +381,80 @@ void mc_arc(float *position, float *target, float *offset, uint8_t axis_0, uint8
      a correction, the planner should have caught up to the lag caused by the initial mc_arc overhead. 
      This is important when there are successive arc motions. 
   */
-  // Vector rotation matrix values
-  float cos_T = 1-0.5*theta_per_segment*theta_per_segment; // Small angle approximation
-  float sin_T = theta_per_segment;
-  
-  float arc_target[3];
-  float sin_Ti;
-  float cos_Ti;
-  float r_axisi;
-  uint16_t i;
-  int8_t count = 0;
+  arc.cos_T = 1-0.5*arc.theta_per_segment*arc.theta_per_segment; // Small angle approximation
+  arc.sin_T = arc.theta_per_segment;
 
+  arc.center_axis0 = center_axis0;
+  arc.center_axis1 = center_axis1;
+  arc.r_axis0 = r_axis0;
+  arc.r_axis1 = r_axis1;
+  arc.offset_axis0 = offset[axis_0];
+  arc.offset_axis1 = offset[axis_1];
+  arc.axis_0 = axis_0;
+  arc.axis_1 = axis_1;
+  arc.axis_linear = axis_linear;
+  arc.feed_rate = feed_rate;
+  arc.invert_feed_rate = invert_feed_rate;
+  memcpy(arc.target, target, sizeof(arc.target));
   // Initialize the linear axis
-  arc_target[axis_linear] = position[axis_linear];
+  arc.arc_target[axis_linear] = position[axis_linear];
+  arc.count = 0;
+  arc.i = 0;
+  arc.segments = segments;
 
-  for (i = 1; i<segments; i++) { // Increment (segments-1)
-    
-    if (count < settings.n_arc_correction) {
+  mc_arc_continue();
+}
+
+
+// Queue the next segment of the arc in progress. Waits in buffer_line() if the planner buffer is full.
+static void arc_segment()
+{
+  arc.i++;
+  if (arc.i < arc.segments) {
+    if (arc.count < settings.n_arc_correction) {
       // Apply vector rotation matrix 
-      r_axisi = r_axis0*sin_T + r_axis1*cos_T;
-      r_axis0 = r_axis0*cos_T - r_axis1*sin_T;
-      r_axis1 = r_axisi;
-      count++;
+      float r_axisi = arc.r_axis0*arc.sin_T + arc.r_axis1*arc.cos_T;
+      arc.r_axis0 = arc.r_axis0*arc.cos_T - arc.r_axis1*arc.sin_T;
+      arc.r_axis1 = r_axisi;
+      arc.count++;
     } else {
       // Arc correction to radius vector. Computed only every n_arc_correction increments.
       // Compute exact location by applying transformation matrix from initial radius vector(=-offset).
-      cos_Ti = cos(i*theta_per_segment);
-      sin_Ti = sin(i*theta_per_segment);
-      r_axis0 = -offset[axis_0]*cos_Ti + offset[axis_1]*sin_Ti;
-      r_axis1 = -offset[axis_0]*sin_Ti - offset[axis_1]*cos_Ti;
-      count = 0;
+      float cos_Ti = cos(arc.i*arc.theta_per_segment);
+      float sin_Ti = sin(arc.i*arc.theta_per_segment);
+      arc.r_axis0 = -arc.offset_axis0*cos_Ti + arc.offset_axis1*sin_Ti;
+      arc.r_axis1 = -arc.offset_axis0*sin_Ti - arc.offset_axis1*cos_Ti;
+      arc.count = 0;
     }
 
     // Update arc_target location
-    arc_target[axis_0] = center_axis0 + r_axis0;
-    arc_target[axis_1] = center_axis1 + r_axis1;
-    arc_target[axis_linear] += linear_per_segment;
-    mc_line(arc_target[X_AXIS], arc_target[Y_AXIS], arc_target[Z_AXIS], feed_rate, invert_feed_rate);
-    
-    // Bail mid-circle on system abort. Runtime command check already performed by mc_line.
-    if (sys.abort) { return; }
+    arc.arc_target[arc.axis_0] = arc.center_axis0 + arc.r_axis0;
+    arc.arc_target[arc.axis_1] = arc.center_axis1 + arc.r_axis1;
+    arc.arc_target[arc.axis_linear] += arc.linear_per_segment;
+    buffer_line(arc.arc_target, arc.feed_rate, arc.invert_feed_rate);
+  } else {
+    // Ensure last segment arrives at target location.
+    buffer_line(arc.target, arc.feed_rate, arc.invert_feed_rate);
+    arc.segments = 0;
   }
-  // Ensure last segment arrives at target location.
-  mc_line(target[X_AXIS], target[Y_AXIS], target[Z_AXIS], feed_rate, invert_feed_rate);
+  // Bail mid-circle on system abort. Runtime command check already performed by buffer_line.
+  if (sys.abort) { arc.segments = 0; }
+}
+
+
+// Queue as many segments of the arc in progress as the planner buffer has room for, without
+// waiting. Returns true while segments remain.
+uint8_t mc_arc_continue()
+{
+  while (arc.segments && !plan_check_full_buffer()) { arc_segment(); }
+  return(arc.segments != 0);
+}
+
+
+// Queue all remaining segments of the arc in progress, waiting for planner space as needed.
+void mc_arc_finish()
+{
+  while (arc.segments) { arc_segment(); }
 }
 
 
@@ -195,6 +462,7 @@ void mc_arc(float *position, float *target, float *offset, uint8_t axis_0, uint8
 void mc_dwell(float seconds) 
 {
    uint16_t i = floor(1000/DWELL_TIME_STEP*seconds);
+   mc_line_flush();
    plan_synchronize();
    delay_ms(floor(1000*seconds-i*DWELL_TIME_STEP)); // Delay millisecond remainder
    while (i-- > 0) {
@@ -211,6 +479,7 @@ void mc_dwell(float seconds)
 // executing the homing cycle. This prevents incorrect buffered plans after homing.
 void mc_go_home()
 {
+  mc_line_flush();
   plan_synchronize();  // Empty all motions in buffer before homing.
   #ifdef LIMIT_INT
   PCICR &= ~(1 << LIMIT_INT);   // Disable hard limits pin change interrupt
@@ -25,17 +25,36 @@
 #include <avr/io.h>
 #include "planner.h"
 
+// Clears the arc in progress and the held line. Called upon a system reset.
+void mc_init();
+
 // Execute linear motion in absolute millimeter coordinates. Feed rate given in millimeters/second
 // unless invert_feed_rate is true. Then the feed_rate means that the motion should be completed in
-// (1 minute)/feed_rate time.
+// (1 minute)/feed_rate time. A negative feed rate marks a seek motion at its absolute value, which
+// the rapid override applies to. Feed motions are held back one line, to merge nearly collinear
+// lines and, in continuous path mode (G64), to blend the corner to the next.
 void mc_line(float x, float y, float z, float feed_rate, uint8_t invert_feed_rate);
 
+// Sends the held line to the planner, if any. Called before anything
+// that must follow the queued motions.
+void mc_line_flush();
+
+// Set the position the next line starts from. Input in steps.
+void mc_set_current_position(int32_t x, int32_t y, int32_t z);
+
 // Execute an arc in offset mode format. position == current xyz, target == target xyz, 
 // offset == offset from current xyz, axis_XXX defines circle plane in tool space, axis_linear is
 // the direction of helical travel, radius == circle radius, isclockwise boolean. Used
 // for vector transformation direction.
 void mc_arc(float *position, float *target, float *offset, uint8_t axis_0, uint8_t axis_1,
   uint8_t axis_linear, float feed_rate, uint8_t invert_feed_rate, float radius, uint8_t isclockwise);
+
+// Queue the segments of the arc in progress that fit in the planner buffer, without waiting for
+// space. Returns true while segments remain. Called from the main program's serial processing.
+uint8_t mc_arc_continue();
+
+// Queue all remaining segments of the arc in progress, waiting for planner space as needed.
+void mc_arc_finish();
   
 // Dwell for a specific number of seconds
 void mc_dwell(float seconds);
@@ -23,6 +23,8 @@
 #include "nuts_bolts.h"
 #include "gcode.h"
 #include "planner.h"
+#include "motion_control.h"
+#include "serial.h"
 
 #define MAX_INT_DIGITS 8 // Maximum number of digits in int32 (and float)
 extern float __floatunsisf (unsigned long);
@@ -36,19 +38,21 @@ extern float __floatunsisf (unsigned long);
 // NOTE: Thanks to Radu-Eosif Mihailescu for identifying the issues with using strtod().
 int read_float(char *line, uint8_t *char_counter, float *float_ptr)                  
 {
-  char *ptr = line + *char_counter;
+  uint8_t index = *char_counter;
   unsigned char c;
     
-  // Grab first character and increment pointer. No spaces assumed in line.
-  c = *ptr++;
+  // Grab first character. No spaces assumed in line.
+  c = line[index];
   
   // Capture initial positive/minus character
   bool isnegative = false;
   if (c == '-') {
     isnegative = true;
-    c = *ptr++;
+    index = serial_next_index(index);
+    c = line[index];
   } else if (c == '+') {
-    c = *ptr++;
+    index = serial_next_index(index);
+    c = line[index];
   }
   
   // Extract number into fast integer. Track decimal in terms of exponent value.
@@ -71,7 +75,8 @@ int read_float(char *line, uint8_t *char_counter, float *float_ptr)
     } else {
       break;
     }
-    c = *ptr++;
+    index = serial_next_index(index);
+    c = line[index];
   }
   
   // Return if no digits have been read.
@@ -104,7 +109,7 @@ int read_float(char *line, uint8_t *char_counter, float *float_ptr)
     *float_ptr = fval;
   }
 
-  *char_counter = ptr - line - 1; // Set char_counter to next statement
+  *char_counter = index; // Set char_counter to next statement
   
   return(true);
 }
@@ -145,4 +150,5 @@ void sys_sync_current_position()
 {
   plan_set_current_position(sys.position[X_AXIS],sys.position[Y_AXIS],sys.position[Z_AXIS]);
   gc_set_current_position(sys.position[X_AXIS],sys.position[Y_AXIS],sys.position[Z_AXIS]);
+  mc_set_current_position(sys.position[X_AXIS],sys.position[Y_AXIS],sys.position[Z_AXIS]);
 }
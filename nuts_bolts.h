@@ -64,7 +64,18 @@
 #define EXEC_RESET          bit(4) // bitmask 00010000
 #define EXEC_ALARM          bit(5) // bitmask 00100000
 #define EXEC_CRIT_EVENT     bit(6) // bitmask 01000000
-// #define                  bit(7) // bitmask 10000000
+#define EXEC_BUFFER_REPORT  bit(7) // bitmask 10000000
+
+// Define system override bit map. The override commands are picked off by the serial interrupt and
+// executed by the main program. Also used as the sys.override flag byte.
+#define OVERRIDE_FEED_RESET        bit(0)
+#define OVERRIDE_FEED_COARSE_PLUS  bit(1)
+#define OVERRIDE_FEED_COARSE_MINUS bit(2)
+#define OVERRIDE_FEED_FINE_PLUS    bit(3)
+#define OVERRIDE_FEED_FINE_MINUS   bit(4)
+#define OVERRIDE_RAPID_RESET       bit(5)
+#define OVERRIDE_RAPID_MEDIUM      bit(6)
+#define OVERRIDE_RAPID_LOW         bit(7)
 
 // Define system state bit map. The state variable primarily tracks the individual functions
 // of Grbl to manage each without overlapping. It is also used as a messaging flag for
@@ -84,6 +95,9 @@ typedef struct {
   uint8_t abort;                 // System abort flag. Forces exit back to main loop for reset.
   uint8_t state;                 // Tracks the current state of Grbl.
   volatile uint8_t execute;      // Global system runtime executor bitflag variable. See EXEC bitmasks.
+  volatile uint8_t override;     // Pending override commands. See OVERRIDE bitmasks.
+  uint8_t feed_override;         // Feed rate override in percent of the programmed feed rates.
+  uint8_t rapid_override;        // Rapid override in percent of the seek rate.
   int32_t position[N_AXIS];      // Real-time machine (aka home) position vector in steps. 
                                  // NOTE: This may need to be a volatile variable, if problems arise.   
   uint8_t auto_start;            // Planner auto-start flag. Toggled off during feed hold. Defaulted by settings.
@@ -92,7 +106,8 @@ extern system_t sys;
 
 // Read a floating point value from a string. Line points to the input buffer, char_counter 
 // is the indexer pointing to the current character of the line, while float_ptr is 
-// a pointer to the result variable. Returns true when it succeeds
+// a pointer to the result variable. Returns true when it succeeds. The indexer wraps around
+// at the end of the serial read buffer, where lines are parsed (see serial_next_index()).
 int read_float(char *line, uint8_t *char_counter, float *float_ptr);
 
 // Delays variable-defined milliseconds. Compiler compatibility fix for _delay_ms().
@@ -30,11 +30,18 @@
 #include "settings.h"
 #include "config.h"
 #include "protocol.h"
+#include "spindle_control.h"
+
+#define SOME_LARGE_VALUE 1.0E+38 // Junction speed limit of straight junctions, which have none (mm/min)^2
 
 static block_t block_buffer[BLOCK_BUFFER_SIZE];  // A ring buffer for motion instructions
 static volatile uint8_t block_buffer_head;       // Index of the next block to be pushed
 static volatile uint8_t block_buffer_tail;       // Index of the block to process now
 static uint8_t next_buffer_head;                 // Index of the next buffer head
+static volatile uint8_t block_buffer_planned;    // Index of the optimally planned block. Entry speeds
+                                                 // from the tail up to this block can no longer change.
+static uint8_t block_buffer_prep;                // Index of the block the stepper segment generator is
+                                                 // preparing. Never after block_buffer_planned.
 
 // Define planner variables
 typedef struct {
@@ -42,7 +49,9 @@ typedef struct {
                                    // from g-code position for movements requiring multiple line motions,
                                    // i.e. arcs, canned cycles, and backlash compensation.
   float previous_unit_vec[3];     // Unit vector of previous path line segment
-  float previous_nominal_speed;   // Nominal speed of previous path line segment
+  float previous_nominal_speed_sqr; // Nominal speed of previous path line segment, squared
+  float split_feed_rate;          // Speed (mm/min) of the inverse time line being split, if any
+  uint16_t prep_step_offset;      // Step events of the prep block before its replanned remainder
 } planner_t;
 static planner_t pl;
 
@@ -86,63 +95,181 @@ float estimate_acceleration_distance(float initial_rate, float target_rate, floa
 // you started at speed initial_rate and accelerated until this point and want to end at the final_rate after
 // a total travel of distance. This can be used to compute the intersection point between acceleration and
 // deceleration in the cases where the trapezoid has no plateau (i.e. never reaches maximum speed)
+#ifndef PLANNER_FIXED_POINT
 static float intersection_distance(float initial_rate, float final_rate, float acceleration, float distance) 
 {
   return( (2*acceleration*distance-initial_rate*initial_rate+final_rate*final_rate)/(4*acceleration) );
 }
+#else
+
+// Fixed-point counterpart of estimate_acceleration_distance() for step rates low <= high (step/min), 
+// rounded up if round_up is set and down otherwise. (high^2-low^2) is split into (high-low)*(high+low)
+// and scaled by the block's reciprocal of twice its acceleration, taken once by plan_buffer_line(),
+// so there is no division. The reciprocal has 24 significant bits and the product is truncated to
+// about 31, so with rates below 2^22 step/min the result is within about one part in 2^24 plus a
+// step of the exact value.
+static uint32_t fixed_acceleration_distance(block_t *block, uint32_t low, uint32_t high, uint8_t round_up)
+{
+  uint8_t shift = block->acceleration_shift-22;
+  uint32_t scaled = ((uint64_t)(high-low)*block->acceleration_inverse) >> 22;
+  uint64_t distance = (uint64_t)scaled*(high+low);
+  if (round_up) { distance += ((uint64_t)1 << shift)-1; }
+  return(distance >> shift);
+}
+#endif
+
 
-            
-// Calculates the maximum allowable speed at this point when you must be able to reach target_velocity
-// using the acceleration within the allotted distance.
-// NOTE: sqrt() reimplimented here from prior version due to improved planner logic. Increases speed
-// in time critical computations, i.e. arcs or rapid short lines from curves. Guaranteed to not exceed
-// BLOCK_BUFFER_SIZE calls per planner cycle.
-static float max_allowable_speed(float acceleration, float target_velocity, float distance) 
+/*                       S-CURVE PHASE (settings.jerk > 0)
+                              +-------------+         <- rate_delta
+                             /               \
+    rate change per tick -> /                 \
+                           /                   \
+                       ---+                     +---      <- 0
+                          |<R>|             |<R>|
+                          |<------ ticks ------>|      time -->
+*/
+// With a jerk limit, a phase changes the rate between rate_a and rate_b with the rate change per tick
+// ramping at the block's jerk up to at most rate_delta, holding it, and ramping back down. If the phase
+// is too short for the ramps to reach rate_delta, its peak is lowered instead, to sqrt(change*jerk), so
+// neither the acceleration nor the jerk limit is ever exceeded. The profile is symmetric, so the phase
+// covers its duration at the mean of the two rates. The stepper rounds the ramps and the hold up to whole 
+// ticks, which adds at most SCURVE_MARGIN_TICKS, and stretches the hold over the planned steps (see 
+// scurve_start() in stepper.c). The fixed-point trapezoid generator only covers trapezoids.
+#define SCURVE_MARGIN_TICKS 2.0
+#define SCURVE_ITERATIONS 10 // Bisection steps of the rates solved for, each halving the uncertainty
+
+// Returns the block's jerk limit in step/min per acceleration tick squared.
+float plan_scurve_jerk(block_t *block)
 {
-  return( sqrt(target_velocity*target_velocity-2*acceleration*distance) );
+  float tick_per_minute = 60.0*settings.acceleration_ticks;
+  return(settings.jerk*block->step_events_per_mm/(tick_per_minute*tick_per_minute));
 }
 
+// Returns the steps the block takes to change between the step rates rate_a and rate_b (step/min).
+float plan_scurve_steps(block_t *block, float rate_a, float rate_b)
+{
+  float change = fabs(rate_b-rate_a);
+  if (change == 0.0) { return(0.0); }
+  float jerk = plan_scurve_jerk(block);
+  float ticks;
+  if (change*jerk >= (float)block->rate_delta*block->rate_delta) {
+    ticks = change/block->rate_delta + block->rate_delta/jerk; // Ramps reach rate_delta
+  } else {
+    ticks = 2*sqrt(change/jerk); // Triangular acceleration, peaking below rate_delta
+  }
+  return((rate_a+rate_b)*(ticks+SCURVE_MARGIN_TICKS)/(120.0*settings.acceleration_ticks));
+}
+
+// Returns the step rate nearest to limit, up or down, that the block can change to from rate within the
+// given steps. Rounded towards rate, so the change always fits.
+float plan_scurve_reachable_rate(block_t *block, float rate, float limit, float steps)
+{
+  if (plan_scurve_steps(block, rate, limit) <= steps) { return(limit); }
+  float reachable = rate;
+  uint8_t i;
+  for (i=0; i<SCURVE_ITERATIONS; i++) {
+    float middle = 0.5*(reachable+limit);
+    if (plan_scurve_steps(block, rate, middle) <= steps) { reachable = middle; } 
+    else { limit = middle; }
+  }
+  return(reachable);
+}
+
+// Returns the highest rate, up to the nominal rate, that the block can accelerate to from its initial rate
+// and still decelerate to its final rate within the given steps. At least the higher of the two.
+static float scurve_peak_rate(block_t *block, float steps)
+{
+  float reachable = max(block->initial_rate, block->final_rate);
+  float limit = block->nominal_rate;
+  uint8_t i;
+  for (i=0; i<SCURVE_ITERATIONS; i++) {
+    float middle = 0.5*(reachable+limit);
+    if (plan_scurve_steps(block, block->initial_rate, middle) + 
+        plan_scurve_steps(block, middle, block->final_rate) <= steps) { reachable = middle; } 
+    else { limit = middle; }
+  }
+  return(reachable);
+}
+
+// Returns the speed^2 nearest to limit_sqr, up or down, that an S-curve phase reaches from speed_sqr 
+// within the block ((mm/min)^2). The speeds are solved as step rates.
+static float scurve_reachable_speed_sqr(block_t *block, float speed_sqr, float limit_sqr)
+{
+  // delta_speed_sqr = 2*acceleration*length, with rate_delta the acceleration in step/min per tick
+  float steps = block->delta_speed_sqr*block->step_events_per_mm*block->step_events_per_mm/
+                (120.0*block->rate_delta*settings.acceleration_ticks);
+  float rate = plan_scurve_reachable_rate(block, sqrt(speed_sqr)*block->step_events_per_mm, 
+                                          sqrt(limit_sqr)*block->step_events_per_mm, steps);
+  rate /= block->step_events_per_mm;
+  return(rate*rate);
+}
+
+// Returns the speed^2 nearest to limit_sqr, up or down, that the block can change to from speed_sqr 
+// within its length ((mm/min)^2). At full acceleration, the squared speed changes by delta_speed_sqr over
+// the block. An S-curve needs more of the block.
+static inline float block_reachable_speed_sqr(block_t *block, float speed_sqr, float limit_sqr)
+{
+  if (settings.jerk > 0) { return(scurve_reachable_speed_sqr(block, speed_sqr, limit_sqr)); }
+  if (limit_sqr > speed_sqr) { return(min(limit_sqr, speed_sqr+block->delta_speed_sqr)); }
+  return(max(limit_sqr, speed_sqr-block->delta_speed_sqr));
+}
+
+
 
 // The kernel called by planner_recalculate() when scanning the plan from last to first entry.
-static void planner_reverse_pass_kernel(block_t *previous, block_t *current, block_t *next) 
+// Returns false if the current block's entry speed is unchanged, in which case no earlier entry
+// speed can change either.
+static uint8_t planner_reverse_pass_kernel(block_t *previous, block_t *current, block_t *next) 
 {
-  if (!current) { return; }  // Cannot operate on nothing.
+  if (!current) { return(true); }  // Cannot operate on nothing.
   
   if (next) { 
     // If entry speed is already at the maximum entry speed, no need to recheck. Block is cruising.
     // If not, block in state of acceleration or deceleration. Reset entry speed to maximum and 
     // check for maximum allowable speed reductions to ensure maximum possible planned speed.
-    if (current->entry_speed != current->max_entry_speed) {
+    if (current->entry_speed_sqr != current->max_entry_speed_sqr) {
+      float entry_speed_sqr;
     
       // If nominal length true, max junction speed is guaranteed to be reached. Only compute
       // for max allowable speed if block is decelerating and nominal length is false.
-      if ((!current->nominal_length_flag) && (current->max_entry_speed > next->entry_speed)) {
-        current->entry_speed = min( current->max_entry_speed,
-          max_allowable_speed(-settings.acceleration,next->entry_speed,current->millimeters));
+      if (bit_isfalse(current->flags,BLOCK_FLAG_NOMINAL_LENGTH) && 
+          (current->max_entry_speed_sqr > next->entry_speed_sqr)) {
+        entry_speed_sqr = block_reachable_speed_sqr(current, next->entry_speed_sqr, current->max_entry_speed_sqr);
       } else {
-        current->entry_speed = current->max_entry_speed;
+        entry_speed_sqr = current->max_entry_speed_sqr;
       } 
-      current->recalculate_flag = true;    
-    
+      if (current->entry_speed_sqr != entry_speed_sqr) {
+        current->entry_speed_sqr = entry_speed_sqr;
+        bit_true(current->flags,BLOCK_FLAG_RECALCULATE);
+        return(true);
+      }
     }
+    return(false);
   } // Skip last block. Already initialized and set for recalculation.
+  return(true);
 }
 
 
 // planner_recalculate() needs to go over the current plan twice. Once in reverse and once forward. This 
-// implements the reverse pass.
-static void planner_reverse_pass() 
+// implements the reverse pass. Returns the index of the block the forward pass must start from: the
+// first block back from the head whose entry speed did not change, or the optimally planned block.
+// With replan_all set, the pass does not stop early, for when all maximum entry speeds have changed.
+static uint8_t planner_reverse_pass(uint8_t planned_index, uint8_t replan_all) 
 {
   uint8_t block_index = block_buffer_head;
   block_t *block[3] = {NULL, NULL, NULL};
-  while(block_index != block_buffer_tail) {    
+  while(block_index != planned_index) {    
     block_index = prev_block_index( block_index );
     block[2]= block[1];
     block[1]= block[0];
     block[0] = &block_buffer[block_index];
-    planner_reverse_pass_kernel(block[0], block[1], block[2]);
+    if (!planner_reverse_pass_kernel(block[0], block[1], block[2]) && !replan_all) {
+      return(next_block_index(block_index));
+    }
   }
-  // Skip buffer tail/first block to prevent over-writing the initial entry speed.
+  // Skip the optimally planned block, which is at least the buffer tail/first block, to prevent
+  // over-writing its entry speed.
+  return(planned_index);
 }
 
 
@@ -155,15 +282,14 @@ static void planner_forward_pass_kernel(block_t *previous, block_t *current, blo
   // full speed change within the block, we need to adjust the entry speed accordingly. Entry
   // speeds have already been reset, maximized, and reverse planned by reverse planner.
   // If nominal length is true, max junction speed is guaranteed to be reached. No need to recheck.  
-  if (!previous->nominal_length_flag) {
-    if (previous->entry_speed < current->entry_speed) {
-      float entry_speed = min( current->entry_speed,
-        max_allowable_speed(-settings.acceleration,previous->entry_speed,previous->millimeters) );
+  if (bit_isfalse(previous->flags,BLOCK_FLAG_NOMINAL_LENGTH)) {
+    if (previous->entry_speed_sqr < current->entry_speed_sqr) {
+      float entry_speed_sqr = block_reachable_speed_sqr(previous, previous->entry_speed_sqr, current->entry_speed_sqr);
 
       // Check for junction speed change
-      if (current->entry_speed != entry_speed) {
-        current->entry_speed = entry_speed;
-        current->recalculate_flag = true;
+      if (current->entry_speed_sqr != entry_speed_sqr) {
+        current->entry_speed_sqr = entry_speed_sqr;
+        bit_true(current->flags,BLOCK_FLAG_RECALCULATE);
       }
     }    
   }
@@ -171,20 +297,36 @@ static void planner_forward_pass_kernel(block_t *previous, block_t *current, blo
 
 
 // planner_recalculate() needs to go over the current plan twice. Once in reverse and once forward. This 
-// implements the forward pass.
-static void planner_forward_pass() 
+// implements the forward pass. It also moves the optimally planned pointer forward: a block entered at
+// its maximum entry speed, or entered at the end of a full-length acceleration from an optimally planned
+// block, cannot be entered any faster no matter what blocks are added later. Neither can any block
+// before it.
+static void planner_forward_pass(uint8_t block_index) 
 {
-  uint8_t block_index = block_buffer_tail;
   block_t *block[3] = {NULL, NULL, NULL};
   
   while(block_index != block_buffer_head) {
     block[0] = block[1];
     block[1] = block[2];
     block[2] = &block_buffer[block_index];
-    planner_forward_pass_kernel(block[0],block[1],block[2]);
+    if (block[0]) {
+      float entry_speed_sqr = block[1]->entry_speed_sqr;
+      planner_forward_pass_kernel(block[0],block[1],block[2]);
+      if (block[1]->entry_speed_sqr < entry_speed_sqr || 
+          block[1]->entry_speed_sqr == block[1]->max_entry_speed_sqr) {
+        block_buffer_planned = prev_block_index(block_index);
+      }
+    }
     block_index = next_block_index( block_index );
   }
-  planner_forward_pass_kernel(block[1], block[2], NULL);
+  if (block[1]) {
+    float entry_speed_sqr = block[2]->entry_speed_sqr;
+    planner_forward_pass_kernel(block[1], block[2], NULL);
+    if (block[2]->entry_speed_sqr < entry_speed_sqr || 
+        block[2]->entry_speed_sqr == block[2]->max_entry_speed_sqr) {
+      block_buffer_planned = prev_block_index(block_index);
+    }
+  }
 }
 
 
@@ -196,36 +338,89 @@ static void planner_forward_pass()
                                    +-------------+                              
                                        time -->                                 
 */                                                                              
-// Calculates trapezoid parameters so that the entry- and exit-speed is compensated by the provided factors.
-// The factors represent a factor of braking and must be in the range 0.0-1.0.
+// Calculates trapezoid parameters for the provided entry and exit speeds (mm/min). An entry speed above 
+// the nominal speed, after the feed override was lowered, is first brought down to it.
 // This converts the planner parameters to the data required by the stepper controller.
 // NOTE: Final rates must be computed in terms of their respective blocks.
-static void calculate_trapezoid_for_block(block_t *block, float entry_factor, float exit_factor) 
+static void calculate_trapezoid_for_block(block_t *block, float entry_speed, float exit_speed) 
 {  
-  block->initial_rate = ceil(block->nominal_rate*entry_factor); // (step/min)
-  block->final_rate = ceil(block->nominal_rate*exit_factor); // (step/min)
-  int32_t acceleration_per_minute = block->rate_delta*ACCELERATION_TICKS_PER_SECOND*60.0; // (step/min^2)
-  int32_t accelerate_steps = 
-    ceil(estimate_acceleration_distance(block->initial_rate, block->nominal_rate, acceleration_per_minute));
-  int32_t decelerate_steps = 
-    floor(estimate_acceleration_distance(block->nominal_rate, block->final_rate, -acceleration_per_minute));
+  // A block replanned while it is being prepared only plans the rest of its step events.
+  uint16_t step_offset = 0;
+  if (block == &block_buffer[block_buffer_prep]) { step_offset = pl.prep_step_offset; }
+  int32_t step_event_count = block->step_event_count-step_offset;
+
+  block->initial_rate = ceil(entry_speed*block->step_events_per_mm); // (step/min)
+  block->final_rate = min(ceil(exit_speed*block->step_events_per_mm), 
+                          max(block->initial_rate, block->nominal_rate)); // (step/min)
+  int32_t accelerate_steps, decelerate_steps;
+  #ifndef PLANNER_FIXED_POINT
+    int32_t acceleration_per_minute = block->rate_delta*settings.acceleration_ticks*60.0; // (step/min^2)
+  #endif
+  if (settings.jerk > 0) { // S-curve phases
+    accelerate_steps = ceil(plan_scurve_steps(block, block->initial_rate, block->nominal_rate));
+    if (block->final_rate > block->nominal_rate) { decelerate_steps = step_event_count; }
+    else { decelerate_steps = ceil(plan_scurve_steps(block, block->nominal_rate, block->final_rate)); }
+  } else {
+  #ifdef PLANNER_FIXED_POINT
+    if (block->initial_rate > block->nominal_rate) {
+      accelerate_steps = fixed_acceleration_distance(block, block->nominal_rate, block->initial_rate, true);
+    } else {
+      accelerate_steps = fixed_acceleration_distance(block, block->initial_rate, block->nominal_rate, true);
+    }
+    if (block->final_rate > block->nominal_rate) { decelerate_steps = step_event_count; }
+    else { decelerate_steps = fixed_acceleration_distance(block, block->final_rate, block->nominal_rate, false); }
+  #else
+    accelerate_steps = ceil(estimate_acceleration_distance(min(block->initial_rate, block->nominal_rate), 
+                                                           max(block->initial_rate, block->nominal_rate), 
+                                                           acceleration_per_minute));
+    if (block->final_rate > block->nominal_rate) { decelerate_steps = step_event_count; }
+    else {
+      decelerate_steps = 
+        floor(estimate_acceleration_distance(block->nominal_rate, block->final_rate, -acceleration_per_minute));
+    }
+  #endif
+  }
     
   // Calculate the size of Plateau of Nominal Rate. 
-  int32_t plateau_steps = block->step_event_count-accelerate_steps-decelerate_steps;
+  int32_t plateau_steps = step_event_count-accelerate_steps-decelerate_steps;
   
   // Is the Plateau of Nominal Rate smaller than nothing? That means no cruising, and we will
   // have to use intersection_distance() to calculate when to abort acceleration and start braking 
   // in order to reach the final_rate exactly at the end of this block.
   if (plateau_steps < 0) {  
-    accelerate_steps = ceil(
-      intersection_distance(block->initial_rate, block->final_rate, acceleration_per_minute, block->step_event_count));
-    accelerate_steps = max(accelerate_steps,0); // Check limits due to numerical round-off
-    accelerate_steps = min(accelerate_steps,block->step_event_count);
+    if (block->initial_rate > block->nominal_rate) {
+      // Entered too fast to slow down to the nominal rate and still end at the final rate. Decelerate
+      // all the way.
+      accelerate_steps = 0;
+    } else if (settings.jerk > 0) {
+      // Accelerate to the highest rate the block can still decelerate from.
+      accelerate_steps = ceil(plan_scurve_steps(block, block->initial_rate, 
+                                                scurve_peak_rate(block, step_event_count)));
+      accelerate_steps = min(accelerate_steps,step_event_count);
+    } else {
+    #ifdef PLANNER_FIXED_POINT
+      // The intersection is half way along the block, offset by half the distance needed to change
+      // between the initial and final rates.
+      if (block->final_rate >= block->initial_rate) {
+        accelerate_steps = step_event_count + 
+          fixed_acceleration_distance(block, block->initial_rate, block->final_rate, true);
+      } else {
+        accelerate_steps = step_event_count - 
+          fixed_acceleration_distance(block, block->final_rate, block->initial_rate, false);
+      }
+      accelerate_steps = (accelerate_steps+1)/2;
+    #else
+      accelerate_steps = ceil(
+        intersection_distance(block->initial_rate, block->final_rate, acceleration_per_minute, step_event_count));
+    #endif
+      accelerate_steps = max(accelerate_steps,0); // Check limits due to numerical round-off
+      accelerate_steps = min(accelerate_steps,step_event_count);
+    }
     plateau_steps = 0;
   }  
   
-  block->accelerate_until = accelerate_steps;
-  block->decelerate_after = accelerate_steps+plateau_steps;
+  block->accelerate_until = step_offset+accelerate_steps;
+  block->decelerate_after = step_offset+accelerate_steps+plateau_steps;
 }     
 
 /*                            PLANNER SPEED DEFINITION                                              
@@ -237,39 +432,45 @@ static void calculate_trapezoid_for_block(block_t *block, float entry_factor, fl
                                        time -->                                 
 */                                                                              
 // Recalculates the trapezoid speed profiles for flagged blocks in the plan according to the 
-// entry_speed for each junction and the entry_speed of the next junction. Must be called by 
+// entry_speed_sqr for each junction and the entry_speed_sqr of the next junction. Must be called by 
 // planner_recalculate() after updating the blocks. Any recalulate flagged junction will
 // compute the two adjacent trapezoids to the junction, since the junction speed corresponds 
 // to exit speed and entry speed of one another.
-static void planner_recalculate_trapezoids() 
+static void planner_recalculate_trapezoids(uint8_t block_index) 
 {
-  uint8_t block_index = block_buffer_tail;
   block_t *current;
   block_t *next = NULL;
+  float entry_speed = -1.0; // Entry speed of the current block, if already known (>= 0)
+  float next_entry_speed;
   
   while(block_index != block_buffer_head) {
     current = next;
     next = &block_buffer[block_index];
     if (current) {
       // Recalculate if current block entry or exit junction speed has changed.
-      if (current->recalculate_flag || next->recalculate_flag) {
-        // NOTE: Entry and exit factors always > 0 by all previous logic operations.     
-        calculate_trapezoid_for_block(current, current->entry_speed/current->nominal_speed,
-          next->entry_speed/current->nominal_speed);      
-        current->recalculate_flag = false; // Reset current only to ensure next trapezoid is computed
+      if (bit_istrue((current->flags | next->flags),BLOCK_FLAG_RECALCULATE)) {
+        // The exit speed of this block is the entry speed of the next, so each square root is only
+        // taken once along a run of recalculated blocks.
+        if (entry_speed < 0.0) { entry_speed = sqrt(current->entry_speed_sqr); }
+        next_entry_speed = sqrt(next->entry_speed_sqr);
+        calculate_trapezoid_for_block(current, entry_speed, next_entry_speed);
+        bit_false(current->flags,BLOCK_FLAG_RECALCULATE); // Reset current only to ensure next trapezoid is computed
+        entry_speed = next_entry_speed;
+      } else {
+        entry_speed = -1.0;
       }
     }
     block_index = next_block_index( block_index );
   }
   // Last/newest block in buffer. Exit speed is set with MINIMUM_PLANNER_SPEED. Always recalculated.
-  calculate_trapezoid_for_block(next, next->entry_speed/next->nominal_speed,
-    MINIMUM_PLANNER_SPEED/next->nominal_speed);
-  next->recalculate_flag = false;
+  if (entry_speed < 0.0) { entry_speed = sqrt(next->entry_speed_sqr); }
+  calculate_trapezoid_for_block(next, entry_speed, MINIMUM_PLANNER_SPEED);
+  bit_false(next->flags,BLOCK_FLAG_RECALCULATE);
 }
 
 // Recalculates the motion plan according to the following algorithm:
 //
-//   1. Go over every block in reverse order and calculate a junction speed reduction (i.e. block_t.entry_speed) 
+//   1. Go over every block in reverse order and calculate a junction speed reduction (i.e. block_t.entry_speed_sqr) 
 //      so that:
 //     a. The junction speed is equal to or less than the maximum junction speed limit
 //     b. No speed reduction within one block requires faster deceleration than the one, true constant 
@@ -287,18 +488,118 @@ static void planner_recalculate_trapezoids()
 //
 // All planner computations are performed with doubles (float on Arduinos) to minimize numerical round-
 // off errors. Only when planned values are converted to stepper rate parameters, these are integers.
+// Junction speeds are kept squared, since constant acceleration makes the squared speed linear in
+// distance (v^2 = u^2 + 2*a*d). The passes then need no square roots at all. With a jerk limit ($29),
+// the speed changes take the longer S-curve phases instead, solved by bisection in block_reachable_speed_sqr(),
+// so each pass costs a few dozen square roots per block.
+//
+// Only the blocks after the optimally planned block (block_buffer_planned) are replanned, since the
+// entry speeds up to it can no longer change. The reverse pass also stops at the first block whose
+// entry speed comes out unchanged, and the forward pass and trapezoid update start from there. So
+// unless a new block raises the speeds of the whole buffer, as when the buffer is too short to reach
+// the feed rate, adding a block costs about the same whatever the BLOCK_BUFFER_SIZE.
 
 static void planner_recalculate() 
 {     
-  planner_reverse_pass();
-  planner_forward_pass();
-  planner_recalculate_trapezoids();
+  // The stepper interrupt may move the planned pointer forward meanwhile, if it discards that block.
+  uint8_t block_index = planner_reverse_pass(block_buffer_planned, false);
+  planner_forward_pass(block_index);
+  planner_recalculate_trapezoids(block_index);
+}
+
+// Returns the fastest speed of the block within the axis maximum rates (mm/min). The axis step counts
+// give its direction. Its step_event_count may be the remainder after a feed hold, so it is not used.
+static float block_max_speed(block_t *block)
+{
+  uint16_t steps[N_AXIS] = {block->steps_x, block->steps_y, block->steps_z};
+  uint16_t step_event_count = max(steps[X_AXIS], max(steps[Y_AXIS], steps[Z_AXIS]));
+  float max_speed = 0.0;
+  uint8_t idx;
+  for (idx=0; idx<N_AXIS; idx++) {
+    if (steps[idx]) {
+      // The axis maximum rate divided by the axis' share of the unit vector
+      float speed = settings.max_rate[idx]*settings.steps_per_mm[idx]*step_event_count/
+                    (steps[idx]*block->step_events_per_mm);
+      if (max_speed == 0.0 || speed < max_speed) { max_speed = speed; }
+    }
+  }
+  return(max_speed);
+}
+
+// Returns the nominal speed of the block with the feed override, or the rapid override for seek
+// motions, applied (mm/min)
+static float block_nominal_speed(block_t *block)
+{
+  if (bit_istrue(block->flags,BLOCK_FLAG_RAPID)) {
+    if (sys.rapid_override == 100) { return(block->nominal_speed); }
+    return(block->nominal_speed*(0.01*sys.rapid_override));
+  }
+  if (sys.feed_override == 100) { return(block->nominal_speed); }
+  float nominal_speed = block->nominal_speed*(0.01*sys.feed_override);
+  if (sys.feed_override > 100) { nominal_speed = min(nominal_speed, block_max_speed(block)); }
+  return(nominal_speed);
+}
+
+// Sets the step events of the prep block that come before its replanned remainder, and scales the 
+// block's speed change to the remainder.
+static void set_prep_step_offset(uint16_t step_offset)
+{
+  block_t *block = &block_buffer[block_buffer_prep];
+  block->delta_speed_sqr *= (float)(block->step_event_count-step_offset)/
+                            (block->step_event_count-pl.prep_step_offset);
+  pl.prep_step_offset = step_offset;
+}
+
+// Recomputes the nominal and maximum entry speeds of the blocks from the prep block on for the feed
+// and rapid overrides, and replans them all. The prep block keeps its entry speed. No later block may be planned
+// to enter slower than full deceleration from it allows, so entry speeds can exceed a lowered nominal
+// speed for a while. Those blocks slow down to it first.
+static void planner_replan_speeds()
+{
+  uint8_t block_index = block_buffer_prep;
+  block_t *block = &block_buffer[block_index];
+  float min_entry_speed_sqr = block->entry_speed_sqr; // The slowest entry speed the next block allows
+  float previous_nominal_speed_sqr = 0.0;
+  do {
+    float nominal_speed = block_nominal_speed(block);
+    float nominal_speed_sqr = nominal_speed*nominal_speed;
+    block->nominal_rate = ceil(nominal_speed*block->step_events_per_mm);
+    if (block_index != block_buffer_prep) {
+      block->max_entry_speed_sqr = max(min_entry_speed_sqr, min(block->max_junction_speed_sqr, 
+                                       min(nominal_speed_sqr, previous_nominal_speed_sqr)));
+    }
+    float v_allowable_sqr = block_reachable_speed_sqr(block, MINIMUM_PLANNER_SPEED*MINIMUM_PLANNER_SPEED,
+                                                      max(nominal_speed_sqr, block->max_entry_speed_sqr));
+    if (block_index != block_buffer_prep) {
+      // Start the reverse pass from the entry speed of a new block.
+      block->entry_speed_sqr = min(block->max_entry_speed_sqr, v_allowable_sqr);
+    }
+    bit_false(block->flags,BLOCK_FLAG_NOMINAL_LENGTH);
+    bit_true(block->flags,BLOCK_FLAG_RECALCULATE);
+    if (max(nominal_speed_sqr, block->max_entry_speed_sqr) <= v_allowable_sqr) { 
+      bit_true(block->flags,BLOCK_FLAG_NOMINAL_LENGTH); 
+    }
+    min_entry_speed_sqr = block_reachable_speed_sqr(block, min_entry_speed_sqr, 0.0);
+    previous_nominal_speed_sqr = nominal_speed_sqr;
+    block_index = next_block_index(block_index);
+    block = &block_buffer[block_index];
+  } while (block_index != block_buffer_head);
+  // The next block joins the last one at its new nominal speed. Unless it is flagged to stop there.
+  if (pl.previous_nominal_speed_sqr > 0.0) { pl.previous_nominal_speed_sqr = previous_nominal_speed_sqr; }
+  
+  block_buffer_planned = block_buffer_prep;
+  planner_reverse_pass(block_buffer_prep, true);
+  planner_forward_pass(block_buffer_prep);
+  planner_recalculate_trapezoids(block_buffer_prep);
 }
 
 void plan_reset_buffer() 
 {
   block_buffer_tail = block_buffer_head;
+  block_buffer_planned = block_buffer_tail;
+  block_buffer_prep = block_buffer_tail;
   next_buffer_head = next_block_index(block_buffer_head);
+  pl.prep_step_offset = 0;
 }
 
 void plan_init() 
@@ -310,7 +611,10 @@ void plan_init()
 inline void plan_discard_current_block() 
 {
   if (block_buffer_head != block_buffer_tail) {
-    block_buffer_tail = next_block_index( block_buffer_tail );
+    uint8_t block_index = next_block_index( block_buffer_tail );
+    // Push the planned pointer forward with the tail, so it never points at a discarded block.
+    if (block_buffer_tail == block_buffer_planned) { block_buffer_planned = block_index; }
+    block_buffer_tail = block_index;
   }
 }
 
@@ -320,6 +624,26 @@ inline block_t *plan_get_current_block()
   return(&block_buffer[block_buffer_tail]);
 }
 
+// Gets the block the stepper segment generator prepares next, which may be ahead of the current block.
+// Its entry speed is fixed from here on. Returns NULL if all buffered blocks have been prepared.
+block_t *plan_get_prep_block()
+{
+  if (block_buffer_head == block_buffer_prep) { return(NULL); }
+  return(&block_buffer[block_buffer_prep]);
+}
+
+// Called when the stepper segment generator has prepared all of the prep block.
+void plan_discard_prep_block()
+{
+  if (block_buffer_head != block_buffer_prep) {
+    uint8_t block_index = next_block_index( block_buffer_prep );
+    if (pl.prep_step_offset) { set_prep_step_offset(0); } // Restore for a replan after a feed hold
+    // The next block is about to be prepared: stop the planner from changing its entry speed.
+    if (block_buffer_prep == block_buffer_planned) { block_buffer_planned = block_index; }
+    block_buffer_prep = block_index;
+  }
+}
+
 // Returns the availability status of the block ring buffer. True, if full.
 uint8_t plan_check_full_buffer()
 {
@@ -327,6 +651,14 @@ uint8_t plan_check_full_buffer()
   return(false);
 }
 
+// Returns the number of blocks that can be added before the block ring buffer is full.
+uint8_t plan_get_block_buffer_available()
+{
+  uint8_t tail = block_buffer_tail; // Copy, as the stepper may move it
+  if (block_buffer_head >= tail) { return((BLOCK_BUFFER_SIZE-1)-(block_buffer_head-tail)); }
+  return((tail-block_buffer_head)-1);
+}
+
 // Block until all buffered steps are executed.
 void plan_synchronize()
 {
@@ -341,11 +673,20 @@ void plan_synchronize()
 // rate is taken to mean "frequency" and would complete the operation in 1/feed_rate minutes.
 // All position data passed to the planner must be in terms of machine position to keep the planner 
 // independent of any coordinate system changes and offsets, which are handled by the g-code parser.
+// Lines with more step events than a block can hold are split into the fewest equal parts that fit.
+// Only the first part is buffered and false is returned; the caller calls again with the same line
+// for the next part, once there is room in the buffer.
 // NOTE: Assumes buffer is available. Buffer checks are handled at a higher level by motion_control.
-void plan_buffer_line(float x, float y, float z, float feed_rate, uint8_t invert_feed_rate) 
+uint8_t plan_buffer_line(float x, float y, float z, float feed_rate, uint8_t invert_feed_rate) 
 {
   // Prepare to set up new block
   block_t *block = &block_buffer[block_buffer_head];
+  block->spindle_direction = spindle_queued_direction();
+  block->flags = 0;
+  if (feed_rate < 0.0) {
+    block->flags = BLOCK_FLAG_RAPID;
+    feed_rate = -feed_rate;
+  }
 
   // Calculate target position in absolute steps
   int32_t target[3];
@@ -353,6 +694,31 @@ void plan_buffer_line(float x, float y, float z, float feed_rate, uint8_t invert
   target[Y_AXIS] = lround(y*settings.steps_per_mm[Y_AXIS]);
   target[Z_AXIS] = lround(z*settings.steps_per_mm[Z_AXIS]);     
 
+  // Split lines too long for a block. Truncating each axis keeps the first part within the limit,
+  // and the line still ends exactly on its own target.
+  uint8_t line_complete = true;
+  uint32_t step_event_count = max(labs(target[X_AXIS]-pl.position[X_AXIS]), 
+    max(labs(target[Y_AXIS]-pl.position[Y_AXIS]), labs(target[Z_AXIS]-pl.position[Z_AXIS])));
+  if (step_event_count > MAX_STEP_EVENTS_PER_BLOCK) {
+    uint16_t parts = (step_event_count-1)/MAX_STEP_EVENTS_PER_BLOCK + 1;
+    uint8_t idx;
+    float line_mm_sqr = 0.0;
+    for (idx=0; idx<N_AXIS; idx++) {
+      float delta_mm = (target[idx]-pl.position[idx])/settings.steps_per_mm[idx];
+      line_mm_sqr += delta_mm*delta_mm;
+      target[idx] = pl.position[idx] + (target[idx]-pl.position[idx])/parts;
+    }
+    // Inverse time applies to the whole line. Keep its speed for the parts still to come, which are
+    // requested with the same, no longer whole, line.
+    if (invert_feed_rate && pl.split_feed_rate == 0.0) { pl.split_feed_rate = sqrt(line_mm_sqr)*feed_rate; }
+    line_complete = false;
+  }
+  if (invert_feed_rate && pl.split_feed_rate > 0.0) {
+    feed_rate = pl.split_feed_rate;
+    invert_feed_rate = false;
+    if (line_complete) { pl.split_feed_rate = 0.0; }
+  }
+
   // Compute direction bits for this block
   block->direction_bits = 0;
   if (target[X_AXIS] < pl.position[X_AXIS]) { block->direction_bits |= (1<<X_DIRECTION_BIT); }
@@ -366,16 +732,24 @@ void plan_buffer_line(float x, float y, float z, float feed_rate, uint8_t invert
   block->step_event_count = max(block->steps_x, max(block->steps_y, block->steps_z));
 
   // Bail if this is a zero-length block
-  if (block->step_event_count == 0) { return; };
+  if (block->step_event_count == 0) { return(true); };
   
   // Compute path vector in terms of absolute step target and current positions
   float delta_mm[3];
   delta_mm[X_AXIS] = (target[X_AXIS]-pl.position[X_AXIS])/settings.steps_per_mm[X_AXIS];
   delta_mm[Y_AXIS] = (target[Y_AXIS]-pl.position[Y_AXIS])/settings.steps_per_mm[Y_AXIS];
   delta_mm[Z_AXIS] = (target[Z_AXIS]-pl.position[Z_AXIS])/settings.steps_per_mm[Z_AXIS];
-  block->millimeters = sqrt(delta_mm[X_AXIS]*delta_mm[X_AXIS] + delta_mm[Y_AXIS]*delta_mm[Y_AXIS] + 
-                            delta_mm[Z_AXIS]*delta_mm[Z_AXIS]);
-  float inverse_millimeters = 1.0/block->millimeters;  // Inverse millimeters to remove multiple divides	
+  float millimeters = sqrt(delta_mm[X_AXIS]*delta_mm[X_AXIS] + delta_mm[Y_AXIS]*delta_mm[Y_AXIS] + 
+                           delta_mm[Z_AXIS]*delta_mm[Z_AXIS]);
+  float inverse_millimeters = 1.0/millimeters;  // Inverse millimeters to remove multiple divides	
+  block->step_events_per_mm = block->step_event_count*inverse_millimeters;
+
+  // Compute path unit vector                            
+  float unit_vec[3];
+
+  unit_vec[X_AXIS] = delta_mm[X_AXIS]*inverse_millimeters;
+  unit_vec[Y_AXIS] = delta_mm[Y_AXIS]*inverse_millimeters;
+  unit_vec[Z_AXIS] = delta_mm[Z_AXIS]*inverse_millimeters;  
   
   // Calculate speed in mm/minute for each axis. No divide by zero due to previous checks.
   // NOTE: Minimum stepper speed is limited by MINIMUM_STEPS_PER_MINUTE in stepper.c
@@ -385,7 +759,29 @@ void plan_buffer_line(float x, float y, float z, float feed_rate, uint8_t invert
   } else {
     inverse_minute = 1.0 / feed_rate;
   }
-  block->nominal_speed = block->millimeters * inverse_minute; // (mm/min) Always > 0
+  
+  // Limit the path speed and acceleration so that no axis exceeds its own maximum rate or 
+  // acceleration. An axis limit applies to the path divided by that axis' share of the unit vector,
+  // so a slow Z axis only restricts the blocks that actually move Z.
+  float nominal_speed = millimeters * inverse_minute; // (mm/min) Always > 0
+  float acceleration = settings.acceleration; // (mm/min^2)
+  uint8_t idx;
+  for (idx=0; idx<N_AXIS; idx++) {
+    if (unit_vec[idx] != 0) {
+      float inverse_unit_vec_value = fabs(1.0/unit_vec[idx]);
+      if (nominal_speed > settings.max_rate[idx]*inverse_unit_vec_value) {
+        nominal_speed = settings.max_rate[idx]*inverse_unit_vec_value;
+        inverse_minute = nominal_speed * inverse_millimeters;
+      }
+      acceleration = min(acceleration, settings.max_acceleration[idx]*inverse_unit_vec_value);
+    }
+  }
+  block->nominal_speed = nominal_speed;
+  if (sys.feed_override != 100 || sys.rapid_override != 100) {
+    nominal_speed = block_nominal_speed(block);
+    inverse_minute = nominal_speed * inverse_millimeters;
+  }
+  float nominal_speed_sqr = nominal_speed*nominal_speed;
   block->nominal_rate = ceil(block->step_event_count * inverse_minute); // (step/min) Always > 0
   
   // Compute the acceleration rate for the trapezoid generator. Depending on the slope of the line
@@ -394,16 +790,21 @@ void plan_buffer_line(float x, float y, float z, float feed_rate, uint8_t invert
   // axes might step for every step event. Travel per step event is then sqrt(travel_x^2+travel_y^2).
   // To generate trapezoids with contant acceleration between blocks the rate_delta must be computed 
   // specifically for each line to compensate for this phenomenon:
-  // Convert universal acceleration for direction-dependent stepper rate change parameter
-  block->rate_delta = ceil( block->step_event_count*inverse_millimeters *  
-        settings.acceleration / (60 * ACCELERATION_TICKS_PER_SECOND )); // (step/min/acceleration_tick)
-
-  // Compute path unit vector                            
-  float unit_vec[3];
-
-  unit_vec[X_AXIS] = delta_mm[X_AXIS]*inverse_millimeters;
-  unit_vec[Y_AXIS] = delta_mm[Y_AXIS]*inverse_millimeters;
-  unit_vec[Z_AXIS] = delta_mm[Z_AXIS]*inverse_millimeters;  
+  // Convert path acceleration for direction-dependent stepper rate change parameter
+  block->rate_delta = ceil( block->step_events_per_mm *  
+        acceleration / (60 * settings.acceleration_ticks)); // (step/min/acceleration_tick)
+  // Largest change of speed^2 within the block (v^2 = v0^2 + 2*a*d). The reverse and forward passes 
+  // work with squared speeds throughout, so this is all they need of acceleration and length.
+  block->delta_speed_sqr = 2*acceleration*millimeters; // (mm/min)^2
+  #ifdef PLANNER_FIXED_POINT
+    // Reciprocal of twice the acceleration (step/min^2) for the fixed-point trapezoid generator, 
+    // normalized to 2^30..2^31. Taken once here; trapezoids are recalculated many times per block.
+    // It is a float, as double is on the AVR, so only its top 24 of 31 bits are significant.
+    int exponent;
+    float mantissa = frexp(2.0*block->rate_delta*settings.acceleration_ticks*60, &exponent);
+    block->acceleration_inverse = ldexp((float)(1.0/mantissa), 30);
+    block->acceleration_shift = exponent+30;
+  #endif
 
   // Compute maximum allowable entry speed at junction by centripetal acceleration approximation.
   // Let a circle be tangent to both previous and current path line segments, where the junction 
@@ -420,10 +821,12 @@ void plan_buffer_line(float x, float y, float z, float feed_rate, uint8_t invert
   // will just need to follow the arc circle defined above and check if the arc radii are no longer
   // than half of either line segment to ensure no overlapping. Right now, the Arduino likely doesn't
   // have the horsepower to do these calculations at high feed rates.
-  float vmax_junction = MINIMUM_PLANNER_SPEED; // Set default max junction speed
+  // The junction speed limit of the path angle alone is kept, to apply to changed nominal speeds.
+  float vmax_junction_sqr = MINIMUM_PLANNER_SPEED*MINIMUM_PLANNER_SPEED; // Set default max junction speed
+  block->max_junction_speed_sqr = vmax_junction_sqr;
 
-  // Skip first block or when previous_nominal_speed is used as a flag for homing and offset cycles.
-  if ((block_buffer_head != block_buffer_tail) && (pl.previous_nominal_speed > 0.0)) {
+  // Skip first block or when previous_nominal_speed_sqr is used as a flag for homing and offset cycles.
+  if ((block_buffer_head != block_buffer_tail) && (pl.previous_nominal_speed_sqr > 0.0)) {
     // Compute cosine of angle between previous and current path. (prev_unit_vec is negative)
     // NOTE: Max junction velocity is computed without sin() or acos() by trig half angle identity.
     float cos_theta = - pl.previous_unit_vec[X_AXIS] * unit_vec[X_AXIS] 
@@ -432,21 +835,24 @@ void plan_buffer_line(float x, float y, float z, float feed_rate, uint8_t invert
                          
     // Skip and use default max junction speed for 0 degree acute junction.
     if (cos_theta < 0.95) {
-      vmax_junction = min(pl.previous_nominal_speed,block->nominal_speed);
+      vmax_junction_sqr = min(pl.previous_nominal_speed_sqr,nominal_speed_sqr);
+      block->max_junction_speed_sqr = SOME_LARGE_VALUE;
       // Skip and avoid divide by zero for straight junctions at 180 degrees. Limit to min() of nominal speeds.
       if (cos_theta > -0.95) {
         // Compute maximum junction velocity based on maximum acceleration and junction deviation
         float sin_theta_d2 = sqrt(0.5*(1.0-cos_theta)); // Trig half angle identity. Always positive.
-        vmax_junction = min(vmax_junction,
-          sqrt(settings.acceleration * settings.junction_deviation * sin_theta_d2/(1.0-sin_theta_d2)) );
+        block->max_junction_speed_sqr =
+          acceleration * settings.junction_deviation * sin_theta_d2/(1.0-sin_theta_d2);
+        vmax_junction_sqr = min(vmax_junction_sqr, block->max_junction_speed_sqr);
       }
     }
   }
-  block->max_entry_speed = vmax_junction;
+  block->max_entry_speed_sqr = vmax_junction_sqr;
   
   // Initialize block entry speed. Compute based on deceleration to user-defined MINIMUM_PLANNER_SPEED.
-  float v_allowable = max_allowable_speed(-settings.acceleration,MINIMUM_PLANNER_SPEED,block->millimeters);
-  block->entry_speed = min(vmax_junction, v_allowable);
+  float v_allowable_sqr = block_reachable_speed_sqr(block, MINIMUM_PLANNER_SPEED*MINIMUM_PLANNER_SPEED, 
+                                                    max(nominal_speed_sqr, vmax_junction_sqr));
+  block->entry_speed_sqr = min(vmax_junction_sqr, v_allowable_sqr);
 
   // Initialize planner efficiency flags
   // Set flag if block will always reach maximum junction speed regardless of entry/exit speeds.
@@ -456,13 +862,12 @@ void plan_buffer_line(float x, float y, float z, float feed_rate, uint8_t invert
   // block nominal speed limits both the current and next maximum junction speeds. Hence, in both
   // the reverse and forward planners, the corresponding block junction speed will always be at the
   // the maximum junction speed and may always be ignored for any speed reduction checks.
-  if (block->nominal_speed <= v_allowable) { block->nominal_length_flag = true; }
-  else { block->nominal_length_flag = false; }
-  block->recalculate_flag = true; // Always calculate trapezoid for new block
+  block->flags |= BLOCK_FLAG_RECALCULATE; // Always calculate trapezoid for new block
+  if (nominal_speed_sqr <= v_allowable_sqr) { block->flags |= BLOCK_FLAG_NOMINAL_LENGTH; }
 
   // Update previous path unit_vector and nominal speed
   memcpy(pl.previous_unit_vec, unit_vec, sizeof(unit_vec)); // pl.previous_unit_vec[] = unit_vec[]
-  pl.previous_nominal_speed = block->nominal_speed;
+  pl.previous_nominal_speed_sqr = nominal_speed_sqr;
   
   // Update buffer head and next buffer head indices
   block_buffer_head = next_buffer_head;  
@@ -472,6 +877,7 @@ void plan_buffer_line(float x, float y, float z, float feed_rate, uint8_t invert
   memcpy(pl.position, target, sizeof(target)); // pl.position[] = target[]
 
   planner_recalculate(); 
+  return(line_complete);
 }
 
 // Reset the planner position vector (in steps). Called by the system abort routine.
@@ -486,18 +892,34 @@ void plan_set_current_position(int32_t x, int32_t y, int32_t z)
 // Called after a steppers have come to a complete stop for a feed hold and the cycle is stopped.
 void plan_cycle_reinitialize(int32_t step_events_remaining) 
 {
+  if (pl.prep_step_offset) { set_prep_step_offset(0); } // The whole prep block is replanned.
   block_t *block = &block_buffer[block_buffer_tail]; // Point to partially completed block
   
-  // Only remaining millimeters and step_event_count need to be updated for planner recalculate. 
+  // Only the remaining speed change and step_event_count need to be updated for planner recalculate. 
   // Other variables (step_x, step_y, step_z, rate_delta, etc.) all need to remain the same to
   // ensure the original planned motion is resumed exactly.
-  block->millimeters = (block->millimeters*step_events_remaining)/block->step_event_count;
+  block->delta_speed_sqr = (block->delta_speed_sqr*step_events_remaining)/block->step_event_count;
   block->step_event_count = step_events_remaining;
   
-  // Re-plan from a complete stop. Reset planner entry speeds and flags.
-  block->entry_speed = 0.0;
-  block->max_entry_speed = 0.0;
-  block->nominal_length_flag = false;
-  block->recalculate_flag = true;
-  planner_recalculate();  
+  // Re-plan from a complete stop. Reset planner entry speeds. The overrides may have changed 
+  // during the feed hold, so the nominal speeds are updated as well.
+  block->entry_speed_sqr = 0.0;
+  block->max_entry_speed_sqr = 0.0;
+  block_buffer_prep = block_buffer_tail;
+  planner_replan_speeds();
+}
+
+// Applies a changed feed or rapid override to the buffered blocks and replans them. If the block being prepared
+// by the stepper segment generator has started, the rest of it is replanned from the given step event,
+// entered at the given rate (step/min). Called by the stepper subsystem.
+void plan_update_overrides(uint16_t step_events_completed, uint32_t rate)
+{
+  if (block_buffer_prep == block_buffer_head) { return; } // All buffered blocks are prepared
+  if (step_events_completed) {
+    block_t *block = &block_buffer[block_buffer_prep];
+    set_prep_step_offset(step_events_completed);
+    float entry_speed = rate/block->step_events_per_mm;
+    block->entry_speed_sqr = entry_speed*entry_speed;
+  }
+  planner_replan_speeds();
 }
@@ -21,37 +21,56 @@
 
 #ifndef planner_h
 #define planner_h
+
+#include "config.h"
+#include "nuts_bolts.h"
                  
 // The number of linear motions that can be in the plan at any give time
 #ifndef BLOCK_BUFFER_SIZE
-  #define BLOCK_BUFFER_SIZE 18
+  #define BLOCK_BUFFER_SIZE 20
 #endif
 
+// The largest number of step events in a block. Longer lines are split by plan_buffer_line().
+#define MAX_STEP_EVENTS_PER_BLOCK 0xffff
+
+// Define bit flag masks for block_t.flags
+#define BLOCK_FLAG_RECALCULATE     bit(0) // Planner flag to recalculate trapezoids on entry junction
+#define BLOCK_FLAG_NOMINAL_LENGTH  bit(1) // Planner flag for nominal speed always reached
+#define BLOCK_FLAG_RAPID           bit(2) // Seek motion. Scaled by the rapid override, not the feed override.
+
 // This struct is used when buffering the setup for each linear movement "nominal" values are as specified in 
 // the source g-code and may never actually be reached if acceleration management is active.
+// NOTE: The block buffer is most of Grbl's RAM, so only what cannot be cheaply derived is kept, in the
+// narrowest type its range allows. Run 'make ram' to see the resulting RAM use.
 typedef struct {
 
-  // Fields used by the bresenham algorithm for tracing the line
+  // Fields read by the stepper interrupt. Fields used by the bresenham algorithm for tracing the line
   uint8_t  direction_bits;            // The direction bit set for this block (refers to *_DIRECTION_BIT in config.h)
-  uint32_t steps_x, steps_y, steps_z; // Step count along each axis
-  int32_t  step_event_count;          // The number of step events required to complete this block
-
-  // Fields used by the motion planner to manage acceleration
-  float nominal_speed;               // The nominal speed for this block in mm/min  
-  float entry_speed;                 // Entry speed at previous-current block junction in mm/min
-  float max_entry_speed;             // Maximum allowable junction entry speed in mm/min
-  float millimeters;                 // The total travel of this block in mm
-  uint8_t recalculate_flag;           // Planner flag to recalculate trapezoids on entry junction
-  uint8_t nominal_length_flag;        // Planner flag for nominal speed always reached
+  uint16_t steps_x, steps_y, steps_z; // Step count along each axis
+  uint16_t step_event_count;          // The number of step events required to complete this block
+  int8_t spindle_direction;           // Spindle state while this block runs. 1, -1, 0 for M3, M4, M5
 
   // Settings for the trapezoid generator
   uint32_t initial_rate;              // The step rate at start of block  
   uint32_t final_rate;                // The step rate at end of block
   int32_t rate_delta;                 // The steps/minute to add or subtract when changing speed (must be positive)
-  uint32_t accelerate_until;          // The index of the step event on which to stop acceleration
-  uint32_t decelerate_after;          // The index of the step event on which to start decelerating
+  uint16_t accelerate_until;          // The index of the step event on which to stop acceleration
+  uint16_t decelerate_after;          // The index of the step event on which to start decelerating
   uint32_t nominal_rate;              // The nominal step rate for this block in step_events/minute
 
+  // Fields used only by the motion planner to manage acceleration
+  float entry_speed_sqr;             // Entry speed at previous-current block junction in (mm/min)^2
+  float max_entry_speed_sqr;         // Maximum allowable junction entry speed in (mm/min)^2
+  float max_junction_speed_sqr;      // Junction speed limit of the path angle alone in (mm/min)^2
+  float nominal_speed;               // Nominal speed without the feed or rapid override in mm/min
+  float delta_speed_sqr;             // Change of speed^2 over the whole block at full acceleration in (mm/min)^2
+  float step_events_per_mm;          // Converts speeds to step rates for the trapezoid generator
+  uint8_t flags;                     // Planner flags (BLOCK_FLAG_*)
+  #ifdef PLANNER_FIXED_POINT
+    uint32_t acceleration_inverse;    // 2^acceleration_shift/(2*acceleration), acceleration in step/min^2
+    uint8_t acceleration_shift;
+  #endif
+
 } block_t;
       
 // Initialize the motion plan subsystem      
@@ -60,7 +79,10 @@ void plan_init();
 // Add a new linear movement to the buffer. x, y and z is the signed, absolute target position in 
 // millimaters. Feed rate specifies the speed of the motion. If feed rate is inverted, the feed
 // rate is taken to mean "frequency" and would complete the operation in 1/feed_rate minutes.
-void plan_buffer_line(float x, float y, float z, float feed_rate, uint8_t invert_feed_rate);
+// A negative feed rate marks a seek (rapid) motion at its absolute value.
+// Lines with more than MAX_STEP_EVENTS_PER_BLOCK step events are split into equal parts, one per call:
+// returns false if only the first part was buffered, so the caller must call again with the same line.
+uint8_t plan_buffer_line(float x, float y, float z, float feed_rate, uint8_t invert_feed_rate);
 
 // Called when the current block is no longer needed. Discards the block and makes the memory
 // availible for new blocks.
@@ -69,19 +91,41 @@ void plan_discard_current_block();
 // Gets the current block. Returns NULL if buffer empty
 block_t *plan_get_current_block();
 
+// Gets the next block for the stepper segment generator. Returns NULL if there is none
+block_t *plan_get_prep_block();
+
+// Called when the stepper segment generator is done with its block
+void plan_discard_prep_block();
+
 // Reset the planner position vector (in steps)
 void plan_set_current_position(int32_t x, int32_t y, int32_t z);
 
 // Reinitialize plan with a partially completed block
 void plan_cycle_reinitialize(int32_t step_events_remaining);
 
+// Applies a changed feed or rapid override to the buffered blocks and replans them. The block being prepared 
+// continues at the given rate (step/min) from its given step event, if it has started.
+void plan_update_overrides(uint16_t step_events_completed, uint32_t rate);
+
 // Reset buffer
 void plan_reset_buffer();
 
 // Returns the status of the block ring buffer. True, if buffer is full.
 uint8_t plan_check_full_buffer();
 
+// Returns the number of blocks that can be added before the buffer is full.
+uint8_t plan_get_block_buffer_available();
+
 // Block until all buffered steps are executed
 void plan_synchronize();
 
+// Returns the block's jerk limit ($29) in step/min per acceleration tick squared.
+float plan_scurve_jerk(block_t *block);
+
+// Returns the steps an S-curve phase of the block takes to change between two step rates (step/min).
+float plan_scurve_steps(block_t *block, float rate_a, float rate_b);
+
+// Returns the step rate nearest to limit that an S-curve phase of the block reaches from rate within steps.
+float plan_scurve_reachable_rate(block_t *block, float rate, float limit, float steps);
+
 #endif
@@ -21,6 +21,9 @@
 
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <util/crc16.h>
+#include <math.h>
+#include <string.h>
 #include "protocol.h"
 #include "gcode.h"
 #include "serial.h"
@@ -31,16 +34,42 @@
 #include "stepper.h"
 #include "report.h"
 #include "motion_control.h"
+#include "spindle_control.h"
 
-static char line[LINE_BUFFER_SIZE]; // Line to be executed. Zero-terminated.
-static uint8_t char_counter; // Last character counter in line variable.
+// Startup lines are parsed from strings the size of LINE_BUFFER_SIZE, with the same read buffer 
+// indexing as streamed lines, which must not wrap around for them.
+#if RX_BUFFER_SIZE < LINE_BUFFER_SIZE
+  #error "RX_BUFFER_SIZE must not be smaller than LINE_BUFFER_SIZE"
+#endif
+#if RX_BUFFER_SIZE < FRAME_MAX_LENGTH+4
+  #error "RX_BUFFER_SIZE too small to hold a binary frame"
+#endif
+
+// Read buffer count at which a line without an end of line is too long, as no more of it comes in.
+#ifdef ENABLE_XONXOFF
+  #define LINE_OVERFLOW_COUNT RX_BUFFER_FULL // Flow control holds the host back
+#else
+  #define LINE_OVERFLOW_COUNT (RX_BUFFER_SIZE-1) // Read buffer full
+#endif
+
+// The line being received is filtered in place in the serial read buffer, where it starts at
+// the read buffer tail. Filtering only ever drops characters, so the filtered line never overtakes
+// the characters still to be filtered.
+static uint8_t scan; // Read buffer index of the next character to be filtered.
+static uint8_t line_end; // Read buffer index following the last character of the filtered line.
 static uint8_t iscomment; // Comment/block delete flag for processor to ignore comment characters.
+static uint8_t line_pending; // Complete line waiting for the arc in progress to be fully queued.
+static uint8_t isframe; // Binary frame flag. The frame starts at the read buffer tail.
+static uint8_t isoverflow; // Line too long flag. Its characters are thrown away up to the end of line.
 
 
 void protocol_init() 
 {
-  char_counter = 0; // Reset line input
+  scan = line_end = rx_buffer_tail; // Reset line input
   iscomment = false;
+  line_pending = false;
+  isframe = false;
+  isoverflow = false;
   report_init_message(); // Welcome message   
   
   PINOUT_DDR &= ~(PINOUT_MASK); // Set as input pins
@@ -52,6 +81,7 @@ void protocol_init()
 // Executes user startup script, if stored.
 void protocol_execute_startup() 
 {
+  char line[LINE_BUFFER_SIZE];
   uint8_t n;
   for (n=0; n < N_STARTUP_LINE; n++) {
     if (!(settings_read_startup_line(n, line))) {
@@ -59,7 +89,7 @@ void protocol_execute_startup()
     } else {
       if (line[0] != 0) {
         printString(line); // Echo startup line to indicate execution.
-        report_status_message(gc_execute_line(line));
+        report_status_message(gc_execute_line(line,0));
       }
     } 
   }  
@@ -138,6 +168,12 @@ void protocol_execute_runtime()
       bit_false(sys.execute,EXEC_STATUS_REPORT);
     }
     
+    // Serial print the buffer state only
+    if (rt_exec & EXEC_BUFFER_REPORT) { 
+      report_buffer_state();
+      bit_false(sys.execute,EXEC_BUFFER_REPORT);
+    }
+    
     // Initiate stepper feed hold
     if (rt_exec & EXEC_FEED_HOLD) {
       st_feed_hold(); // Initiate feed hold.
@@ -160,8 +196,34 @@ void protocol_execute_runtime()
     }
   }
   
-  // Overrides flag byte (sys.override) and execution should be installed here, since they 
-  // are runtime and require a direct and controlled interface to the main stepper program.
+  // Execute feed rate and rapid override changes. The flags are only accumulated into the override 
+  // values here, so the motions are replanned once however many override commands arrived meanwhile.
+  if (sys.override) {
+    uint8_t rt_override = sys.override; // Avoid calling volatile multiple times
+    int16_t feed_override = sys.feed_override;
+    if (rt_override & OVERRIDE_FEED_RESET) { feed_override = 100; }
+    if (rt_override & OVERRIDE_FEED_COARSE_PLUS) { feed_override += FEED_OVERRIDE_COARSE_INCREMENT; }
+    if (rt_override & OVERRIDE_FEED_COARSE_MINUS) { feed_override -= FEED_OVERRIDE_COARSE_INCREMENT; }
+    if (rt_override & OVERRIDE_FEED_FINE_PLUS) { feed_override += FEED_OVERRIDE_FINE_INCREMENT; }
+    if (rt_override & OVERRIDE_FEED_FINE_MINUS) { feed_override -= FEED_OVERRIDE_FINE_INCREMENT; }
+    feed_override = min(max(feed_override, MIN_FEED_RATE_OVERRIDE), MAX_FEED_RATE_OVERRIDE);
+    uint8_t rapid_override = sys.rapid_override;
+    if (rt_override & OVERRIDE_RAPID_RESET) { rapid_override = 100; }
+    if (rt_override & OVERRIDE_RAPID_MEDIUM) { rapid_override = RAPID_OVERRIDE_MEDIUM; }
+    if (rt_override & OVERRIDE_RAPID_LOW) { rapid_override = RAPID_OVERRIDE_LOW; }
+    bit_false(sys.override, rt_override);
+    if (feed_override != sys.feed_override || rapid_override != sys.rapid_override) {
+      sys.feed_override = feed_override;
+      sys.rapid_override = rapid_override;
+      st_update_overrides();
+    }
+  }
+
+  // Keep the stepper interrupt supplied with step segments.
+  if (sys.state == STATE_CYCLE || sys.state == STATE_HOLD) { st_prep_buffer(); }
+  
+  // Write the spindle changes of the blocks the stepper interrupt has started.
+  spindle_execute();
 }  
 
 
@@ -173,30 +235,43 @@ void protocol_execute_runtime()
 // the lines that are processed afterward, not necessarily real-time during a cycle, 
 // since there are motions already stored in the buffer. However, this 'lag' should not
 // be an issue, since these commands are not typically used during a cycle.
-uint8_t protocol_execute_line(char *line) 
+// NOTE: The line begins at index start and may wrap around the end of the serial read buffer.
+uint8_t protocol_execute_line(char *line, uint8_t start) 
 {   
   // Grbl internal command and parameter lines are of the form '$4=374.3' or '$' for help  
-  if(line[0] == '$') {
+  if(line[start] == '$') {
+    // Queue an arc or line the motion control still holds first. It was acknowledged with the
+    // g-code before this and must run as it was given, not be dropped by check mode or converted
+    // with settings changed after it.
+    mc_arc_finish();
+    mc_line_flush();
     
-    uint8_t char_counter = 1; 
+    uint8_t char_counter = serial_next_index(start); 
     uint8_t helper_var = 0; // Helper variable
     float parameter, value;
+    char block[LINE_BUFFER_SIZE]; // Startup line, as stored in EEPROM
     switch( line[char_counter] ) {
       case 0 : report_grbl_help(); break;
       case '$' : // Prints Grbl settings
-        if ( line[++char_counter] != 0 ) { return(STATUS_UNSUPPORTED_STATEMENT); }
+        if ( line[serial_next_index(char_counter)] != 0 ) { return(STATUS_UNSUPPORTED_STATEMENT); }
         else { report_grbl_settings(); }
         break;
       case '#' : // Print gcode parameters
-        if ( line[++char_counter] != 0 ) { return(STATUS_UNSUPPORTED_STATEMENT); }
+        if ( line[serial_next_index(char_counter)] != 0 ) { return(STATUS_UNSUPPORTED_STATEMENT); }
         else { report_gcode_parameters(); }
         break;
       case 'G' : // Prints gcode parser state
-        if ( line[++char_counter] != 0 ) { return(STATUS_UNSUPPORTED_STATEMENT); }
+        if ( line[serial_next_index(char_counter)] != 0 ) { return(STATUS_UNSUPPORTED_STATEMENT); }
         else { report_gcode_modes(); }
         break;
+      #ifdef STEPPER_ISR_TIMING
+      case 'T' : // Prints and restarts stepper interrupt timing statistics
+        if ( line[serial_next_index(char_counter)] != 0 ) { return(STATUS_UNSUPPORTED_STATEMENT); }
+        else { report_isr_timing(); }
+        break;
+      #endif
       case 'C' : // Set check g-code mode
-        if ( line[++char_counter] != 0 ) { return(STATUS_UNSUPPORTED_STATEMENT); }
+        if ( line[serial_next_index(char_counter)] != 0 ) { return(STATUS_UNSUPPORTED_STATEMENT); }
         // Perform reset when toggling off. Check g-code mode should only work if Grbl
         // is idle and ready, regardless of alarm locks. This is mainly to keep things
         // simple and consistent.
@@ -210,7 +285,7 @@ uint8_t protocol_execute_line(char *line)
         }
         break; 
       case 'X' : // Disable alarm lock
-        if ( line[++char_counter] != 0 ) { return(STATUS_UNSUPPORTED_STATEMENT); }
+        if ( line[serial_next_index(char_counter)] != 0 ) { return(STATUS_UNSUPPORTED_STATEMENT); }
         if (sys.state == STATE_ALARM) { 
           report_feedback_message(MESSAGE_ALARM_UNLOCK);
           sys.state = STATE_IDLE;
@@ -239,12 +314,13 @@ uint8_t protocol_execute_line(char *line)
       // block buffer without having the planner plan them. It would need to manage de/ac-celerations 
       // on its own carefully. This approach could be effective and possibly size/memory efficient.
       case 'N' : // Startup lines. 
-        if ( line[++char_counter] == 0 ) { // Print startup lines
+        char_counter = serial_next_index(char_counter);
+        if ( line[char_counter] == 0 ) { // Print startup lines
           for (helper_var=0; helper_var < N_STARTUP_LINE; helper_var++) {
-            if (!(settings_read_startup_line(helper_var, line))) {
+            if (!(settings_read_startup_line(helper_var, block))) {
               report_status_message(STATUS_SETTING_READ_FAIL);
             } else {
-              report_startup_line(helper_var,line);
+              report_startup_line(helper_var,block);
             }
           }
           break;
@@ -254,19 +330,23 @@ uint8_t protocol_execute_line(char *line)
         }
       default :  // Storing setting methods
         if(!read_float(line, &char_counter, &parameter)) { return(STATUS_BAD_NUMBER_FORMAT); }
-        if(line[char_counter++] != '=') { return(STATUS_UNSUPPORTED_STATEMENT); }
+        if(line[char_counter] != '=') { return(STATUS_UNSUPPORTED_STATEMENT); }
+        char_counter = serial_next_index(char_counter);
         if (helper_var) { // Store startup line
-          // Prepare sending gcode block to gcode parser by shifting all characters
-          helper_var = char_counter; // Set helper variable as counter to start of gcode block
-          do {
-            line[char_counter-helper_var] = line[char_counter];
-          } while (line[char_counter++] != 0);
+          // Copy the gcode block out of the read buffer into a startup line.
+          helper_var = 0; // Set helper variable as counter of the gcode block
+          while (line[char_counter] != 0) {
+            if (helper_var >= LINE_BUFFER_SIZE-1) { return(STATUS_LINE_LENGTH_EXCEEDED); }
+            block[helper_var++] = line[char_counter];
+            char_counter = serial_next_index(char_counter);
+          }
+          block[helper_var] = 0;
           // Execute gcode block to ensure block is valid.
-          helper_var = gc_execute_line(line); // Set helper_var to returned status code.
+          helper_var = gc_execute_line(block,0); // Set helper_var to returned status code.
           if (helper_var) { return(helper_var); }
           else { 
             helper_var = trunc(parameter); // Set helper_var to int value of parameter
-            settings_store_startup_line(helper_var,line);
+            settings_store_startup_line(helper_var,block);
           }
         } else { // Store global setting.
           if(!read_float(line, &char_counter, &value)) { return(STATUS_BAD_NUMBER_FORMAT); }
@@ -277,18 +357,194 @@ uint8_t protocol_execute_line(char *line)
     return(STATUS_OK); // If '$' command makes it to here, then everything's ok.
 
   } else {
-    return(gc_execute_line(line));    // Everything else is gcode
+    return(gc_execute_line(line,start));    // Everything else is gcode
+  }
+}
+
+
+// Returns the number of bytes of a binary frame record of the given type, or zero if unknown.
+static uint8_t frame_record_size(uint8_t type)
+{
+  switch (type) {
+    case FRAME_FEED: return(1+sizeof(float));
+    case FRAME_LINE: return(1+3*sizeof(int16_t));
+    case FRAME_LINE_LONG: case FRAME_SEEK: return(1+3*sizeof(int32_t));
+    case FRAME_ARC: return(2+5*sizeof(int32_t));
+  }
+  return(0);
+}
+
+// Sets the target of a binary frame motion in mm, from its steps relative to the g-code parser 
+// position. The position is rounded to steps the same way the planner does, so the steps add up 
+// exactly over any number of records.
+static void frame_target(float *target, int32_t *steps)
+{
+  uint8_t i;
+  for (i=0; i<3; i++) {
+    target[i] = (lround(gc.position[i]*settings.steps_per_mm[i]) + steps[i])/settings.steps_per_mm[i];
+  }
+}
+
+// Executes the records of the binary frame in the line variable, once it has been checked to be
+// complete and intact. The line holds the frame from its length byte on. The motions go straight to 
+// the motion control, bypassing the g-code parser, which is only kept up to date with the position
+// and feed rate. Frame motions are always in units per minute feed rate mode.
+static uint8_t protocol_execute_frame(char *line)
+{
+  uint8_t length = line[0];
+  uint8_t crc = 0;
+  uint8_t i;
+  for (i=0; i<=length; i++) { crc = _crc8_ccitt_update(crc, line[i]); }
+  if (crc != (uint8_t)line[length+1]) { return(STATUS_BAD_FRAME); }
+  
+  // Check all records before executing the first, so a bad frame has no effect.
+  int32_t steps[3];
+  int16_t short_steps[3];
+  float feed_rate, target[3], offset[3];
+  uint8_t size;
+  for (i=1; i<=length; i+=size) {
+    size = frame_record_size(line[i]);
+    if (!size) { return(STATUS_UNSUPPORTED_STATEMENT); }
+    if (i+size > length+1) { return(STATUS_BAD_FRAME); }
+    if (line[i] == FRAME_FEED) {
+      memcpy(&feed_rate, line+i+1, sizeof(float));
+      if (!(feed_rate > 0)) { return(STATUS_INVALID_STATEMENT); }
+    } else if (line[i] == FRAME_ARC) {
+      memcpy(steps, line+i+2+3*sizeof(int32_t), 2*sizeof(int32_t));
+      if (!steps[0] && !steps[1]) { return(STATUS_INVALID_STATEMENT); } // No center offset
+    }
+  }
+  if (sys.state == STATE_ALARM) { return(STATUS_ALARM_LOCK); }
+  
+  for (i=1; i<=length; i+=size) {
+    char *record = line+i+1;
+    size = frame_record_size(line[i]);
+    switch (line[i]) {
+      case FRAME_FEED:
+        memcpy(&gc.feed_rate, record, sizeof(float));
+        continue; // No motion
+      case FRAME_LINE:
+        memcpy(short_steps, record, sizeof(short_steps));
+        steps[X_AXIS] = short_steps[X_AXIS];
+        steps[Y_AXIS] = short_steps[Y_AXIS];
+        steps[Z_AXIS] = short_steps[Z_AXIS];
+        frame_target(target, steps);
+        mc_arc_finish(); // Follow an arc earlier in the frame.
+        mc_line(target[X_AXIS], target[Y_AXIS], target[Z_AXIS], gc.feed_rate, false);
+        break;
+      case FRAME_LINE_LONG: case FRAME_SEEK:
+        memcpy(steps, record, sizeof(steps));
+        frame_target(target, steps);
+        mc_arc_finish();
+        mc_line(target[X_AXIS], target[Y_AXIS], target[Z_AXIS], 
+          (line[i] == FRAME_SEEK) ? -settings.default_seek_rate : gc.feed_rate, false);
+        break;
+      case FRAME_ARC: {
+        uint8_t axis_0 = X_AXIS, axis_1 = Y_AXIS, axis_linear = Z_AXIS;
+        switch ((record[0] >> 1) & 3) {
+          case 1: axis_1 = Z_AXIS; axis_linear = Y_AXIS; break;
+          case 2: axis_0 = Y_AXIS; axis_1 = Z_AXIS; axis_linear = X_AXIS; break;
+        }
+        memcpy(steps, record+1, sizeof(steps));
+        frame_target(target, steps);
+        memcpy(steps, record+1+sizeof(steps), 2*sizeof(int32_t));
+        clear_vector(offset);
+        offset[axis_0] = steps[0]/settings.steps_per_mm[axis_0];
+        offset[axis_1] = steps[1]/settings.steps_per_mm[axis_1];
+        mc_arc(gc.position, target, offset, axis_0, axis_1, axis_linear, gc.feed_rate, false,
+          hypot(offset[axis_0], offset[axis_1]), record[0] & 1);
+        break;
+      }
+    }
+    if (sys.abort) { return(STATUS_OK); }
+    memcpy(gc.position, target, sizeof(target)); // gc.position[] = target[];
   }
+  return(STATUS_OK);
+}
+
+
+// Executes the complete line or binary frame and frees it from the serial read buffer, before
+// its status is reported, so a host counting characters may send as many as it acknowledges.
+static void protocol_execute_pending_line()
+{
+  uint8_t status_code = STATUS_OK;
+  if (isframe) {
+    // Frame records are read as binary values, so the frame is copied out of the read buffer
+    // in one piece, from its length byte on.
+    char frame[FRAME_MAX_LENGTH+2];
+    uint8_t index = serial_next_index(rx_buffer_tail);
+    uint8_t i;
+    for (i=0; index != scan; i++) {
+      frame[i] = rx_buffer[index];
+      index = serial_next_index(index);
+    }
+    status_code = protocol_execute_frame(frame);
+  } else if (isoverflow) {
+    status_code = STATUS_LINE_LENGTH_EXCEEDED;
+  } else if (line_end != rx_buffer_tail) { // Line is complete. Then execute!
+    rx_buffer[line_end] = 0; // Terminate string
+    status_code = protocol_execute_line((char*)rx_buffer, rx_buffer_tail);
+  } 
+  // Else empty or comment line. Skip block. Send status message for syncing purposes.
+  serial_free_read_buffer(scan);
+  line_end = scan; // Reset line input
+  iscomment = false; // Reset comment flag
+  isframe = false;
+  isoverflow = false;
+  line_pending = false;
+  report_status_message(status_code);
 }
 
 
 // Process and report status one line of incoming serial data. Performs an initial filtering
-// by removing spaces and comments and capitalizing all letters.
+// by removing spaces and comments and capitalizing all letters, in place in the serial read buffer,
+// where the line is parsed. Binary frames are left unfiltered.
+// NOTE: While an arc is being queued, its segments are sent to the planner as space frees up and
+// the next line is read in meanwhile. That line waits, without blocking the main program, until 
+// the arc is fully queued, since its motion must follow the arc. The serial interrupt keeps 
+// buffering the lines after it.
 void protocol_process()
 {
+  uint8_t arc_in_progress = mc_arc_continue();
+  if (line_pending) {
+    if (arc_in_progress) { return; }
+    protocol_execute_pending_line();
+  }
+
   uint8_t c;
-  while((c = serial_read()) != SERIAL_NO_DATA) {
-    if ((c == '\n') || (c == '\r')) { // End of line reached
+  while(scan != rx_buffer_head) {
+    c = rx_buffer[scan];
+    if (isframe) {
+      // The frame starts at the read buffer tail. The byte following the start is its length, 
+      // which the serial interrupt has checked to fit, unless the frame is to be rejected.
+      scan = serial_next_index(scan);
+      uint8_t length = rx_buffer[serial_next_index(rx_buffer_tail)];
+      if (scan == (rx_buffer_tail+2) % RX_BUFFER_SIZE && length > FRAME_MAX_LENGTH) {
+        serial_free_read_buffer(scan);
+        line_end = scan;
+        isframe = false;
+        report_status_message(STATUS_BAD_FRAME);
+        continue;
+      }
+      if (scan != (rx_buffer_tail+length+3) % RX_BUFFER_SIZE) { continue; } // Records and CRC to come
+      
+      protocol_execute_runtime();
+      if (sys.abort) { return; } // Bail to main program upon system abort    
+      line_pending = true;
+      if (mc_arc_continue()) { return; } // Resume here once the arc is queued.
+      protocol_execute_pending_line();
+      
+    } else if (c == FRAME_START) {
+      // A frame ends any partly received line, which is dropped.
+      serial_free_read_buffer(scan);
+      scan = serial_next_index(scan);
+      line_end = rx_buffer_tail;
+      iscomment = false;
+      isoverflow = false;
+      isframe = true;
+      
+    } else if ((c == '\n') || (c == '\r')) { // End of line reached
+      scan = serial_next_index(scan);
 
       // Runtime command check point before executing line. Prevent any furthur line executions.
       // NOTE: If there is no line, this function should quickly return to the main program when
@@ -296,17 +552,12 @@ void protocol_process()
       protocol_execute_runtime();
       if (sys.abort) { return; } // Bail to main program upon system abort    
 
-      if (char_counter > 0) {// Line is complete. Then execute!
-        line[char_counter] = 0; // Terminate string
-        report_status_message(protocol_execute_line(line));
-      } else { 
-        // Empty or comment line. Skip block.
-        report_status_message(STATUS_OK); // Send status message for syncing purposes.
-      }
-      char_counter = 0; // Reset line buffer index
-      iscomment = false; // Reset comment flag
+      line_pending = true;
+      if (mc_arc_continue()) { return; } // Resume here once the arc is queued.
+      protocol_execute_pending_line();
       
     } else {
+      scan = serial_next_index(scan);
       if (iscomment) {
         // Throw away all comment characters
         if (c == ')') {
@@ -321,14 +572,39 @@ void protocol_process()
         } else if (c == '(') {
           // Enable comments flag and ignore all characters until ')' or EOL.
           iscomment = true;
-        } else if (char_counter >= LINE_BUFFER_SIZE-1) {
-          // Throw away any characters beyond the end of the line buffer          
-        } else if (c >= 'a' && c <= 'z') { // Upcase lowercase
-          line[char_counter++] = c-'a'+'A';
+        } else if (isoverflow) {
+          // Throw away the rest of a line too long for the read buffer
         } else {
-          line[char_counter++] = c;
+          if (c >= 'a' && c <= 'z') { c += 'A'-'a'; } // Upcase lowercase
+          rx_buffer[line_end] = c;
+          line_end = serial_next_index(line_end);
         }
       }
     }
   }
+
+  // Keep room in the read buffer for the rest of the line being received. Once it runs low, the
+  // filtered line is moved up to the characters still to come, freeing those filtered out. A read
+  // buffer filled up with none to free holds a line too long for it, which is thrown away up to its
+  // end of line and rejected.
+  if (!isframe && scan == rx_buffer_head && serial_get_rx_buffer_count() >= RX_BUFFER_SIZE-RX_BUFFER_SIZE/4) {
+    if (line_end != scan) {
+      uint8_t index = scan;
+      while (line_end != rx_buffer_tail) {
+        line_end = serial_prev_index(line_end);
+        index = serial_prev_index(index);
+        rx_buffer[index] = rx_buffer[line_end];
+      }
+      serial_free_read_buffer(index);
+      line_end = scan;
+    } else if (serial_get_rx_buffer_count() >= LINE_OVERFLOW_COUNT) {
+      serial_free_read_buffer(scan);
+      line_end = scan;
+      isoverflow = true;
+    }
+  }
+
+  // No more input for now. Unless the next line is partly received, send the held line to the
+  // planner, so the motion does not wait on a line that may never come.
+  if (line_end == rx_buffer_tail && !iscomment && !isframe && !isoverflow) { mc_line_flush(); }
 }
@@ -23,16 +23,26 @@
 
 #include <avr/sleep.h>
 
-// Line buffer size from the serial input stream to be executed.
-// NOTE: Not a problem except for extreme cases, but the line buffer size can be too small
-// and g-code blocks can get truncated. Officially, the g-code standards support up to 256
-// characters. In future versions, this will be increased, when we know how much extra
-// memory space we can invest into here or we re-write the g-code parser not to have his 
-// buffer.
+// Startup line size, as stored in EEPROM. Lines from the serial input stream are parsed in 
+// place in the serial read buffer, so they may be up to RX_BUFFER_SIZE-2 characters long once 
+// spaces and comments are removed, which takes any length. Longer lines are rejected.
 #ifndef LINE_BUFFER_SIZE
   #define LINE_BUFFER_SIZE 50
 #endif
 
+// Binary motion frames. Alongside text lines, the host may send frames of the form
+//   FRAME_START, length, records[length], CRC-8 (CCITT, zero initial value) of length and records
+// which are acknowledged with 'ok' or 'error:' like a line. The records carry motions pre-resolved
+// to steps, relative to the current position. Numbers are little-endian, floats IEEE single.
+#define FRAME_START 0xa5
+#define FRAME_MAX_LENGTH 48 // Records per frame, in bytes
+#define FRAME_FEED 1      // float feed rate (mm/min) for the following lines and arcs
+#define FRAME_LINE 2      // int16 x,y,z steps. Feed motion.
+#define FRAME_LINE_LONG 3 // int32 x,y,z steps. Feed motion.
+#define FRAME_SEEK 4      // int32 x,y,z steps. Seek motion.
+#define FRAME_ARC 5       // uint8 flags, int32 x,y,z target steps, int32 center offset steps along
+                          // the two plane axes. Flags: bit 0 clockwise, bits 1-2 plane (0 XY, 1 XZ, 2 YZ).
+
 // Initialize the serial protocol
 void protocol_init();
 
@@ -41,7 +51,7 @@ void protocol_init();
 void protocol_process();
 
 // Executes one line of input according to protocol
-uint8_t protocol_execute_line(char *line);
+uint8_t protocol_execute_line(char *line, uint8_t start);
 
 // Checks and executes a runtime command at various stop points in main program
 void protocol_execute_runtime();
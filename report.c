@@ -33,6 +33,9 @@
 #include "nuts_bolts.h"
 #include "gcode.h"
 #include "coolant_control.h"
+#include "stepper.h"
+#include "serial.h"
+#include "planner.h"
 
 
 // Handles the primary confirmation protocol response for streaming interfaces and human-feedback.
@@ -74,6 +77,12 @@ void report_status_message(uint8_t status_code)
       printPgmString(PSTR("Busy or queued")); break;
       case STATUS_ALARM_LOCK:
       printPgmString(PSTR("Alarm lock")); break;
+      case STATUS_SETTING_VALUE_RANGE:
+      printPgmString(PSTR("Value out of range")); break;
+      case STATUS_BAD_FRAME:
+      printPgmString(PSTR("Bad frame")); break;
+      case STATUS_LINE_LENGTH_EXCEEDED:
+      printPgmString(PSTR("Line overflow")); break;
     }
     printPgmString(PSTR("\r\n"));
   }
@@ -134,6 +143,9 @@ void report_grbl_help() {
                       "$C (check gcode mode)\r\n"
                       "$X (kill alarm lock)\r\n"
                       "$H (run homing cycle)\r\n"
+                      #ifdef STEPPER_ISR_TIMING
+                      "$T (view and restart step ISR timing)\r\n"
+                      #endif
                       "~ (cycle start)\r\n"
                       "! (feed hold)\r\n"
                       "? (current status)\r\n"
@@ -155,7 +167,7 @@ void report_grbl_settings() {
   printPgmString(PSTR(" (step idle delay, msec)\r\n$8=")); printFloat(settings.acceleration/(60*60)); // Convert from mm/min^2 for human readability
   printPgmString(PSTR(" (acceleration, mm/sec^2)\r\n$9=")); printFloat(settings.junction_deviation);
   printPgmString(PSTR(" (junction deviation, mm)\r\n$10=")); printFloat(settings.mm_per_arc_segment);
-  printPgmString(PSTR(" (arc, mm/segment)\r\n$11=")); printInteger(settings.n_arc_correction);
+  printPgmString(PSTR(" (arc min segment, mm)\r\n$11=")); printInteger(settings.n_arc_correction);
   printPgmString(PSTR(" (n-arc correction, int)\r\n$12=")); printInteger(settings.decimal_places);
   printPgmString(PSTR(" (n-decimals, int)\r\n$13=")); printInteger(bit_istrue(settings.flags,BITFLAG_REPORT_INCHES));
   printPgmString(PSTR(" (report inches, bool)\r\n$14=")); printInteger(bit_istrue(settings.flags,BITFLAG_AUTO_START));
@@ -168,10 +180,60 @@ void report_grbl_settings() {
   printPgmString(PSTR(" (homing feed, mm/min)\r\n$20=")); printFloat(settings.homing_seek_rate);
   printPgmString(PSTR(" (homing seek, mm/min)\r\n$21=")); printInteger(settings.homing_debounce_delay);
   printPgmString(PSTR(" (homing debounce, msec)\r\n$22=")); printFloat(settings.homing_pulloff);
-  printPgmString(PSTR(" (homing pull-off, mm)\r\n")); 
+  printPgmString(PSTR(" (homing pull-off, mm)\r\n$23=")); printFloat(settings.max_rate[X_AXIS]);
+  printPgmString(PSTR(" (x max rate, mm/min)\r\n$24=")); printFloat(settings.max_rate[Y_AXIS]);
+  printPgmString(PSTR(" (y max rate, mm/min)\r\n$25=")); printFloat(settings.max_rate[Z_AXIS]);
+  printPgmString(PSTR(" (z max rate, mm/min)\r\n$26=")); printFloat(settings.max_acceleration[X_AXIS]/(60*60));
+  printPgmString(PSTR(" (x accel, mm/sec^2)\r\n$27=")); printFloat(settings.max_acceleration[Y_AXIS]/(60*60));
+  printPgmString(PSTR(" (y accel, mm/sec^2)\r\n$28=")); printFloat(settings.max_acceleration[Z_AXIS]/(60*60));
+  printPgmString(PSTR(" (z accel, mm/sec^2)\r\n$29=")); printFloat(settings.jerk/(60*60*60));
+  printPgmString(PSTR(" (jerk, mm/sec^3, 0 for trapezoids)\r\n$30=")); printInteger(settings.acceleration_ticks);
+  printPgmString(PSTR(" (acceleration ticks/sec, 1-1000)\r\n$31=")); printFloat(settings.arc_tolerance);
+  printPgmString(PSTR(" (arc tolerance, mm)\r\n$32=")); printFloat(acos(settings.merge_cos_angle)*180/M_PI);
+  printPgmString(PSTR(" (merge angle, deg)\r\n$33=")); printFloat(settings.merge_deviation);
+  printPgmString(PSTR(" (merge deviation, mm, 0 to disable)\r\n$34=")); printInteger(settings.merge_steps);
+  printPgmString(PSTR(" (merge short lines, steps)\r\n$35=")); printInteger(settings.baud_rate);
+  printPgmString(PSTR(" (baud rate, ")); printFloat(serial_baud_error(settings.baud_rate));
+  printPgmString(PSTR("% error, applied on reset)\r\n")); 
 }
 
 
+#ifdef STEPPER_ISR_TIMING
+// Prints the stepper interrupt timing statistics gathered since the last '$T', in microseconds.
+// The histogram covers all paths. Its last bin also holds everything longer.
+void report_isr_timing()
+{
+  isr_timing_t timing;
+  uint8_t i;
+  st_isr_timing_read(&timing);
+  for (i=0; i<N_ISR_PATH; i++) {
+    switch (i) {
+      case ISR_PATH_BLOCK_LOAD: printPgmString(PSTR("load:")); break;
+      case ISR_PATH_SEGMENT: printPgmString(PSTR("seg:")); break;
+      case ISR_PATH_STEP: printPgmString(PSTR("step:")); break;
+    }
+    printInteger(timing.count[i]);
+    if (timing.count[i]) {
+      printPgmString(PSTR(" (min/mean/max ")); printFloat(timing.min[i]*ISR_TIMING_USEC_PER_TICK);
+      printPgmString(PSTR("/")); printFloat((float)timing.total[i]/timing.count[i]*ISR_TIMING_USEC_PER_TICK);
+      printPgmString(PSTR("/")); printFloat(timing.max[i]*ISR_TIMING_USEC_PER_TICK);
+      printPgmString(PSTR(" usec)"));
+    }
+    printPgmString(PSTR("\r\n"));
+  }
+  printPgmString(PSTR("hist:"));
+  for (i=0; i<N_ISR_TIMING_BIN; i++) {
+    if (i) { printPgmString(PSTR(",")); }
+    printInteger((long)((i<<ISR_TIMING_BIN_SHIFT)*ISR_TIMING_USEC_PER_TICK));
+    printPgmString(PSTR("="));
+    printInteger(timing.histogram[i]);
+  }
+  printPgmString(PSTR(" (usec=count)\r\noverrun:"));
+  printInteger(timing.overruns);
+  printPgmString(PSTR("\r\n"));
+}
+#endif
+
 // Prints gcode coordinate offset parameters
 void report_gcode_parameters()
 {
@@ -238,6 +300,12 @@ void report_gcode_modes()
   
   if (gc.inverse_feed_rate_mode) { printPgmString(PSTR(" G93")); }
   else { printPgmString(PSTR(" G94")); }
+
+  if (gc.path_tolerance > 0) { 
+    printPgmString(PSTR(" G64 P"));
+    if (gc.inches_mode) { printFloat(gc.path_tolerance*INCH_PER_MM); }
+    else { printFloat(gc.path_tolerance); }
+  } else { printPgmString(PSTR(" G61")); }
     
   switch (gc.program_flow) {
     case PROGRAM_FLOW_RUNNING : printPgmString(PSTR(" M0")); break;
@@ -277,6 +345,24 @@ void report_startup_line(uint8_t n, char *line)
   printPgmString(PSTR("\r\n"));
 }
 
+// Prints the serial read buffer bytes used and free, the free planner blocks, the characters
+// lost to a full read buffer and the step segment buffer underruns since power-up. The motion
+// control holds back one more line, which is not counted in the planner.
+static void print_buffer_state()
+{
+  uint8_t rx_count = serial_get_rx_buffer_count();
+  printPgmString(PSTR("RX:"));
+  printInteger(rx_count);
+  printPgmString(PSTR(","));
+  printInteger((RX_BUFFER_SIZE-1)-rx_count);
+  printPgmString(PSTR(",Blk:"));
+  printInteger(plan_get_block_buffer_available());
+  printPgmString(PSTR(",Ovf:"));
+  printInteger(serial_get_rx_overflow_count());
+  printPgmString(PSTR(",Und:"));
+  printInteger(st_get_segment_underrun_count());
+}
+
  // Prints real-time data. This function grabs a real-time snapshot of the stepper subprogram 
  // and the actual location of the CNC machine. Users may change the following function to their
  // specific needs, but the desired real-time data report must be as short as possible. This is
@@ -325,6 +411,23 @@ void report_realtime_status()
     printFloat(print_position[i]);
     if (i < 2) { printPgmString(PSTR(",")); }
   }
-    
+  
+  // Report feed rate and rapid overrides (percent)
+  printPgmString(PSTR(",Ovr:"));
+  printInteger(sys.feed_override);
+  printPgmString(PSTR(","));
+  printInteger(sys.rapid_override);
+  
+  printPgmString(PSTR(","));
+  print_buffer_state();
+  printPgmString(PSTR("]\r\n"));
+}
+
+// Buffer state report, for host streamers to keep the serial read and planner buffers filled. 
+// Short to send, so it can be queried often.
+void report_buffer_state()
+{
+  printPgmString(PSTR("["));
+  print_buffer_state();
   printPgmString(PSTR("]\r\n"));
 }
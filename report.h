@@ -35,6 +35,9 @@
 #define STATUS_SETTING_READ_FAIL 10
 #define STATUS_IDLE_ERROR 11
 #define STATUS_ALARM_LOCK 12
+#define STATUS_SETTING_VALUE_RANGE 13
+#define STATUS_BAD_FRAME 14
+#define STATUS_LINE_LENGTH_EXCEEDED 15
 
 // Define Grbl alarm codes. Less than zero to distinguish alarm error from status error.
 #define ALARM_HARD_LIMIT -1
@@ -68,6 +71,12 @@ void report_grbl_settings();
 // Prints realtime status report
 void report_realtime_status();
 
+// Prints only the serial read and planner buffer state
+void report_buffer_state();
+
+// Prints and restarts the stepper interrupt timing statistics
+void report_isr_timing();
+
 // Prints Grbl persistent coordinate parameters
 void report_gcode_parameters();
 
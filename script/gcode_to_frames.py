@@ -0,0 +1,150 @@
+#!/usr/bin/env python
+"""\
+Convert g-code to grbl binary motion frames
+
+Writes the g-code file with its G0, G1, G2 and G3 moves replaced by
+binary frames (see protocol.h), which grbl executes without parsing.
+The moves are resolved to steps, so the steps per mm given must be
+those of grbl's $0, $1 and $2 settings. Consecutive moves are packed
+into frames of up to the given number of records. Lines with anything
+else, such as M-codes, G92 or radius format arcs, are passed on as
+text, and a move that grbl could place differently, after G28 or G92
+for instance, stays text until the position is known again.
+
+Output is a byte stream to be sent to grbl as it is, by a streamer
+that counts a frame's bytes like a line's: start byte, length byte,
+records and CRC.
+"""
+
+import argparse
+import re
+import struct
+
+FRAME_START = 0xa5
+FRAME_MAX_LENGTH = 48
+FRAME_FEED = 1
+FRAME_LINE = 2
+FRAME_LINE_LONG = 3
+FRAME_SEEK = 4
+FRAME_ARC = 5
+MM_PER_INCH = 25.4
+
+parser = argparse.ArgumentParser(description='Convert g-code to grbl binary motion frames.')
+parser.add_argument('gcode_file', type=argparse.FileType('r'),
+        help='g-code filename to be converted')
+parser.add_argument('frame_file',
+        help='output filename')
+parser.add_argument('-s','--steps',default='377.952755905512',
+        help='steps per mm, one value or x,y,z (grbl $0,$1,$2)')
+parser.add_argument('-n','--records',type=int,default=4,
+        help='most records per frame (default 4)')
+args = parser.parse_args()
+
+steps = [float(v) for v in args.steps.split(',')]
+if len(steps) == 1: steps = steps*3
+
+def crc8(data):
+    crc = 0
+    for b in bytearray(data):
+        crc ^= b
+        for i in range(8):
+            crc = ((crc << 1) ^ 0x07) & 0xff if crc & 0x80 else (crc << 1) & 0xff
+    return crc
+
+out = open(args.frame_file,'wb')
+records = []
+
+def flush():
+    global records
+    if records:
+        body = b''.join(records)
+        head = struct.pack('<B',len(body))
+        out.write(struct.pack('<B',FRAME_START) + head + body + struct.pack('<B',crc8(head+body)))
+        records = []
+
+def add(record):
+    if len(records) >= args.records or sum(len(r) for r in records)+len(record) > FRAME_MAX_LENGTH:
+        flush()
+    records.append(record)
+
+def text(line):
+    global feed_sent
+    flush()
+    out.write(line.encode('ascii') + b'\n')
+    feed_sent = feed # Text lines set grbl's feed rate too
+
+# Parser state. The position is in program coordinates (mm), which is all relative moves need.
+position = [0.0,0.0,0.0]
+known = [False,False,False]
+motion = None
+absolute = True
+inches = False
+inverse_time = False
+plane = 0
+feed = None
+feed_sent = None
+
+for raw in args.gcode_file:
+    line = re.sub(r'\s|\(.*?\)|;.*','',raw).upper()
+    if not line: continue
+    words = re.findall(r'([A-Z])([-+]?[0-9.]*)',line)
+    if ''.join(l+v for l,v in words) != line:
+        text(raw.strip()); continue
+    words = [(l,float(v)) for l,v in words]
+    g = [v for l,v in words if l == 'G']
+    for v in g:
+        if v in (0,1,2,3): motion = int(v)
+        elif v == 90: absolute = True
+        elif v == 91: absolute = False
+        elif v == 20: inches = True
+        elif v == 21: inches = False
+        elif v == 93: inverse_time = True
+        elif v == 94: inverse_time = False
+        elif v in (17,18,19): plane = int(v)-17
+    scale = MM_PER_INCH if inches else 1.0
+    axes = dict((l,v*scale) for l,v in words if l in 'XYZ')
+    other = [l for l,v in words if l not in 'GXYZFIJK']
+    if 'F' in dict(words) and not inverse_time: feed = dict(words)['F']*scale
+    if [v for l,v in words if l == 'M' and v in (2,30)]: feed = None # Reset to the default
+    if other or [v for v in g if v not in (0,1,2,3,17,18,19,20,21,90,91,94)]:
+        # Anything that may move the position without grbl's moves saying where to.
+        if [v for v in g if v in (10,28,28.1,30,30.1,53,54,55,56,57,58,59,92,92.1,92.2,92.3)]:
+            known = [False,False,False]
+        text(raw.strip()); continue
+    target = list(position)
+    for i,l in enumerate('XYZ'):
+        if l in axes: target[i] = axes[l] if absolute else position[i]+axes[l]
+    # Moves are sent relative to grbl's position, so only the axes moving need to be known.
+    binary = (motion is not None and axes and not inverse_time and
+              all(known['XYZ'.index(l)] for l in axes))
+    if motion in (2,3):
+        axis_0,axis_1 = ((0,1),(0,2),(1,2))[plane]
+        offsets = dict((l,v*scale) for l,v in words if l in 'IJK')
+        binary = binary and offsets
+    if motion in (1,2,3) and feed is None: binary = False
+    if not binary:
+        text(raw.strip())
+        for i,l in enumerate('XYZ'):
+            if l in axes and (absolute or known[i]): known[i] = True
+        if motion is not None: position = target
+        continue
+    if motion != 0 and feed != feed_sent:
+        add(struct.pack('<Bf',FRAME_FEED,feed))
+        feed_sent = feed
+    delta = [int(round(target[i]*steps[i])) - int(round(position[i]*steps[i])) for i in range(3)]
+    if motion == 0:
+        add(struct.pack('<Biii',FRAME_SEEK,*delta))
+    elif motion == 1:
+        if max(abs(d) for d in delta) < 32768:
+            add(struct.pack('<Bhhh',FRAME_LINE,*delta))
+        else:
+            add(struct.pack('<Biii',FRAME_LINE_LONG,*delta))
+    else:
+        o = [offsets.get('IJK'[a],0.0) for a in (axis_0,axis_1)]
+        flags = (1 if motion == 2 else 0) | (plane << 1)
+        add(struct.pack('<BBiiiii',FRAME_ARC,flags,*(delta +
+            [int(round(o[0]*steps[axis_0])),int(round(o[1]*steps[axis_1]))])))
+    position = target
+
+flush()
+out.close()
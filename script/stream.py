@@ -9,6 +9,9 @@ from the serial buffer and does not have to wait for a
 response from the computer. This effectively adds another
 buffer layer to prevent buffer starvation.
 
+The serial read buffer size is queried from grbl, which also reports
+any characters it had to drop, so the count is exact.
+
 TODO: - Add runtime command capabilities
 
 Version: SKJ.20120110
@@ -21,16 +24,49 @@ import sys
 import argparse
 # import threading
 
-RX_BUFFER_SIZE = 128
+RX_BUFFER_SIZE = 128 # Unless grbl reports its size
+FRAME_START = 0xa5
+CMD_BUFFER_REPORT = '\x98'
+
+# Queries grbl's buffer state '[RX:used,free,Blk:free,Ovf:lost,Und:underruns]'. Returns the numbers,
+# or None if grbl does not answer, as versions without the query do not. Versions without the
+# underrun count report it as 0.
+def buffer_state():
+    s.write(CMD_BUFFER_REPORT)
+    s.timeout = 0.5
+    state = None
+    timeout = time.time() + 1
+    while time.time() < timeout and not state:
+        m = re.match(r'\[RX:(\d+),(\d+),Blk:(\d+),Ovf:(\d+)(?:,Und:(\d+))?\]', s.readline().strip())
+        if m: state = [int(v or 0) for v in m.groups()]
+    s.timeout = None
+    return state
+
+# Splits the file into its lines and the binary frames written by gcode_to_frames.py. A frame
+# is sent as it is and counts in grbl's serial read buffer with all its bytes.
+def blocks(data):
+    i = 0
+    while i < len(data):
+        if ord(data[i]) == FRAME_START:
+            n = ord(data[i+1]) + 3
+            yield data[i:i+n]
+            i += n
+        else:
+            j = data.find('\n', i)
+            if j < 0: j = len(data)
+            yield data[i:j].strip() + '\n'
+            i = j + 1
 
 # Define command line argument interface
 parser = argparse.ArgumentParser(description='Stream g-code file to grbl. (pySerial and argparse libraries required)')
-parser.add_argument('gcode_file', type=argparse.FileType('r'),
+parser.add_argument('gcode_file', type=argparse.FileType('rb'),
         help='g-code filename to be streamed')
 parser.add_argument('device_file',
         help='serial device path')
 parser.add_argument('-q','--quiet',action='store_true', default=False, 
         help='suppress output text')
+parser.add_argument('-b','--baud',type=int,default=9600,
+        help='serial baud rate, matching grbl $35 (default 9600)')
 args = parser.parse_args()
 
 # Periodic timer to query for status reports
@@ -41,7 +77,7 @@ args = parser.parse_args()
 #     t.start()
 
 # Initialize
-s = serial.Serial(args.device_file,9600)
+s = serial.Serial(args.device_file,args.baud)
 f = args.gcode_file
 verbose = True
 if args.quiet : verbose = False
@@ -54,17 +90,24 @@ s.write("\r\n\r\n")
 time.sleep(2)
 s.flushInput()
 
+# Size the character counting to grbl's serial read buffer
+state = buffer_state()
+if state:
+    RX_BUFFER_SIZE = state[0] + state[1] + 1
+    print "Serial read buffer", RX_BUFFER_SIZE, "bytes,", state[2], "free planner blocks"
+overflows = state[3] if state else 0
+underruns = state[4] if state else 0
+
 # Stream g-code to grbl
 print "Streaming ", args.gcode_file.name, " to ", args.device_file
 l_count = 0
 g_count = 0
 c_line = []
 # periodic() # Start status report periodic timer
-for line in f:
+for l_block in blocks(f.read()):
     l_count += 1 # Iterate line counter
 #     l_block = re.sub('\s|\(.*?\)','',line).upper() # Strip comments/spaces/new line and capitalize
-    l_block = line.strip()
-    c_line.append(len(l_block)+1) # Track number of characters in grbl serial read buffer
+    c_line.append(len(l_block)) # Track number of characters in grbl serial read buffer
     grbl_out = '' 
     while sum(c_line) >= RX_BUFFER_SIZE-1 | s.inWaiting() :
         out_temp = s.readline().strip() # Wait for grbl response
@@ -75,10 +118,20 @@ for line in f:
             g_count += 1 # Iterate g-code counter
             grbl_out += str(g_count); # Add line finished indicator
             del c_line[0]
-    if verbose: print "SND: " + str(l_count) + " : " + l_block,
-    s.write(l_block + '\n') # Send block to grbl
+    if verbose:
+        if ord(l_block[0]) == FRAME_START: print "SND: " + str(l_count) + " : <frame " + str(len(l_block)) + " bytes>"
+        else: print "SND: " + str(l_count) + " : " + l_block.strip(),
+    s.write(l_block) # Send block to grbl
     if verbose : print "BUF:",str(sum(c_line)),"REC:",grbl_out
 
+# Characters lost to a full serial read buffer corrupt the lines they were in
+state = buffer_state()
+if state and state[3] > overflows:
+    print "WARNING:", state[3]-overflows, "characters were lost to a full serial read buffer!"
+# Underruns so far. The motion still buffered may add more.
+if state and state[4] > underruns:
+    print "WARNING: grbl fell behind the steppers", state[4]-underruns, "times, pausing the motion."
+
 # Wait for user input after streaming is completed
 print "G-code streaming finished!\n"
 print "WARNING: Wait until grbl completes buffered g-code blocks before exiting."
@@ -29,36 +29,83 @@
 #include "protocol.h"
 
 uint8_t rx_buffer[RX_BUFFER_SIZE];
-uint8_t rx_buffer_head = 0;
+volatile uint8_t rx_buffer_head = 0;
 uint8_t rx_buffer_tail = 0;
 
 uint8_t tx_buffer[TX_BUFFER_SIZE];
 uint8_t tx_buffer_head = 0;
 volatile uint8_t tx_buffer_tail = 0;
 
+#define RX_FRAME_LENGTH_NEXT 0xff
+static uint8_t rx_frame_bytes = 0; // Bytes of the binary frame being received still to come
+
+static uint16_t rx_overflow_count = 0; // Characters lost to a full RX buffer since power-up. Stops at 0xffff.
+
 #ifdef ENABLE_XONXOFF
   volatile uint8_t flow_ctrl = XON_SENT; // Flow control state variable
-  
-  // Returns the number of bytes in the RX buffer. This replaces a typical byte counter to prevent
-  // the interrupt and main programs from writing to the counter at the same time.
-  static uint8_t get_rx_buffer_count()
-  {
-    if (rx_buffer_head == rx_buffer_tail) { return(0); }
-    if (rx_buffer_head < rx_buffer_tail) { return(rx_buffer_tail-rx_buffer_head); }
-    return (RX_BUFFER_SIZE - (rx_buffer_head-rx_buffer_tail));
-  }
 #endif
 
+// Returns the number of bytes in the RX buffer. This replaces a typical byte counter to prevent
+// the interrupt and main programs from writing to the counter at the same time.
+uint8_t serial_get_rx_buffer_count()
+{
+  uint8_t head = rx_buffer_head; // Copy, as the serial interrupt may move it
+  if (head >= rx_buffer_tail) { return(head-rx_buffer_tail); }
+  return (RX_BUFFER_SIZE - (rx_buffer_tail-head));
+}
+
+uint16_t serial_get_rx_overflow_count()
+{
+  uint8_t sreg = SREG;
+  cli(); // The serial interrupt must not change the count between reading its two bytes.
+  uint16_t count = rx_overflow_count;
+  SREG = sreg;
+  return(count);
+}
+
+// Returns the baud rate register value closest to the baud rate, with the baud doubler on. The 
+// doubler halves the clock divider steps, which is what makes rates such as 250000, 500000 and 
+// 1000000 exact at 16MHz.
+static uint16_t baud_rate_ubrr(uint32_t baud_rate)
+{
+  uint32_t ubrr = (F_CPU/(4*baud_rate) + 1)/2; // F_CPU/(8*baud_rate), rounded
+  if (ubrr > 0x1000) { ubrr = 0x1000; } // UBRR0 is 12 bits wide
+  if (ubrr > 0) { ubrr--; }
+  return(ubrr);
+}
+
+// Microseconds two 10-bit characters take per count of UBRR0+1 with U2X, 160/(F_CPU in MHz), rounded
+// up. Divided first: (UBRR0+1)*160000000 overflows the AVR's 32-bit long at any rate below 115200.
+#define TX_DRAIN_US_PER_UBRR ((160000000UL + F_CPU - 1)/F_CPU)
+#if TX_DRAIN_US_PER_UBRR*0x1000 + 1 > 0xffffffff
+  #error "Serial drain delay at the slowest baud rate does not fit in 32 bits"
+#endif
+
+// Returns the difference of the actual from the given baud rate in percent.
+float serial_baud_error(uint32_t baud_rate)
+{
+  float actual = F_CPU/(8.0*(baud_rate_ubrr(baud_rate)+1));
+  return(100*(actual/baud_rate - 1));
+}
+
+void serial_set_baud_rate(uint32_t baud_rate)
+{
+  uint16_t UBRR0_value = baud_rate_ubrr(baud_rate);
+  uint16_t old_UBRR0_value = ((uint16_t)UBRR0H << 8) | UBRR0L;
+  if (UBRR0_value == old_UBRR0_value) { return; }
+  // Finish sending at the old rate: empty the buffer, then allow the data and shift registers the
+  // time of two 10-bit characters.
+  while (tx_buffer_head != tx_buffer_tail) { }
+  delay_us((old_UBRR0_value+1)*TX_DRAIN_US_PER_UBRR + 1);
+  UBRR0H = UBRR0_value >> 8;
+  UBRR0L = UBRR0_value;
+}
+
 void serial_init()
 {
   // Set baud rate
-  #if BAUD_RATE < 57600
-    uint16_t UBRR0_value = ((F_CPU / (8L * BAUD_RATE)) - 1)/2 ;
-    UCSR0A &= ~(1 << U2X0); // baud doubler off  - Only needed on Uno XXX
-  #else
-    uint16_t UBRR0_value = ((F_CPU / (4L * BAUD_RATE)) - 1)/2;
-    UCSR0A |= (1 << U2X0);  // baud doubler on for high baud rates, i.e. 115200
-  #endif
+  UCSR0A |= (1 << U2X0);  // baud doubler on
+  uint16_t UBRR0_value = baud_rate_ubrr(BAUD_RATE);
   UBRR0H = UBRR0_value >> 8;
   UBRR0L = UBRR0_value;
             
@@ -124,24 +171,16 @@ ISR(USART_UDRE_vect)
   if (tail == tx_buffer_head) { UCSR0B &= ~(1 << UDRIE0); }
 }
 
-uint8_t serial_read()
+void serial_free_read_buffer(uint8_t index)
 {
-  if (rx_buffer_head == rx_buffer_tail) {
-    return SERIAL_NO_DATA;
-  } else {
-    uint8_t data = rx_buffer[rx_buffer_tail];
-    rx_buffer_tail++;
-    if (rx_buffer_tail == RX_BUFFER_SIZE) { rx_buffer_tail = 0; }
+  rx_buffer_tail = index;
 
-    #ifdef ENABLE_XONXOFF
-      if ((get_rx_buffer_count() < RX_BUFFER_LOW) && flow_ctrl == XOFF_SENT) { 
-        flow_ctrl = SEND_XON;
-        UCSR0B |=  (1 << UDRIE0); // Force TX
-      }
-    #endif
-    
-    return data;
-  }
+  #ifdef ENABLE_XONXOFF
+    if ((serial_get_rx_buffer_count() < RX_BUFFER_LOW) && flow_ctrl == XOFF_SENT) { 
+      flow_ctrl = SEND_XON;
+      UCSR0B |=  (1 << UDRIE0); // Force TX
+    }
+  #endif
 }
 
 #ifdef __AVR_ATmega644P__
@@ -153,36 +192,61 @@ ISR(USART_RX_vect)
   uint8_t data = UDR0;
   uint8_t next_head;
   
-  // Pick off runtime command characters directly from the serial stream. These characters are
-  // not passed into the buffer, but these set system state flag bits for runtime execution.
-  switch (data) {
-    case CMD_STATUS_REPORT: sys.execute |= EXEC_STATUS_REPORT; break; // Set as true
-    case CMD_CYCLE_START:   sys.execute |= EXEC_CYCLE_START; break; // Set as true
-    case CMD_FEED_HOLD:     sys.execute |= EXEC_FEED_HOLD; break; // Set as true
-    case CMD_RESET:         mc_reset(); break; // Call motion control reset routine.
-    default: // Write character to buffer    
-      next_head = rx_buffer_head + 1;
-      if (next_head == RX_BUFFER_SIZE) { next_head = 0; }
+  if (rx_frame_bytes) {
+    // Pass binary frame bytes on as they are. Their numbers may take the value of any command
+    // character. The count of bytes to come follows from the frame length byte.
+    if (rx_frame_bytes == RX_FRAME_LENGTH_NEXT) {
+      rx_frame_bytes = (data <= FRAME_MAX_LENGTH) ? data+1 : 0; // A bad length is passed on for rejection.
+    } else {
+      rx_frame_bytes--;
+    }
+  } else {
+    // Pick off runtime command characters directly from the serial stream. These characters are
+    // not passed into the buffer, but these set system state flag bits for runtime execution.
+    switch (data) {
+      case CMD_STATUS_REPORT: sys.execute |= EXEC_STATUS_REPORT; return; // Set as true
+      case CMD_BUFFER_REPORT: sys.execute |= EXEC_BUFFER_REPORT; return; // Set as true
+      case CMD_CYCLE_START:   sys.execute |= EXEC_CYCLE_START; return; // Set as true
+      case CMD_FEED_HOLD:     sys.execute |= EXEC_FEED_HOLD; return; // Set as true
+      case CMD_RESET:         mc_reset(); return; // Call motion control reset routine.
+      case CMD_FEED_OVR_RESET:        sys.override |= OVERRIDE_FEED_RESET; return;
+      case CMD_FEED_OVR_COARSE_PLUS:  sys.override |= OVERRIDE_FEED_COARSE_PLUS; return;
+      case CMD_FEED_OVR_COARSE_MINUS: sys.override |= OVERRIDE_FEED_COARSE_MINUS; return;
+      case CMD_FEED_OVR_FINE_PLUS:    sys.override |= OVERRIDE_FEED_FINE_PLUS; return;
+      case CMD_FEED_OVR_FINE_MINUS:   sys.override |= OVERRIDE_FEED_FINE_MINUS; return;
+      case CMD_RAPID_OVR_RESET:       sys.override |= OVERRIDE_RAPID_RESET; return;
+      case CMD_RAPID_OVR_MEDIUM:      sys.override |= OVERRIDE_RAPID_MEDIUM; return;
+      case CMD_RAPID_OVR_LOW:         sys.override |= OVERRIDE_RAPID_LOW; return;
+      case FRAME_START:               rx_frame_bytes = RX_FRAME_LENGTH_NEXT; break;
+    }
+  }
+
+  // Write character to buffer    
+  next_head = rx_buffer_head + 1;
+  if (next_head == RX_BUFFER_SIZE) { next_head = 0; }
+
+  // Write data to buffer unless it is full. Then the character is lost, which is counted for 
+  // the buffer state report.
+  if (next_head != rx_buffer_tail) {
+    rx_buffer[rx_buffer_head] = data;
+    rx_buffer_head = next_head;    
     
-      // Write data to buffer unless it is full.
-      if (next_head != rx_buffer_tail) {
-        rx_buffer[rx_buffer_head] = data;
-        rx_buffer_head = next_head;    
-        
-        #ifdef ENABLE_XONXOFF
-          if ((get_rx_buffer_count() >= RX_BUFFER_FULL) && flow_ctrl == XON_SENT) {
-            flow_ctrl = SEND_XOFF;
-            UCSR0B |=  (1 << UDRIE0); // Force TX
-          } 
-        #endif
-        
-      }
+    #ifdef ENABLE_XONXOFF
+      if ((serial_get_rx_buffer_count() >= RX_BUFFER_FULL) && flow_ctrl == XON_SENT) {
+        flow_ctrl = SEND_XOFF;
+        UCSR0B |=  (1 << UDRIE0); // Force TX
+      } 
+    #endif
+    
+  } else {
+    if (rx_overflow_count < 0xffff) { rx_overflow_count++; }
   }
 }
 
 void serial_reset_read_buffer() 
 {
   rx_buffer_tail = rx_buffer_head;
+  rx_frame_bytes = 0;
 
   #ifdef ENABLE_XONXOFF
     flow_ctrl = XON_SENT;
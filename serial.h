@@ -34,8 +34,6 @@
   #define TX_BUFFER_SIZE 64
 #endif
 
-#define SERIAL_NO_DATA 0xff
-
 #ifdef ENABLE_XONXOFF
   #define RX_BUFFER_FULL 96 // XOFF high watermark
   #define RX_BUFFER_LOW 64 // XON low watermark
@@ -47,11 +45,42 @@
   #define XON_CHAR 0x11
 #endif
 
+// Starts the serial port at BAUD_RATE.
 void serial_init();
 
+// Changes the baud rate, once everything written so far has been sent. Interrupts must be enabled.
+void serial_set_baud_rate(uint32_t baud_rate);
+
+// Returns how far, in percent, the actual baud rate is off the given one.
+float serial_baud_error(uint32_t baud_rate);
+
 void serial_write(uint8_t data);
 
-uint8_t serial_read();
+// The read buffer. Lines are parsed where they were received (see protocol.c), so they only
+// leave the buffer, by serial_free_read_buffer(), once executed.
+extern uint8_t rx_buffer[RX_BUFFER_SIZE];
+extern volatile uint8_t rx_buffer_head; // Index of the next byte to be received
+extern uint8_t rx_buffer_tail; // Index of the oldest byte not yet freed
+
+// Return the read buffer index following or preceding the given one, wrapping around at the end of the
+// buffer. The line parsers step with this, so a line may run across the end of the buffer. Plain
+// strings shorter than the buffer never reach it.
+#if (RX_BUFFER_SIZE & (RX_BUFFER_SIZE-1)) == 0
+  #define serial_next_index(i) (((i)+1) & (RX_BUFFER_SIZE-1)) // Power of two size. No branch.
+  #define serial_prev_index(i) (((i)-1) & (RX_BUFFER_SIZE-1))
+#else
+  #define serial_next_index(i) ((i) < RX_BUFFER_SIZE-1 ? (i)+1 : 0)
+  #define serial_prev_index(i) ((i) > 0 ? (i)-1 : RX_BUFFER_SIZE-1)
+#endif
+
+// Frees the read buffer up to, not including, the given index, for more data to be received.
+void serial_free_read_buffer(uint8_t index);
+
+// Returns the number of bytes waiting in the read buffer.
+uint8_t serial_get_rx_buffer_count();
+
+// Returns the number of received characters lost to a full read buffer since power-up.
+uint16_t serial_get_rx_overflow_count();
 
 // Reset and empty data in read buffer. Used by e-stop and reset.
 void serial_reset_read_buffer();
@@ -20,6 +20,7 @@
 */
 
 #include <avr/io.h>
+#include <stddef.h>
 #include "protocol.h"
 #include "report.h"
 #include "stepper.h"
@@ -27,6 +28,7 @@
 #include "settings.h"
 #include "eeprom.h"
 #include "limits.h"
+#include "serial.h"
 
 settings_t settings;
 
@@ -43,6 +45,19 @@ typedef struct {
   float junction_deviation;
 } settings_v4_t;
 
+// Size of the version 5 settings record: settings_t up to the per-axis limits added in version 6.
+#define SETTINGS_V5_SIZE offsetof(settings_t, max_rate)
+// Size of the version 6 settings record: settings_t up to the jerk limit added in version 7.
+#define SETTINGS_V6_SIZE offsetof(settings_t, jerk)
+// Size of the version 7 settings record: settings_t up to the acceleration tick rate added in version 8.
+#define SETTINGS_V7_SIZE offsetof(settings_t, acceleration_ticks)
+// Size of the version 8 settings record: settings_t up to the arc tolerance added in version 9.
+#define SETTINGS_V8_SIZE offsetof(settings_t, arc_tolerance)
+// Size of the version 9 settings record: settings_t up to the line merging added in version 10.
+#define SETTINGS_V9_SIZE offsetof(settings_t, merge_cos_angle)
+// Size of the version 10 settings record: settings_t up to the baud rate added in version 11.
+#define SETTINGS_V10_SIZE offsetof(settings_t, baud_rate)
+
 
 // Method to store startup lines into EEPROM
 void settings_store_startup_line(uint8_t n, char *line)
@@ -66,9 +81,9 @@ void write_global_settings()
 }
 
 // Method to reset Grbl global settings back to defaults. 
-void settings_reset(bool reset_all) {
-  // Reset all settings or only the migration settings to the new version.
-  if (reset_all) {
+// Resets all settings, or with a nonzero version only those added after that settings version.
+void settings_reset(uint8_t version) {
+  if (version == 0) {
     settings.steps_per_mm[X_AXIS] = DEFAULT_X_STEPS_PER_MM;
     settings.steps_per_mm[Y_AXIS] = DEFAULT_Y_STEPS_PER_MM;
     settings.steps_per_mm[Z_AXIS] = DEFAULT_Z_STEPS_PER_MM;
@@ -80,21 +95,61 @@ void settings_reset(bool reset_all) {
     settings.invert_mask = DEFAULT_STEPPING_INVERT_MASK;
     settings.junction_deviation = DEFAULT_JUNCTION_DEVIATION;
   }
-  // New settings since last version
-  settings.flags = 0;
-  if (DEFAULT_REPORT_INCHES) { settings.flags |= BITFLAG_REPORT_INCHES; }
-  if (DEFAULT_AUTO_START) { settings.flags |= BITFLAG_AUTO_START; }
-  if (DEFAULT_INVERT_ST_ENABLE) { settings.flags |= BITFLAG_INVERT_ST_ENABLE; }
-  if (DEFAULT_HARD_LIMIT_ENABLE) { settings.flags |= BITFLAG_HARD_LIMIT_ENABLE; }
-  if (DEFAULT_HOMING_ENABLE) { settings.flags |= BITFLAG_HOMING_ENABLE; }
-  settings.homing_dir_mask = DEFAULT_HOMING_DIR_MASK;
-  settings.homing_feed_rate = DEFAULT_HOMING_FEEDRATE;
-  settings.homing_seek_rate = DEFAULT_HOMING_RAPID_FEEDRATE;
-  settings.homing_debounce_delay = DEFAULT_HOMING_DEBOUNCE_DELAY;
-  settings.homing_pulloff = DEFAULT_HOMING_PULLOFF;
-  settings.stepper_idle_lock_time = DEFAULT_STEPPER_IDLE_LOCK_TIME;
-  settings.decimal_places = DEFAULT_DECIMAL_PLACES;
-  settings.n_arc_correction = DEFAULT_N_ARC_CORRECTION;
+  // Settings added in version 5
+  if (version < 5) {
+    settings.flags = 0;
+    if (DEFAULT_REPORT_INCHES) { settings.flags |= BITFLAG_REPORT_INCHES; }
+    if (DEFAULT_AUTO_START) { settings.flags |= BITFLAG_AUTO_START; }
+    if (DEFAULT_INVERT_ST_ENABLE) { settings.flags |= BITFLAG_INVERT_ST_ENABLE; }
+    if (DEFAULT_HARD_LIMIT_ENABLE) { settings.flags |= BITFLAG_HARD_LIMIT_ENABLE; }
+    if (DEFAULT_HOMING_ENABLE) { settings.flags |= BITFLAG_HOMING_ENABLE; }
+    settings.homing_dir_mask = DEFAULT_HOMING_DIR_MASK;
+    settings.homing_feed_rate = DEFAULT_HOMING_FEEDRATE;
+    settings.homing_seek_rate = DEFAULT_HOMING_RAPID_FEEDRATE;
+    settings.homing_debounce_delay = DEFAULT_HOMING_DEBOUNCE_DELAY;
+    settings.homing_pulloff = DEFAULT_HOMING_PULLOFF;
+    settings.stepper_idle_lock_time = DEFAULT_STEPPER_IDLE_LOCK_TIME;
+    settings.decimal_places = DEFAULT_DECIMAL_PLACES;
+    settings.n_arc_correction = DEFAULT_N_ARC_CORRECTION;
+  }
+  // Settings added in version 6. Migrated settings start from the old machine-wide seek rate and
+  // acceleration, so motion is unchanged until the per-axis limits are set.
+  if (version == 0) {
+    settings.max_rate[X_AXIS] = DEFAULT_X_MAX_RATE;
+    settings.max_rate[Y_AXIS] = DEFAULT_Y_MAX_RATE;
+    settings.max_rate[Z_AXIS] = DEFAULT_Z_MAX_RATE;
+    settings.max_acceleration[X_AXIS] = DEFAULT_X_ACCELERATION;
+    settings.max_acceleration[Y_AXIS] = DEFAULT_Y_ACCELERATION;
+    settings.max_acceleration[Z_AXIS] = DEFAULT_Z_ACCELERATION;
+  } else if (version < 6) {
+    uint8_t idx;
+    for (idx=0; idx<N_AXIS; idx++) {
+      settings.max_rate[idx] = settings.default_seek_rate;
+      settings.max_acceleration[idx] = settings.acceleration;
+    }
+  }
+  // Settings added in version 7
+  if (version < 7) {
+    settings.jerk = DEFAULT_JERK;
+  }
+  // Settings added in version 8
+  if (version < 8) {
+    settings.acceleration_ticks = ACCELERATION_TICKS_PER_SECOND;
+  }
+  // Settings added in version 9
+  if (version < 9) {
+    settings.arc_tolerance = DEFAULT_ARC_TOLERANCE;
+  }
+  // Settings added in version 10
+  if (version < 10) {
+    settings.merge_cos_angle = cos(DEFAULT_MERGE_ANGLE*M_PI/180);
+    settings.merge_deviation = DEFAULT_MERGE_DEVIATION;
+    settings.merge_steps = DEFAULT_MERGE_STEPS;
+  }
+  // Settings added in version 11
+  if (version < 11) {
+    settings.baud_rate = BAUD_RATE;
+  }
   write_global_settings();
 }
 
@@ -142,7 +197,43 @@ uint8_t read_global_settings() {
       if (!(memcpy_from_eeprom_with_checksum((char*)&settings, 1, sizeof(settings_v4_t)))) {
         return(false);
       }     
-      settings_reset(false); // Old settings ok. Write new settings only.
+      settings_reset(4); // Old settings ok. Write new settings only.
+    } else if (version == 5) {
+      // Migrate from settings version 5 to current version.
+      if (!(memcpy_from_eeprom_with_checksum((char*)&settings, EEPROM_ADDR_GLOBAL, SETTINGS_V5_SIZE))) {
+        return(false);
+      }     
+      settings_reset(5);
+    } else if (version == 6) {
+      // Migrate from settings version 6 to current version.
+      if (!(memcpy_from_eeprom_with_checksum((char*)&settings, EEPROM_ADDR_GLOBAL, SETTINGS_V6_SIZE))) {
+        return(false);
+      }     
+      settings_reset(6);
+    } else if (version == 7) {
+      // Migrate from settings version 7 to current version.
+      if (!(memcpy_from_eeprom_with_checksum((char*)&settings, EEPROM_ADDR_GLOBAL, SETTINGS_V7_SIZE))) {
+        return(false);
+      }     
+      settings_reset(7);
+    } else if (version == 8) {
+      // Migrate from settings version 8 to current version.
+      if (!(memcpy_from_eeprom_with_checksum((char*)&settings, EEPROM_ADDR_GLOBAL, SETTINGS_V8_SIZE))) {
+        return(false);
+      }     
+      settings_reset(8);
+    } else if (version == 9) {
+      // Migrate from settings version 9 to current version.
+      if (!(memcpy_from_eeprom_with_checksum((char*)&settings, EEPROM_ADDR_GLOBAL, SETTINGS_V9_SIZE))) {
+        return(false);
+      }     
+      settings_reset(9);
+    } else if (version == 10) {
+      // Migrate from settings version 10 to current version.
+      if (!(memcpy_from_eeprom_with_checksum((char*)&settings, EEPROM_ADDR_GLOBAL, SETTINGS_V10_SIZE))) {
+        return(false);
+      }     
+      settings_reset(10);
     } else {      
       return(false);
     }
@@ -166,7 +257,9 @@ uint8_t settings_store_global_setting(int parameter, float value) {
     case 7: settings.stepper_idle_lock_time = round(value); break;
     case 8: settings.acceleration = value*60*60; break; // Convert to mm/min^2 for grbl internal use.
     case 9: settings.junction_deviation = fabs(value); break;
-    case 10: settings.mm_per_arc_segment = value; break;
+    case 10: 
+      if (value <= 0.0) { return(STATUS_SETTING_VALUE_NEG); } 
+      settings.mm_per_arc_segment = value; break;
     case 11: settings.n_arc_correction = round(value); break;
     case 12: settings.decimal_places = round(value); break;
     case 13:
@@ -201,6 +294,38 @@ uint8_t settings_store_global_setting(int parameter, float value) {
       break;
     case 21: settings.homing_debounce_delay = round(value); break;
     case 22: settings.homing_pulloff = value; break;
+    case 23: case 24: case 25:
+      if (value <= 0.0) { return(STATUS_SETTING_VALUE_NEG); } 
+      settings.max_rate[parameter-23] = value; break;
+    case 26: case 27: case 28:
+      if (value <= 0.0) { return(STATUS_SETTING_VALUE_NEG); } 
+      settings.max_acceleration[parameter-26] = value*60*60; break; // Convert to mm/min^2 for grbl internal use.
+    case 29:
+      // Queued blocks are planned for the jerk. Only change it with none queued.
+      if (sys.state != STATE_IDLE && sys.state != STATE_ALARM) { return(STATUS_IDLE_ERROR); }
+      if (value < 0.0) { return(STATUS_SETTING_VALUE_NEG); } 
+      settings.jerk = value*60*60*60; break; // Convert to mm/min^3 for grbl internal use.
+    case 30:
+      // Queued blocks hold acceleration values per tick. Only change the tick rate with none queued.
+      if (sys.state != STATE_IDLE && sys.state != STATE_ALARM) { return(STATUS_IDLE_ERROR); }
+      if (value < 1 || value > 1000) { return(STATUS_SETTING_VALUE_RANGE); }
+      settings.acceleration_ticks = round(value); break;
+    case 31:
+      if (value <= 0.0) { return(STATUS_SETTING_VALUE_NEG); } 
+      settings.arc_tolerance = value; break;
+    case 32:
+      if (value < 0.0 || value > 90.0) { return(STATUS_SETTING_VALUE_RANGE); }
+      settings.merge_cos_angle = cos(value*M_PI/180); break; // Convert to cosine for grbl internal use.
+    case 33:
+      if (value < 0.0) { return(STATUS_SETTING_VALUE_NEG); } 
+      settings.merge_deviation = value; break;
+    case 34: 
+      if (value < 0 || value > 255) { return(STATUS_SETTING_VALUE_RANGE); }
+      settings.merge_steps = round(value); break;
+    case 35: // Applied upon reset, after the response to this command has gone out at the old rate.
+      if (value < 2400 || value > 1000000) { return(STATUS_SETTING_VALUE_RANGE); }
+      if (fabs(serial_baud_error(value)) > MAX_BAUD_ERROR) { return(STATUS_SETTING_VALUE_RANGE); }
+      settings.baud_rate = value; break;
     default: 
       return(STATUS_INVALID_STATEMENT);
   }
@@ -212,7 +337,7 @@ uint8_t settings_store_global_setting(int parameter, float value) {
 void settings_init() {
   if(!read_global_settings()) {
     report_status_message(STATUS_SETTING_READ_FAIL);
-    settings_reset(true);
+    settings_reset(0);
     report_grbl_settings();
   }
   // Read all parameter data into a dummy variable. If error, reset to zero, otherwise do nothing.
@@ -29,7 +29,7 @@
 
 // Version of the EEPROM data. Will be used to migrate existing data from older versions of Grbl
 // when firmware is upgraded. Always stored in byte 0 of eeprom
-#define SETTINGS_VERSION 5
+#define SETTINGS_VERSION 11
 
 // Define bit flag masks for the boolean settings in settings.flag.
 #define BITFLAG_REPORT_INCHES      bit(0)
@@ -62,7 +62,7 @@ typedef struct {
   float default_feed_rate;
   float default_seek_rate;
   uint8_t invert_mask;
-  float mm_per_arc_segment;
+  float mm_per_arc_segment;       // Shortest arc segment (mm)
   float acceleration;
   float junction_deviation;
   uint8_t flags;  // Contains default boolean settings
@@ -74,6 +74,15 @@ typedef struct {
   uint8_t stepper_idle_lock_time; // If max value 255, steppers do not disable.
   uint8_t decimal_places;
   uint8_t n_arc_correction;
+  float max_rate[N_AXIS];         // Per-axis speed limit (mm/min)
+  float max_acceleration[N_AXIS]; // Per-axis acceleration limit (mm/min^2)
+  float jerk;                     // S-curve acceleration jerk limit (mm/min^3). Zero for trapezoids.
+  uint16_t acceleration_ticks;    // Trapezoid generator updates per second
+  float arc_tolerance;            // Largest deviation of the arc segments from the true arc (mm)
+  float merge_cos_angle;          // Cosine of the largest direction change merged into one line
+  float merge_deviation;          // Largest deviation of a merged line from the lines it replaces (mm)
+  uint8_t merge_steps;            // Lines with fewer step events are merged whatever their direction
+  uint32_t baud_rate;             // Serial baud rate, applied upon reset
 //  uint8_t status_report_mask; // Mask to indicate desired report data.
 } settings_t;
 extern settings_t settings;
@@ -0,0 +1,32 @@
+(Straight moves for the acceleration check of grbl_sim -a, see 'make accel_check', which sets the jerk)
+(limit on the next line. Short moves have phases shorter than their ramps. There are no corners, which)
+(change the speed of each axis at once. A start from rest takes its first step at the minimum step rate)
+(and then catches up with the profile, so with ramps much shorter than that first step, or none, it is)
+(flagged as well.)
+$29=200
+$28=10
+G21 G90 G94
+G1 X10 F300
+G1 X10.2
+G1 X10.5
+G1 X12 F450
+G0 X0
+G1 X0.05 F400
+G0 X0.15
+G1 X0.4
+G1 X0.6 F100
+G1 X0.9 F400
+G1 X1.3 F200
+G1 X3
+G0 X3.5
+G0 X0
+G1 X5 Y5 F350
+G1 X5.3 Y5.3
+G1 X6 Y6 F200
+G0 X0 Y0
+G1 Z2 F300
+G1 Z2.1
+G0 Z0
+G0 Z0.4
+G0 Z5
+G1 Z0 F150
@@ -0,0 +1,33 @@
+/*
+  avr/interrupt.h - interrupt shim for the host-native simulator
+  Part of Grbl
+
+  Grbl is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Grbl is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Grbl.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef sim_avr_interrupt_h
+#define sim_avr_interrupt_h
+
+#include <avr/io.h>
+
+// The global interrupt flag is bit 7 of the simulated SREG. Enabling interrupts gives the
+// simulator a chance to dispatch anything that became pending while they were disabled.
+void sim_sei(void);
+#define sei() sim_sei()
+#define cli() (SREG &= ~0x80)
+
+#define ISR(vector, ...) void vector(void); void vector(void)
+#define SIGNAL(vector) void vector(void); void vector(void)
+
+#endif
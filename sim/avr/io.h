@@ -0,0 +1,275 @@
+/*
+  avr/io.h - ATmega328P register shim for the host-native simulator
+  Part of Grbl
+
+  Grbl is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Grbl is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Grbl.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Replaces avr-libc's <avr/io.h> when building with 'make sim'. The I/O registers used by
+// Grbl are plain memory in a single structure, so the simulator can detect register writes
+// by comparing it against a shadow copy. Registers whose reads have side effects (the timer
+// counters and the EEPROM control/data pair) go through accessor functions instead.
+
+#ifndef sim_avr_io_h
+#define sim_avr_io_h
+
+#include <inttypes.h>
+
+typedef struct {
+  uint8_t pinb, ddrb, portb;
+  uint8_t pinc, ddrc, portc;
+  uint8_t pind, ddrd, portd;
+  uint8_t pcicr, pcmsk0, pcmsk1, pcmsk2, pcifr;
+  uint8_t eicra, eimsk, eifr;
+  uint8_t tccr0a, tccr0b, ocr0a, ocr0b, timsk0, tifr0;
+  uint8_t tccr1a, tccr1b, tccr1c, timsk1, tifr1;
+  uint16_t ocr1a, ocr1b, icr1;
+  uint8_t tccr2a, tccr2b, ocr2a, ocr2b, timsk2, tifr2, assr;
+  uint8_t twbr, twsr, twar, twdr, twcr, twamr;
+  uint8_t ucsr0a, ucsr0b, ucsr0c, udr0;
+  uint8_t ubrr0l, ubrr0h; // Kept adjacent, little-endian, for the 16-bit UBRR0 alias.
+  uint8_t eecr, eedr;
+  uint16_t eear;
+  uint8_t sreg;
+} sim_io_t;
+
+extern volatile sim_io_t sim_io;
+
+volatile uint8_t *sim_tcnt0(void);
+volatile uint16_t *sim_tcnt1(void);
+volatile uint8_t *sim_tcnt2(void);
+volatile uint8_t *sim_eecr(void);
+volatile uint8_t *sim_eedr(void);
+
+#define _BV(bit) (1 << (bit))
+#define _SFR_BYTE(sfr) (sfr)
+#define bit_is_set(sfr, bit) (_SFR_BYTE(sfr) & _BV(bit))
+#define bit_is_clear(sfr, bit) (!(_SFR_BYTE(sfr) & _BV(bit)))
+
+#define PINB    sim_io.pinb
+#define DDRB    sim_io.ddrb
+#define PORTB   sim_io.portb
+#define PINC    sim_io.pinc
+#define DDRC    sim_io.ddrc
+#define PORTC   sim_io.portc
+#define PIND    sim_io.pind
+#define DDRD    sim_io.ddrd
+#define PORTD   sim_io.portd
+
+#define PCICR   sim_io.pcicr
+#define PCMSK0  sim_io.pcmsk0
+#define PCMSK1  sim_io.pcmsk1
+#define PCMSK2  sim_io.pcmsk2
+#define PCIFR   sim_io.pcifr
+#define EICRA   sim_io.eicra
+#define EIMSK   sim_io.eimsk
+#define EIFR    sim_io.eifr
+
+#define TCCR0A  sim_io.tccr0a
+#define TCCR0B  sim_io.tccr0b
+#define TCNT0   (*sim_tcnt0())
+#define OCR0A   sim_io.ocr0a
+#define OCR0B   sim_io.ocr0b
+#define TIMSK0  sim_io.timsk0
+#define TIFR0   sim_io.tifr0
+
+#define TCCR1A  sim_io.tccr1a
+#define TCCR1B  sim_io.tccr1b
+#define TCCR1C  sim_io.tccr1c
+#define TCNT1   (*sim_tcnt1())
+#define OCR1A   sim_io.ocr1a
+#define OCR1B   sim_io.ocr1b
+#define ICR1    sim_io.icr1
+#define TIMSK1  sim_io.timsk1
+#define TIFR1   sim_io.tifr1
+
+#define TCCR2A  sim_io.tccr2a
+#define TCCR2B  sim_io.tccr2b
+#define TCNT2   (*sim_tcnt2())
+#define OCR2A   sim_io.ocr2a
+#define OCR2B   sim_io.ocr2b
+#define TIMSK2  sim_io.timsk2
+#define TIFR2   sim_io.tifr2
+#define ASSR    sim_io.assr
+
+#define TWBR    sim_io.twbr
+#define TWSR    sim_io.twsr
+#define TWAR    sim_io.twar
+#define TWDR    sim_io.twdr
+#define TWCR    sim_io.twcr
+#define TWAMR   sim_io.twamr
+
+#define UCSR0A  sim_io.ucsr0a
+#define UCSR0B  sim_io.ucsr0b
+#define UCSR0C  sim_io.ucsr0c
+#define UDR0    sim_io.udr0
+#define UBRR0L  sim_io.ubrr0l
+#define UBRR0H  sim_io.ubrr0h
+#define UBRR0   (*(volatile uint16_t *)&sim_io.ubrr0l)
+
+#define EECR    (*sim_eecr())
+#define EEDR    (*sim_eedr())
+#define EEAR    sim_io.eear
+
+#define SREG    sim_io.sreg
+
+// Port pins
+#define PB0 0
+#define PB1 1
+#define PB2 2
+#define PB3 3
+#define PB4 4
+#define PB5 5
+#define PB6 6
+#define PB7 7
+#define PC0 0
+#define PC1 1
+#define PC2 2
+#define PC3 3
+#define PC4 4
+#define PC5 5
+#define PC6 6
+#define PD0 0
+#define PD1 1
+#define PD2 2
+#define PD3 3
+#define PD4 4
+#define PD5 5
+#define PD6 6
+#define PD7 7
+
+// External and pin change interrupts
+#define ISC00   0
+#define ISC01   1
+#define ISC10   2
+#define ISC11   3
+#define INT0    0
+#define INT1    1
+#define INTF0   0
+#define INTF1   1
+#define PCIE0   0
+#define PCIE1   1
+#define PCIE2   2
+
+// Timer/Counter0
+#define WGM00   0
+#define WGM01   1
+#define COM0B0  4
+#define COM0B1  5
+#define COM0A0  6
+#define COM0A1  7
+#define CS00    0
+#define CS01    1
+#define CS02    2
+#define WGM02   3
+#define TOIE0   0
+#define OCIE0A  1
+#define OCIE0B  2
+#define TOV0    0
+#define OCF0A   1
+#define OCF0B   2
+
+// Timer/Counter1
+#define WGM10   0
+#define WGM11   1
+#define COM1B0  4
+#define COM1B1  5
+#define COM1A0  6
+#define COM1A1  7
+#define CS10    0
+#define CS11    1
+#define CS12    2
+#define WGM12   3
+#define WGM13   4
+#define TOIE1   0
+#define OCIE1A  1
+#define OCIE1B  2
+#define TOV1    0
+#define OCF1A   1
+#define OCF1B   2
+
+// Timer/Counter2
+#define WGM20   0
+#define WGM21   1
+#define COM2B0  4
+#define COM2B1  5
+#define COM2A0  6
+#define COM2A1  7
+#define CS20    0
+#define CS21    1
+#define CS22    2
+#define WGM22   3
+#define TOIE2   0
+#define OCIE2A  1
+#define OCIE2B  2
+#define TOV2    0
+#define OCF2A   1
+#define OCF2B   2
+
+// Two-wire interface
+#define TWIE    0
+#define TWEN    2
+#define TWWC    3
+#define TWSTO   4
+#define TWSTA   5
+#define TWEA    6
+#define TWINT   7
+#define TWPS0   0
+#define TWPS1   1
+
+// USART0
+#define MPCM0   0
+#define U2X0    1
+#define UPE0    2
+#define DOR0    3
+#define FE0     4
+#define UDRE0   5
+#define TXC0    6
+#define RXC0    7
+#define TXB80   0
+#define RXB80   1
+#define UCSZ02  2
+#define TXEN0   3
+#define RXEN0   4
+#define UDRIE0  5
+#define TXCIE0  6
+#define RXCIE0  7
+#define UCSZ00  1
+#define UCSZ01  2
+
+// EEPROM
+#define EERE    0
+#define EEPE    1
+#define EEMPE   2
+#define EERIE   3
+#define EEPM0   4
+#define EEPM1   5
+
+// Interrupt vectors. ISR() declares these as plain functions; the simulator dispatches them.
+#define INT0_vect          sim_vect_int0
+#define INT1_vect          sim_vect_int1
+#define PCINT0_vect        sim_vect_pcint0
+#define PCINT1_vect        sim_vect_pcint1
+#define PCINT2_vect        sim_vect_pcint2
+#define TIMER2_COMPA_vect  sim_vect_timer2_compa
+#define TIMER2_OVF_vect    sim_vect_timer2_ovf
+#define TIMER1_COMPA_vect  sim_vect_timer1_compa
+#define TIMER1_OVF_vect    sim_vect_timer1_ovf
+#define TIMER0_COMPA_vect  sim_vect_timer0_compa
+#define TIMER0_OVF_vect    sim_vect_timer0_ovf
+#define USART_RX_vect      sim_vect_usart_rx
+#define USART_UDRE_vect    sim_vect_usart_udre
+#define TWI_vect           sim_vect_twi
+
+#endif
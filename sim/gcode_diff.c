@@ -0,0 +1,409 @@
+/*
+  gcode_diff.c - differential test of the g-code parser's fast path against its general path
+  Part of Grbl
+
+  Copyright (c) 2012 Chuck Harrison for http://opensourceecology.org/wiki/CNC_Torch_Table
+
+  Grbl is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Grbl is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Grbl.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Feeds a corpus of g-code lines through gc_execute_line() and writes down everything the parser
+   does: the arguments of every call it makes into motion control, the spindle, coolant and
+   coordinate data changes, the response to each line and the parser state after it. 'make
+   gcode_diff' builds this once as the firmware is and once with GCODE_NO_FAST_PATH, runs both and
+   compares the two records line by line. Any difference is a line the fast path gets wrong.
+
+   gcode.c and nuts_bolts.c are compiled into this file, as planner_bench.c does with the planner.
+   Lines are filtered the way protocol_process() does and placed in a read buffer sized like the
+   serial one, at the position where the previous line ended, so they wrap around its end as they
+   do in the firmware. Floats are written in hex (%a), so bit differences show.
+
+   The corpus is generated here, with a fixed pseudo-random sequence, so every run is the same:
+   micro-segment polylines in the modes the fast path covers, with and without G0/G1 words, arcs,
+   and fuzzed lines with bad words, malformed numbers, comments and M-codes. Each is run in normal mode and in check mode ($C), in
+   which the spindle and coolant are not switched. g-code files given on the command line are run
+   after it. */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <stdint.h>
+
+#include "gcode.c"
+#include "nuts_bolts.c"
+
+settings_t settings;
+system_t sys;
+volatile sim_io_t sim_io; // Not touched by the parser
+
+static const char *corpus; // Name of the corpus being run, for the record
+static uint32_t line_number;
+static uint8_t reset_pending;
+static uint32_t spindle_runs; // Calls to spindle_run(), applied or not. Only the general path makes them.
+
+// avr-libc soft-float helper that read_float() calls directly.
+float __floatunsisf(unsigned long value) { return((float)value); }
+
+
+/************** Recording stand-ins for the rest of the firmware ****************/
+
+static void record(const char *format, ...) __attribute__((format(printf, 1, 2)));
+static void record(const char *format, ...)
+{
+  va_list args;
+  printf("%s:%u ", corpus, line_number);
+  va_start(args, format);
+  vprintf(format, args);
+  va_end(args);
+  printf("\n");
+}
+
+void mc_line(float x, float y, float z, float feed_rate, uint8_t invert_feed_rate)
+{
+  record("mc_line %a %a %a %a %u", x, y, z, feed_rate, invert_feed_rate);
+}
+
+void mc_arc(float *position, float *target, float *offset, uint8_t axis_0, uint8_t axis_1,
+  uint8_t axis_linear, float feed_rate, uint8_t invert_feed_rate, float radius, uint8_t isclockwise)
+{
+  record("mc_arc %a %a %a > %a %a %a @ %a %a %a %u%u%u %a %u %a %u", position[X_AXIS], position[Y_AXIS],
+    position[Z_AXIS], target[X_AXIS], target[Y_AXIS], target[Z_AXIS], offset[X_AXIS], offset[Y_AXIS],
+    offset[Z_AXIS], axis_0, axis_1, axis_linear, feed_rate, invert_feed_rate, radius, isclockwise);
+}
+
+void mc_dwell(float seconds) { record("mc_dwell %a", seconds); }
+void mc_line_flush() { record("mc_line_flush"); }
+void mc_arc_finish() { record("mc_arc_finish"); }
+void plan_synchronize() { record("plan_synchronize"); }
+void mc_reset() { record("mc_reset"); reset_pending = true; }
+void mc_set_current_position(int32_t x, int32_t y, int32_t z) { }
+void plan_set_current_position(int32_t x, int32_t y, int32_t z) { }
+void sim_delay_cycles(uint32_t cycles) { }
+void report_status_message(uint8_t status_code) { record("report_status_message %u", status_code); }
+
+// The spindle and coolant only act, and are only recorded, when their state changes. Calls that
+// change nothing are what the fast path leaves out.
+static int8_t spindle_direction;
+static uint8_t coolant_mode;
+
+void spindle_run(int8_t direction)
+{
+  spindle_runs++;
+  if (direction != spindle_direction) {
+    record("spindle_run %d", direction);
+    spindle_direction = direction;
+  }
+}
+int8_t spindle_queued_direction() { return(spindle_direction); }
+
+void coolant_run(uint8_t mode)
+{
+  if (mode != coolant_mode) {
+    record("coolant_run %u", mode);
+    coolant_mode = mode;
+  }
+}
+uint8_t coolant_current_mode() { return(coolant_mode); }
+
+// Coordinate data, as stored in EEPROM: G54-G59, then G28 and G30.
+static float coord_data[N_COORDINATE_SYSTEM+2][N_AXIS];
+
+uint8_t settings_read_coord_data(uint8_t coord_select, float *data)
+{
+  memcpy(data, coord_data[coord_select], sizeof(coord_data[0]));
+  return(true);
+}
+
+void settings_write_coord_data(uint8_t coord_select, float *data)
+{
+  record("settings_write_coord_data %u %a %a %a", coord_select, data[X_AXIS], data[Y_AXIS], data[Z_AXIS]);
+  memcpy(coord_data[coord_select], data, sizeof(coord_data[0]));
+}
+
+
+/************** Running lines ****************/
+
+uint8_t rx_buffer[RX_BUFFER_SIZE]; // As in serial.c
+static uint8_t rx_index; // Where the next line starts
+
+// Power up or reset, as main() does, into normal or check mode.
+static void diff_reset(uint8_t state)
+{
+  uint8_t i;
+  memset(&sys, 0, sizeof(sys));
+  sys.state = state;
+  spindle_direction = 0;
+  coolant_mode = COOLANT_DISABLE;
+  memset(coord_data, 0, sizeof(coord_data));
+  for (i=0; i<N_AXIS; i++) {
+    coord_data[1][i] = 10.5*(i+1);  // G55
+    coord_data[2][i] = -3.25*(i+1); // G56
+    coord_data[SETTING_INDEX_G28][i] = 1.0*i;
+    coord_data[SETTING_INDEX_G30][i] = -2.0*i;
+  }
+  gc_init();
+  reset_pending = false;
+}
+
+static void record_state(uint8_t status_code)
+{
+  record("= %u | %u %u %u %u %u %d %u %a %a | %a %a %a | %u %u%u%u %u | %a %a %a | %a %a %a", status_code,
+    gc.status_code, gc.motion_mode, gc.inverse_feed_rate_mode, gc.inches_mode, gc.absolute_mode,
+    gc.spindle_direction, gc.coolant_mode, gc.path_tolerance, gc.feed_rate,
+    gc.position[X_AXIS], gc.position[Y_AXIS], gc.position[Z_AXIS], gc.tool, gc.plane_axis_0,
+    gc.plane_axis_1, gc.plane_axis_2, gc.coord_select, gc.coord_system[X_AXIS], gc.coord_system[Y_AXIS],
+    gc.coord_system[Z_AXIS], gc.coord_offset[X_AXIS], gc.coord_offset[Y_AXIS], gc.coord_offset[Z_AXIS]);
+}
+
+static uint32_t lines_run, fast_lines;
+
+// Filters a line into the read buffer like protocol_process(): whitespace, control characters,
+// block deletes and comments go, letters are upcased. Then executes and records it.
+static void run_line(const char *line)
+{
+  uint8_t start = rx_index, end = rx_index, length = 0, iscomment = false;
+  line_number++;
+  for (; *line && *line != '\n' && *line != '\r'; line++) {
+    char c = *line;
+    if (iscomment) {
+      if (c == ')') { iscomment = false; }
+    } else if (c <= ' ' || c == '/') {
+    } else if (c == '(') {
+      iscomment = true;
+    } else if (length < RX_BUFFER_SIZE-1) {
+      if (c >= 'a' && c <= 'z') { c += 'A'-'a'; }
+      rx_buffer[end] = c;
+      end = serial_next_index(end);
+      length++;
+    }
+  }
+  rx_buffer[end] = 0;
+  rx_index = serial_next_index(end);
+  if (length == 0 || rx_buffer[start] == '$') { return; } // Not for the parser
+
+  uint32_t runs = spindle_runs;
+  uint8_t status_code = gc_execute_line((char *)rx_buffer, start);
+  record_state(status_code);
+  lines_run++;
+  if (status_code == STATUS_OK && sys.state != STATE_CHECK_MODE && runs == spindle_runs) { fast_lines++; }
+  if (reset_pending) { diff_reset(sys.state); }
+}
+
+static void run_linef(const char *format, ...) __attribute__((format(printf, 1, 2)));
+static void run_linef(const char *format, ...)
+{
+  char line[256];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(line, sizeof(line), format, args);
+  va_end(args);
+  run_line(line);
+}
+
+
+/************** Corpus ****************/
+
+// A small fixed pseudo-random sequence, independent of the C library.
+static uint32_t random_state;
+static uint32_t random_next(uint32_t n)
+{
+  random_state = random_state*1103515245 + 12345;
+  return((random_state >> 8) % n);
+}
+
+// Micro-segment polylines, as CAM output streams them, in the modes and word orders the fast path
+// takes, with the mode changes between them left to the general path.
+static void corpus_micro()
+{
+  uint32_t i;
+  float t, r;
+  run_line("G21 G90 G1 F1500");
+  for (i=0; i<600; i++) {
+    t = i*0.05/20.0;
+    r = 20.0 + 5.0*sin(3*t);
+    if (i % 97 == 0) { run_linef("N%u X%.3f Y%.3f", i, r*cos(t), r*sin(t)); }
+    else if (i % 50 == 0) { run_linef("X%.3f Y%.3f F%u", r*cos(t), r*sin(t), 800 + i); }
+    else if (i % 13 == 0) { run_linef("  y%.4f x%.4f ", r*sin(t), r*cos(t)); }
+    else if (i % 31 == 0) { run_linef("G1X%.3fY%.3fZ%.3f", r*cos(t), r*sin(t), 0.01*(i % 7)); }
+    else { run_linef("X%.3f Y%.3f", r*cos(t), r*sin(t)); }
+  }
+  run_line("M3");
+  run_line("M8 (coolant on)");
+  for (i=0; i<100; i++) { run_linef("X%.3f Y%.3f", 0.05*i, 0.02*i*i); }
+  run_line("G91");
+  for (i=0; i<100; i++) { run_linef("X0.05 Y%.3f", (i % 2) ? 0.013 : -0.007); }
+  run_line("G90 G20");
+  for (i=0; i<100; i++) { run_linef("X%.4f Y%.4f F%u", 0.002*i, 0.001*i, 20 + i % 3); }
+  run_line("G21 G55");
+  for (i=0; i<100; i++) { run_linef("X%.3f Z%.3f", 0.05*i, -0.01*i); }
+  run_line("G92 X0 Y0");
+  for (i=0; i<100; i++) { run_linef("Y%.3f", -0.05*i); }
+  run_line("G92.1 G54 G0");
+  for (i=0; i<100; i++) { run_linef("X%u Y%u Z%u", i % 17, (i*7) % 23, i % 3); }
+  run_line("M5 M9");
+  run_line("G1 F600");
+  for (i=0; i<100; i++) { run_linef("X%.3f Y%.3f", 5 + 0.05*i, 5 - 0.05*i); }
+  for (i=0; i<100; i++) { // Repeated and switching motion words, as many CAM programs write them
+    if (i % 5 == 0) { run_linef("G0 X%u Y%u", i % 11, i % 7); }
+    else if (i % 9 == 0) { run_linef("X%.3f G1 Y%.3f F%u", 0.1*i, 0.2*i, 300 + i); }
+    else if (i % 7 == 0) { run_linef("G01 X%.3f", 0.1*i); }
+    else { run_linef("G1 X%.3f Y%.3f F300", 0.1*i, -0.1*i); }
+  }
+  run_line("G1.0 X1");
+  run_line("G0.0 Y1");
+  run_line("G1.5 X2"); // Taken as G1 by the general path
+  run_line("G1 G1 X3"); // Modal group violation
+  run_line("G0 G1 X4");
+  run_line("G1 Y5 G0");
+  run_line("G2 X1 Y1 R3 G1"); // Modal group violation
+  run_line("G1");
+  run_line("G0 F500");
+  run_line("G93 G1 X1 Y1 F2"); // Inverse time takes the general path
+  run_line("X2 Y2 F3");
+  run_line("X3 Y3");
+  run_line("G94");
+  run_line("M0");
+  for (i=0; i<20; i++) { run_linef("X%u", i); }
+  run_line("M2"); // Resets the parser
+  for (i=0; i<20; i++) { run_linef("X%u Y%u", i, i); }
+}
+
+// Arcs in each plane, center and radius format, full circles and helices. Modal lines that follow
+// an arc stay in the arc mode, which the fast path leaves alone.
+static void corpus_arcs()
+{
+  uint32_t i;
+  run_line("G21 G90 G17 G1 X10 Y0 F1000");
+  run_line("G2 X10 Y0 I-10 J0");
+  run_line("G3 X0 Y10 I-10 J0");
+  run_line("G2 X10 Y0 R10");
+  run_line("G3 X0 Y10 R-10");
+  run_line("G2 X5 Y5 R1"); // Radius too small
+  run_line("X10 Y0 I-5"); // Modal arc
+  run_line("X20 Y0"); // Modal arc without an offset
+  run_line("G18 G2 X0 Z10 I-10 K5");
+  run_line("G19 G3 Y0 Z0 J-5 K-5 X3"); // Helix
+  run_line("G17 G1 X0 Y0 Z0");
+  for (i=0; i<200; i++) {
+    float a = i*0.1;
+    if (i % 4 == 0) { run_linef("G2 X%.3f Y%.3f I%.3f J%.3f", 10*cos(a), 10*sin(a), -10*cos(a), -10*sin(a)); }
+    else if (i % 4 == 1) { run_linef("G3 X%.3f Y%.3f R%.3f F%u", 5*cos(a), 5*sin(a), 7.5, 500 + i); }
+    else if (i % 4 == 2) { run_linef("G1 X%.3f Y%.3f", cos(a), sin(a)); }
+    else { run_linef("X%.3f Y%.3f", 2*cos(a), 2*sin(a)); }
+  }
+  run_line("G93 G2 X0 Y0 I1 J1 F0.5");
+  run_line("G94 G80");
+  run_line("X1"); // Axis words with motion canceled
+  run_line("G1 X1");
+}
+
+// Fuzzed lines: mostly the shapes the fast path takes, then any word with any value, malformed
+// numbers, unknown letters, comments, block deletes, lowercase and spaces.
+static void corpus_fuzz(uint32_t seed, uint32_t n_lines)
+{
+  static const char letters[] = "XXXXYYYYZZFFNGGMIJKRPSTLQE@#1.";
+  static const char *g_words[] = { "0", "1", "2", "3", "4", "10", "17", "18", "19", "20", "21", "28", "28.1",
+    "30", "30.1", "53", "54", "55", "61", "61.1", "64", "80", "90", "91", "92", "92.1", "93", "94", "5",
+    "28.5", "92.3", "01", "1.0" };
+  static const char *motion_words[] = { "0", "1", "01", "1.0", "00", "0.5", "1.5", "2", "-1" };
+  static const char *m_words[] = { "0", "1", "2", "3", "4", "5", "7", "8", "9", "30", "99", "03" };
+  static const char *numbers[] = { "", "-", "+", ".", "-.", "1..2", ".5.", "1e3", "--1", "0", "-0", "+2.5",
+    "00012.500", "123456789", ".0001", "3", "-7" };
+  uint32_t i, w;
+  random_state = seed;
+  for (i=0; i<n_lines; i++) {
+    char line[160];
+    uint8_t n = 0, n_words = random_next(7);
+    uint8_t shaped = (random_next(10) < 5); // Axis, F, N and motion words only
+    for (w=0; w<n_words && n < sizeof(line)-40; w++) {
+      char letter = shaped ? "XYZXYZFNXYG"[random_next(11)] : letters[random_next(sizeof(letters)-1)];
+      if (random_next(8) == 0) { letter += 'a'-'A'; if (letter < 'a') { letter = 'x'; } }
+      if (random_next(12) == 0) { line[n++] = ' '; }
+      if (random_next(40) == 0) { n += sprintf(line+n, "(note %u)", i); }
+      if (random_next(60) == 0) { line[n++] = '/'; }
+      line[n++] = letter;
+      if (random_next(12) == 0) { line[n++] = ' '; }
+      if ((letter == 'G' || letter == 'g') && shaped) {
+        n += sprintf(line+n, "%s", motion_words[random_next(sizeof(motion_words)/sizeof(motion_words[0]))]);
+      } else if (letter == 'G' || letter == 'g') {
+        n += sprintf(line+n, "%s", g_words[random_next(sizeof(g_words)/sizeof(g_words[0]))]);
+      } else if (letter == 'M' || letter == 'm') {
+        n += sprintf(line+n, "%s", m_words[random_next(sizeof(m_words)/sizeof(m_words[0]))]);
+      } else if (random_next(6) == 0) {
+        n += sprintf(line+n, "%s", numbers[random_next(sizeof(numbers)/sizeof(numbers[0]))]);
+      } else {
+        n += sprintf(line+n, "%.*f", (int)random_next(5), ((int32_t)random_next(200000)-100000)*0.001);
+      }
+    }
+    line[n] = 0;
+    run_line(line);
+  }
+}
+
+static void run_corpus(const char *name, void (*generate)(void), uint8_t state)
+{
+  char label[32];
+  snprintf(label, sizeof(label), "%s%s", name, state == STATE_CHECK_MODE ? "/check" : "");
+  corpus = label;
+  line_number = 0;
+  diff_reset(state);
+  generate();
+}
+
+static uint32_t fuzz_seed;
+static void corpus_fuzz_seeded() { corpus_fuzz(fuzz_seed, 700); }
+
+static char *recorded_file;
+static void corpus_recorded()
+{
+  char line[256];
+  FILE *f = fopen(recorded_file, "r");
+  if (!f) { perror(recorded_file); exit(1); }
+  while (fgets(line, sizeof(line), f)) { run_line(line); }
+  fclose(f);
+}
+
+int main(int argc, char *argv[])
+{
+  uint8_t mode, i;
+  const uint8_t states[2] = { STATE_IDLE, STATE_CHECK_MODE };
+
+  settings.steps_per_mm[X_AXIS] = DEFAULT_X_STEPS_PER_MM;
+  settings.steps_per_mm[Y_AXIS] = DEFAULT_Y_STEPS_PER_MM;
+  settings.steps_per_mm[Z_AXIS] = DEFAULT_Z_STEPS_PER_MM;
+  settings.default_feed_rate = DEFAULT_FEEDRATE;
+  settings.default_seek_rate = DEFAULT_RAPID_FEEDRATE;
+  settings.junction_deviation = DEFAULT_JUNCTION_DEVIATION;
+
+  for (mode=0; mode<2; mode++) {
+    run_corpus("micro", corpus_micro, states[mode]);
+    run_corpus("arcs", corpus_arcs, states[mode]);
+    for (i=1; i<=6; i++) {
+      char name[16];
+      snprintf(name, sizeof(name), "fuzz%u", i);
+      fuzz_seed = i*7919;
+      run_corpus(name, corpus_fuzz_seeded, states[mode]);
+    }
+    for (i=1; i<argc; i++) {
+      recorded_file = argv[i];
+      const char *name = strrchr(recorded_file, '/');
+      run_corpus(name ? name+1 : recorded_file, corpus_recorded, states[mode]);
+    }
+  }
+  fprintf(stderr, "gcode_diff: %u lines parsed, %u by the fast path\n", lines_run, fast_lines);
+  return(0);
+}
@@ -0,0 +1,416 @@
+/*
+  planner_bench.c - host benchmark of plan_buffer_line() and planner_recalculate()
+  Part of Grbl
+
+  Copyright (c) 2012 Chuck Harrison for http://opensourceecology.org/wiki/CNC_Torch_Table
+
+  Grbl is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Grbl is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Grbl.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Replays CAM-style workloads through the planner and reports the cost per planned block and the
+   worst-case cost of a full-buffer replan. 'make bench' builds one binary per BLOCK_BUFFER_SIZE
+   in BENCH_BUFFER_SIZES and runs them all.
+
+   planner.c and motion_control.c are compiled into this file so the static planner internals are
+   reachable and mc_arc() can be driven directly. Both are instrumented with the same basic block
+   hook as grbl_sim; the number of basic blocks executed is the primary, fully repeatable cost
+   measure. Host nanoseconds are reported alongside for reference (minimum over several runs, so
+   they are reasonably stable, but they include the hook and are not AVR cycles). Soft-float cost
+   is not modelled by either measure: compare planner variants against each other, not against
+   the AVR step rate.
+
+   The stepper is stood in for by discarding the oldest block whenever the buffer is full, so the
+   planner always works against a full buffer in steady state, as it does on long jobs.
+
+   Binaries built with PLANNER_FIXED_POINT also check every trapezoid in the buffer after each call
+   (outside the measurement) against the floating point formulas, and report the largest
+   difference in steps. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <math.h>
+#include <stdint.h>
+
+// Count square roots: a soft-float sqrt() costs the AVR far more than its single basic block here.
+static volatile uint64_t sqrt_count;
+__attribute__((no_sanitize_coverage))
+static double bench_sqrt(double x) { sqrt_count++; return(sqrt(x)); }
+#define sqrt bench_sqrt
+
+#include "planner.c"
+
+// Route mc_line()'s calls through the timing wrapper below.
+uint8_t bench_plan_buffer_line(float x, float y, float z, float feed_rate, uint8_t invert_feed_rate);
+#define plan_buffer_line bench_plan_buffer_line
+#include "motion_control.c"
+#undef plan_buffer_line
+
+#define BENCH_RUNS 5
+#define MAX_CALLS 200000
+
+settings_t settings;
+system_t sys;
+parser_state_t gc; // Only the path control mode is read, which stays exact path (G61).
+volatile sim_io_t sim_io; // Touched only by mc_go_home(), which is never called here.
+
+static volatile uint64_t bb_count; // Hook calls are inserted after optimization, so the compiler cannot see them.
+static uint8_t recording;
+static uint32_t n_calls;
+static uint64_t call_bb[MAX_CALLS];
+static uint64_t call_ns[MAX_CALLS];
+static uint64_t sqrt_total;
+static int32_t steps_error; // Largest trapezoid difference from the floating point planner (steps)
+
+#ifdef PLANNER_FIXED_POINT
+  #define BENCH_ARITHMETIC "fixed"
+#else
+  #define BENCH_ARITHMETIC "float"
+#endif
+
+// The hook and the timer sit in an instrumented file, so both must opt out of the instrumentation.
+__attribute__((no_sanitize_coverage))
+void __sanitizer_cov_trace_pc(void) { bb_count++; }
+
+__attribute__((no_sanitize_coverage))
+static uint64_t now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return((uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec);
+}
+
+#ifdef PLANNER_FIXED_POINT
+// Recompute the step counts of every buffered trapezoid from its rates the way the floating point
+// planner does, and track the largest difference.
+__attribute__((no_sanitize_coverage))
+static void check_trapezoids()
+{
+  uint8_t block_index = block_buffer_tail;
+  while (block_index != block_buffer_head) {
+    block_t *block = &block_buffer[block_index];
+    double acceleration = block->rate_delta*settings.acceleration_ticks*60.0;
+    double initial = block->initial_rate, final = block->final_rate, nominal = block->nominal_rate;
+    int32_t accelerate_steps = ceil((nominal*nominal-initial*initial)/(2*acceleration));
+    int32_t decelerate_steps = floor((nominal*nominal-final*final)/(2*acceleration));
+    int32_t plateau_steps = block->step_event_count-accelerate_steps-decelerate_steps;
+    if (plateau_steps < 0) {
+      accelerate_steps = ceil((2*acceleration*block->step_event_count-initial*initial+final*final)/(4*acceleration));
+      accelerate_steps = max(accelerate_steps,0);
+      accelerate_steps = min(accelerate_steps,block->step_event_count);
+      plateau_steps = 0;
+    }
+    int32_t error = labs(accelerate_steps - (int32_t)block->accelerate_until);
+    if (error > steps_error) { steps_error = error; }
+    error = labs(accelerate_steps+plateau_steps - (int32_t)block->decelerate_after);
+    if (error > steps_error) { steps_error = error; }
+    block_index = next_block_index(block_index);
+  }
+}
+#endif
+
+__attribute__((no_sanitize_coverage))
+uint8_t bench_plan_buffer_line(float x, float y, float z, float feed_rate, uint8_t invert_feed_rate)
+{
+  uint64_t bb = bb_count;
+  uint64_t sq = sqrt_count;
+  uint64_t t = now_ns();
+  uint8_t line_complete = plan_buffer_line(x, y, z, feed_rate, invert_feed_rate);
+  t = now_ns() - t;
+  bb = bb_count - bb;
+  if (recording && n_calls < MAX_CALLS) {
+    // Keep the fastest of the repeated runs for each call; the block sequence is identical.
+    if (!call_ns[n_calls] || t < call_ns[n_calls]) { call_ns[n_calls] = t; }
+    call_bb[n_calls] = bb;
+    sqrt_total += sqrt_count - sq;
+  }
+  n_calls++;
+  #ifdef PLANNER_FIXED_POINT
+    if (recording) { check_trapezoids(); }
+  #endif
+  return(line_complete);
+}
+
+// Stand-ins for the rest of the firmware. mc_line() waits in protocol_execute_runtime() for
+// buffer space; consuming a block there plays the part of the stepper.
+void protocol_execute_runtime()
+{
+  if (plan_check_full_buffer()) { plan_discard_current_block(); }
+}
+void st_cycle_start() { }
+void st_go_idle() { }
+void st_reset() { }
+void st_feed_hold() { }
+void spindle_stop() { }
+int8_t spindle_queued_direction() { return(0); }
+void coolant_stop() { }
+void limits_go_home() { }
+void sim_delay_cycles(uint32_t cycles) { }
+void delay_ms(uint16_t ms) { }
+void gc_set_current_position(int32_t x, int32_t y, int32_t z) { }
+void sys_sync_current_position() { }
+
+static void bench_settings_init()
+{
+  settings.steps_per_mm[X_AXIS] = DEFAULT_X_STEPS_PER_MM;
+  settings.steps_per_mm[Y_AXIS] = DEFAULT_Y_STEPS_PER_MM;
+  settings.steps_per_mm[Z_AXIS] = DEFAULT_Z_STEPS_PER_MM;
+  settings.default_feed_rate = DEFAULT_FEEDRATE;
+  settings.default_seek_rate = DEFAULT_RAPID_FEEDRATE;
+  settings.acceleration = DEFAULT_ACCELERATION;
+  settings.max_rate[X_AXIS] = DEFAULT_X_MAX_RATE;
+  settings.max_rate[Y_AXIS] = DEFAULT_Y_MAX_RATE;
+  settings.max_rate[Z_AXIS] = DEFAULT_Z_MAX_RATE;
+  settings.max_acceleration[X_AXIS] = DEFAULT_X_ACCELERATION;
+  settings.max_acceleration[Y_AXIS] = DEFAULT_Y_ACCELERATION;
+  settings.max_acceleration[Z_AXIS] = DEFAULT_Z_ACCELERATION;
+  settings.mm_per_arc_segment = DEFAULT_MM_PER_ARC_SEGMENT;
+  settings.arc_tolerance = DEFAULT_ARC_TOLERANCE;
+  settings.merge_cos_angle = cos(DEFAULT_MERGE_ANGLE*M_PI/180);
+  settings.merge_deviation = DEFAULT_MERGE_DEVIATION;
+  settings.merge_steps = DEFAULT_MERGE_STEPS;
+  settings.junction_deviation = DEFAULT_JUNCTION_DEVIATION;
+  settings.acceleration_ticks = ACCELERATION_TICKS_PER_SECOND;
+  settings.n_arc_correction = DEFAULT_N_ARC_CORRECTION;
+  settings.flags = 0;
+  if (DEFAULT_AUTO_START) { settings.flags |= BITFLAG_AUTO_START; }
+}
+
+
+/************** Workloads ****************/
+
+static float position[3];
+
+static void line_to(float x, float y, float z, float feed_rate)
+{
+  mc_line(x, y, z, feed_rate, false);
+  position[X_AXIS] = x; position[Y_AXIS] = y; position[Z_AXIS] = z;
+}
+
+static void arc_to(float x, float y, float i, float j, uint8_t isclockwise, float feed_rate)
+{
+  float target[3] = { x, y, position[Z_AXIS] };
+  float offset[3] = { i, j, 0 };
+  mc_arc(position, target, offset, X_AXIS, Y_AXIS, Z_AXIS, feed_rate, false, hypot(i,j), isclockwise);
+  mc_arc_finish();
+  memcpy(position, target, sizeof(target));
+}
+
+// Dense polyline: a 0.05 mm chord approximation of a rounded, varying-curvature outline, the way
+// CAM post-processors emit splines and engraved text.
+static void workload_polyline()
+{
+  uint32_t i, n = 20000;
+  for (i=0; i<=n; i++) {
+    float t = i*0.05/20.0;
+    float r = 20.0 + 5.0*sin(3*t);
+    line_to(r*cos(t), r*sin(t), 0, 1500);
+  }
+}
+
+// Arc-derived segment streams: full circles and quarter arcs of several radii, through mc_arc().
+static void workload_arcs()
+{
+  float r;
+  for (r=2.0; r<=50.0; r*=1.6) {
+    line_to(r, 0, 0, 1500);
+    arc_to(r, 0, -r, 0, true, 1000);  // Full circle
+    arc_to(0, r, -r, 0, false, 1000); // Quarter arc back the other way
+  }
+}
+
+// Zig-zag pocketing: long raster passes with a 0.5 mm step-over and sharp reversals.
+static void workload_zigzag()
+{
+  float y;
+  uint8_t dir = 0;
+  for (y=0; y<=60.0; y+=0.5) {
+    line_to(dir ? 0 : 80.0, y, 0, 1200);
+    line_to(dir ? 0 : 80.0, y+0.5, 0, 1200);
+    dir = !dir;
+  }
+}
+
+// Long rapids between widely spaced points, with plunges.
+static void workload_rapids()
+{
+  uint16_t i;
+  for (i=0; i<400; i++) {
+    float x = (i*37 % 600) - 300;
+    float y = (i*91 % 400) - 200;
+    line_to(x, y, 5, settings.default_seek_rate);
+    line_to(x, y, -2, 300);
+    line_to(x, y, 5, settings.default_seek_rate);
+  }
+}
+
+// Recorded workload: G0/G1 lines of a g-code file (absolute mm, XYZF words only).
+static char *recorded_file;
+static void workload_recorded()
+{
+  FILE *f = fopen(recorded_file, "r");
+  char line[256];
+  float target[3] = { 0, 0, 0 };
+  float feed_rate = settings.default_feed_rate;
+  uint8_t rapid = false;
+  if (!f) { perror(recorded_file); exit(1); }
+  memset(position, 0, sizeof(position));
+  while (fgets(line, sizeof(line), f)) {
+    char *p = line;
+    uint8_t motion = false;
+    while (*p) {
+      char letter = *p++;
+      if (letter == '(' || letter == ';') { break; }
+      if (letter >= 'a' && letter <= 'z') { letter -= 'a'-'A'; }
+      if (letter < 'A' || letter > 'Z') { continue; }
+      float value = strtod(p, &p);
+      switch (letter) {
+        case 'G':
+          if (value == 0) { rapid = true; } else if (value == 1) { rapid = false; }
+          break;
+        case 'X': target[X_AXIS] = value; motion = true; break;
+        case 'Y': target[Y_AXIS] = value; motion = true; break;
+        case 'Z': target[Z_AXIS] = value; motion = true; break;
+        case 'F': feed_rate = value; break;
+      }
+    }
+    if (motion) {
+      line_to(target[X_AXIS], target[Y_AXIS], target[Z_AXIS], rapid ? settings.default_seek_rate : feed_rate);
+    }
+  }
+  fclose(f);
+}
+
+
+/************** Measurement ****************/
+
+static void bench_reset()
+{
+  plan_init();
+  mc_init();
+  memset(position, 0, sizeof(position));
+  memset(&sys, 0, sizeof(sys));
+  sys.auto_start = true;
+  sys.feed_override = 100; // As main() resets them. At 0 every block would plan at zero speed.
+  sys.rapid_override = 100;
+  n_calls = 0;
+}
+
+static void run_workload(const char *name, void (*workload)(void))
+{
+  uint8_t run;
+  uint32_t i, calls;
+  memset(call_ns, 0, sizeof(call_ns));
+  sqrt_total = 0;
+  steps_error = 0;
+  for (run=0; run<BENCH_RUNS; run++) {
+    bench_reset();
+    recording = true;
+    workload();
+    mc_line_flush();
+    recording = false;
+  }
+  calls = n_calls < MAX_CALLS ? n_calls : MAX_CALLS;
+  uint64_t bb_total = 0, ns_total = 0, bb_max = 0, ns_max = 0;
+  for (i=0; i<calls; i++) {
+    bb_total += call_bb[i];
+    ns_total += call_ns[i];
+    if (call_bb[i] > bb_max) { bb_max = call_bb[i]; }
+    if (call_ns[i] > ns_max) { ns_max = call_ns[i]; }
+  }
+  printf("%-10s %-5s %4d %8u %10.1f %10llu %10.1f %10llu %8.2f %5d\n", name, BENCH_ARITHMETIC, BLOCK_BUFFER_SIZE, calls,
+    calls ? (double)bb_total/calls : 0, (unsigned long long)bb_max,
+    calls ? (double)ns_total/calls : 0, (unsigned long long)ns_max,
+    calls ? (double)sqrt_total/calls/BENCH_RUNS : 0, steps_error);
+}
+
+// Worst case for planner_recalculate(): a full buffer in which every junction must be revisited
+// and every trapezoid regenerated.
+__attribute__((no_sanitize_coverage))
+static void run_worst_case_recalculate()
+{
+  uint8_t run;
+  uint64_t bb = 0, ns = 0, sq = 0;
+  for (run=0; run<BENCH_RUNS; run++) {
+    bench_reset();
+    uint32_t i = 0;
+    while (!plan_check_full_buffer()) {
+      // Short collinear-ish segments at a feed the buffer cannot reach: all junctions are limited
+      // by the reverse pass and none is marked nominal-length.
+      bench_plan_buffer_line(0.05*(i+1), 0.01*(i%2), 0, 3000, false);
+      i++;
+    }
+    // Drop every entry speed after the first block and forget what was optimally planned, so the
+    // reverse pass has to raise every junction and neither pass can stop early.
+    uint8_t block_index = next_block_index(block_buffer_tail);
+    while (block_index != block_buffer_head) {
+      block_buffer[block_index].entry_speed_sqr = 0.0;
+      block_buffer[block_index].flags = BLOCK_FLAG_RECALCULATE;
+      block_index = next_block_index(block_index);
+    }
+    block_buffer_planned = block_buffer_tail;
+    uint64_t b = bb_count;
+    sq = sqrt_count;
+    uint64_t t = now_ns();
+    planner_recalculate();
+    t = now_ns() - t;
+    b = bb_count - b;
+    sq = sqrt_count - sq;
+    bb = b;
+    if (!ns || t < ns) { ns = t; }
+  }
+  printf("%-10s %-5s %4d %8d %10s %10llu %10s %10llu %8llu %5s\n", "recalc-max", BENCH_ARITHMETIC,
+    BLOCK_BUFFER_SIZE, BLOCK_BUFFER_SIZE-1, "-", (unsigned long long)bb, "-", (unsigned long long)ns,
+    (unsigned long long)sq, "-");
+}
+
+static void usage()
+{
+  fprintf(stderr, "usage: planner_bench [-H] [gcode_file ...]\n"
+                  "  -H  omit the column header\n");
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  int opt;
+  uint8_t header = true;
+  while ((opt = getopt(argc, argv, "H")) != -1) {
+    switch (opt) {
+      case 'H': header = false; break;
+      default: usage();
+    }
+  }
+  bench_settings_init();
+  if (header) {
+    printf("# bb = basic blocks executed per plan_buffer_line() call, ns = host time (min of %d runs),\n"
+           "# sqrt = sqrt() calls per plan_buffer_line() call,\n"
+           "# err = largest trapezoid difference from the floating point planner (steps)\n", BENCH_RUNS);
+    printf("%-10s %-5s %4s %8s %10s %10s %10s %10s %8s %5s\n", "workload", "arith", "bufs", "blocks", "bb/block",
+      "bb max", "ns/block", "ns max", "sqrt", "err");
+  }
+  run_workload("polyline", workload_polyline);
+  run_workload("arcs", workload_arcs);
+  run_workload("zigzag", workload_zigzag);
+  run_workload("rapids", workload_rapids);
+  for (; optind < argc; optind++) {
+    recorded_file = argv[optind];
+    const char *name = strrchr(recorded_file, '/');
+    run_workload(name ? name+1 : recorded_file, workload_recorded);
+  }
+  run_worst_case_recalculate();
+  return(0);
+}
@@ -0,0 +1,884 @@
+/*
+  simulator.c - host-native simulation of the Grbl firmware on a virtual ATmega328P
+  Part of Grbl
+
+  Copyright (c) 2012 Chuck Harrison for http://opensourceecology.org/wiki/CNC_Torch_Table
+
+  Grbl is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Grbl is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Grbl.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* The firmware sources are compiled unmodified for the host, against the register shims in
+   sim/avr, with -fsanitize-coverage=trace-pc. The compiler then calls __sanitizer_cov_trace_pc()
+   at the head of every basic block, which is where this module advances a virtual CPU clock and
+   plays the part of the hardware: Timer0/1/2, the USART, the TWI master with an MCP23017 on the
+   bus, and the EEPROM. Interrupt vectors are dispatched from the same hook, in AVR priority
+   order, whenever the simulated global interrupt flag is set.
+
+   The clock model is deliberately coarse: every basic block costs a fixed number of cycles (-c),
+   so library calls such as soft-float arithmetic are not charged their real AVR cost. Absolute
+   ISR timings are therefore estimates; relative comparisons and all ordering/timing of step
+   pulses, serial traffic and I2C transactions are deterministic for a given input. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <compat/twi.h>
+#include "config.h"
+#include "nuts_bolts.h"
+#include "settings.h"
+#include "serial.h"
+#include "protocol.h"
+#include "i2c_tcb.h"
+#include "stepper.h"
+
+#define NEVER UINT64_MAX
+#define CYCLES_PER_MS (F_CPU/1000)
+#define VECTOR_OVERHEAD_CYCLES 10 // Vector jump, register save/restore and reti
+#define HOUSEKEEPING_CYCLES CYCLES_PER_MS
+#define HOST_START_QUIET_MS 10 // Serial silence after the welcome banner before streaming starts
+#define EXIT_SETTLE_MS 20 // Idle time required after the last response before exiting
+#define DEADLOCK_MS 1000 // Interrupts continuously disabled this long is reported as a hang
+#define EEPROM_SIZE 1024
+#define MCP23017_NREGS 0x16
+#define MCP23017_OLATB 0x15
+#define MCP23017_GPIOB 0x13
+
+int grbl_main(void);
+
+// avr-libc soft-float helper that read_float() calls directly.
+float __floatunsisf(unsigned long value) { return((float)value); }
+
+volatile sim_io_t sim_io;
+static sim_io_t shadow;
+
+uint64_t sim_cycles;
+static uint64_t next_event;
+static uint32_t cycles_per_block = 5;
+static uint64_t time_limit;
+
+// Interrupt vectors. Weak references, so vectors the configuration does not define resolve to NULL.
+void sim_vect_int0(void) __attribute__((weak));
+void sim_vect_pcint0(void) __attribute__((weak));
+void sim_vect_pcint1(void) __attribute__((weak));
+void sim_vect_timer2_compa(void) __attribute__((weak));
+void sim_vect_timer2_ovf(void) __attribute__((weak));
+void sim_vect_timer1_compa(void) __attribute__((weak));
+void sim_vect_timer0_compa(void) __attribute__((weak));
+void sim_vect_timer0_ovf(void) __attribute__((weak));
+void sim_vect_usart_rx(void) __attribute__((weak));
+void sim_vect_usart_udre(void) __attribute__((weak));
+void sim_vect_twi(void) __attribute__((weak));
+
+enum { V_TIMER2_COMPA, V_TIMER2_OVF, V_TIMER1_COMPA, V_TIMER0_COMPA, V_TIMER0_OVF,
+       V_USART_RX, V_USART_UDRE, V_TWI, N_VECTORS };
+
+typedef struct {
+  const char *name;
+  void (*handler)(void);
+  uint32_t count;
+  uint64_t total_cycles;
+  uint32_t max_cycles;
+} vector_t;
+
+// Listed in AVR priority order (lowest vector number first).
+static vector_t vectors[N_VECTORS] = {
+  { "TIMER2_COMPA", sim_vect_timer2_compa },
+  { "TIMER2_OVF",   sim_vect_timer2_ovf },
+  { "TIMER1_COMPA", sim_vect_timer1_compa },
+  { "TIMER0_COMPA", sim_vect_timer0_compa },
+  { "TIMER0_OVF",   sim_vect_timer0_ovf },
+  { "USART_RX",     sim_vect_usart_rx },
+  { "USART_UDRE",   sim_vect_usart_udre },
+  { "TWI",          sim_vect_twi },
+};
+
+
+/************** Timer/Counters ****************/
+
+// A timer counts from count_at, starting at cycle ref, one tick every ps cycles. In CTC mode
+// top is the compare register; if the count is above top when that happens (OCR lowered below
+// TCNT) it runs on to max and wraps, as the hardware does.
+typedef struct {
+  uint32_t count_at;
+  uint64_t ref;
+  uint32_t ps, top, ocr, max;
+  uint32_t returned; // Last value handed out through TCNTn, to detect firmware writes
+  uint64_t next_compa, next_ovf;
+} sim_timer_t;
+
+static sim_timer_t timer0, timer1, timer2;
+static uint8_t tcnt0_buf, tcnt2_buf;
+static uint16_t tcnt1_buf;
+
+static const uint16_t prescale_t01[8] = { 0, 1, 8, 64, 256, 1024, 0, 0 };
+static const uint16_t prescale_t2[8] = { 0, 1, 8, 32, 64, 128, 256, 1024 };
+
+static uint32_t timer_count(sim_timer_t *t)
+{
+  if (!t->ps) { return(t->count_at); }
+  uint64_t c = t->count_at + (sim_cycles - t->ref)/t->ps;
+  if (t->count_at > t->top) {
+    if (c <= t->max) { return(c); }
+    c -= t->max+1;
+  }
+  return(c % (t->top+1));
+}
+
+// Distance in ticks from count c until the counter next reaches value v.
+static uint64_t timer_ticks_to(sim_timer_t *t, uint32_t c, uint32_t v)
+{
+  if (c > t->top) { return((t->max+1-c) + v); }
+  if (v > c) { return(v-c); }
+  return((t->top+1-c) + v);
+}
+
+static void timer_schedule(sim_timer_t *t)
+{
+  t->next_compa = t->next_ovf = NEVER;
+  if (!t->ps) { return; }
+  uint32_t c = timer_count(t);
+  uint64_t tick_base = t->ref + ((sim_cycles - t->ref)/t->ps)*t->ps;
+  if (t->ocr <= t->top || c > t->top) {
+    t->next_compa = tick_base + timer_ticks_to(t,c,t->ocr)*t->ps;
+  }
+  if (t->top == t->max || c > t->top) {
+    t->next_ovf = tick_base + (t->max+1-c)*(uint64_t)t->ps;
+  }
+}
+
+// Re-reads the configuration registers, keeping the current count and prescaler phase.
+static void timer_reconfigure(sim_timer_t *t, uint16_t ps, uint8_t wgm, uint16_t ocr)
+{
+  t->count_at = timer_count(t);
+  if (t->ps) { t->ref += ((sim_cycles - t->ref)/t->ps)*t->ps; } else { t->ref = sim_cycles; }
+  t->ps = ps;
+  t->ocr = ocr;
+  t->top = (wgm == 2 || wgm == 4) ? ocr : t->max; // CTC (mode 2 on 8-bit timers, 4 on Timer1) or normal
+  timer_schedule(t);
+}
+
+// Raises the compare match and overflow flags that have fallen due. Both are checked before
+// rescheduling, as a match at TOP and the wrap to zero can coincide.
+static void timer_events(sim_timer_t *t, volatile uint8_t *tifr)
+{
+  uint8_t flags = 0;
+  if (sim_cycles >= t->next_compa) { flags |= (1<<OCF1A); } // OCFnA and TOVn share bit positions
+  if (sim_cycles >= t->next_ovf) { flags |= (1<<TOV1); }    // on all three timers
+  if (flags) {
+    *tifr |= flags;
+    timer_schedule(t);
+  }
+}
+
+static void timer_write_count(sim_timer_t *t, uint32_t value)
+{
+  t->count_at = value;
+  t->ref = sim_cycles;
+  timer_schedule(t);
+}
+
+static void timer0_reconfigure()
+{
+  timer_reconfigure(&timer0, prescale_t01[TCCR0B & 0x07],
+    ((TCCR0B >> WGM02) & 1) << 2 | (TCCR0A & 0x03), OCR0A);
+}
+
+static void timer1_reconfigure()
+{
+  timer_reconfigure(&timer1, prescale_t01[TCCR1B & 0x07],
+    ((TCCR1B >> WGM12) & 3) << 2 | (TCCR1A & 0x03), OCR1A);
+}
+
+static void timer2_reconfigure()
+{
+  timer_reconfigure(&timer2, prescale_t2[TCCR2B & 0x07],
+    ((TCCR2B >> WGM22) & 1) << 2 | (TCCR2A & 0x03), OCR2A);
+}
+
+static void service(void);
+
+volatile uint8_t *sim_tcnt0(void)
+{
+  service();
+  tcnt0_buf = timer0.returned = timer_count(&timer0);
+  return(&tcnt0_buf);
+}
+
+volatile uint16_t *sim_tcnt1(void)
+{
+  service();
+  tcnt1_buf = timer1.returned = timer_count(&timer1);
+  return(&tcnt1_buf);
+}
+
+volatile uint8_t *sim_tcnt2(void)
+{
+  service();
+  tcnt2_buf = timer2.returned = timer_count(&timer2);
+  return(&tcnt2_buf);
+}
+
+
+/************** EEPROM ****************/
+
+static uint8_t eeprom[EEPROM_SIZE];
+static uint64_t eeprom_busy_until;
+static const char *eeprom_file;
+
+// Completes a read (EERE) or a programming cycle (EEPE) requested through EECR. Programming
+// takes 3.4 ms for erase+write and 1.8 ms for erase or write only (ATmega328P Table 27-3).
+static void eeprom_service()
+{
+  if (sim_io.eecr & (1<<EERE)) {
+    sim_io.eedr = eeprom[EEAR % EEPROM_SIZE];
+    sim_io.eecr &= ~(1<<EERE);
+  }
+  if (sim_io.eecr & (1<<EEPE)) {
+    if (!eeprom_busy_until) {
+      uint8_t mode = (sim_io.eecr >> EEPM0) & 3;
+      uint8_t *cell = &eeprom[EEAR % EEPROM_SIZE];
+      switch (mode) {
+        case 0: *cell = sim_io.eedr; break;
+        case 1: *cell = 0xff; break;
+        case 2: *cell &= sim_io.eedr; break;
+      }
+      eeprom_busy_until = sim_cycles + (mode ? 18 : 34)*(F_CPU/10000);
+    } else if (sim_cycles >= eeprom_busy_until) {
+      eeprom_busy_until = 0;
+      sim_io.eecr &= ~((1<<EEPE)|(1<<EEMPE));
+    }
+  }
+}
+
+volatile uint8_t *sim_eecr(void) { eeprom_service(); return(&sim_io.eecr); }
+volatile uint8_t *sim_eedr(void) { eeprom_service(); return(&sim_io.eedr); }
+
+static void eeprom_load()
+{
+  memset(eeprom, 0xff, sizeof(eeprom));
+  if (eeprom_file) {
+    FILE *f = fopen(eeprom_file, "rb");
+    if (f) {
+      if (fread(eeprom, 1, sizeof(eeprom), f) == 0) { memset(eeprom, 0xff, sizeof(eeprom)); }
+      fclose(f);
+    }
+  }
+}
+
+static void eeprom_save()
+{
+  if (eeprom_file) {
+    FILE *f = fopen(eeprom_file, "wb");
+    if (f) { fwrite(eeprom, 1, sizeof(eeprom), f); fclose(f); }
+  }
+}
+
+
+/************** Step trace ****************/
+
+static FILE *step_trace;
+static uint32_t step_count[N_AXIS];
+static uint64_t last_step[N_AXIS];
+static uint64_t min_step_interval[N_AXIS];
+static const uint8_t step_bit[N_AXIS] = { X_STEP_BIT, Y_STEP_BIT, Z_STEP_BIT };
+
+// Acceleration check. Each axis' speed is taken over consecutive windows of ACCEL_WINDOW_TICKS trapezoid 
+// ticks, from its step count interpolated linearly between steps at the window edges, and its acceleration 
+// from the change of speed between windows. Windows with fewer than ACCEL_MIN_STEPS steps are too coarse
+// to tell and are skipped. Speeds are unsigned, so reversals count as the stop they go through, but 
+// corners change the speed of each axis at once and show up as acceleration.
+#define ACCEL_WINDOW_TICKS 2
+#define ACCEL_MIN_STEPS 8
+
+static double accel_tolerance = -1; // Percent over the limit that fails the run (-a). Negative if unchecked.
+static uint64_t accel_window_end[N_AXIS];
+static uint32_t accel_window_steps[N_AXIS];
+static double accel_window_position[N_AXIS]; // Steps at the start of the window
+static double accel_last_speed[N_AXIS];      // Speed in the last window (step/s), negative if skipped
+static double max_axis_acceleration[N_AXIS]; // (step/s^2)
+
+static void measure_acceleration(uint8_t idx)
+{
+  uint64_t window = (uint64_t)ACCEL_WINDOW_TICKS*F_CPU/settings.acceleration_ticks;
+  if (step_count[idx] == 1) {
+    accel_window_end[idx] = sim_cycles + window;
+    accel_window_position[idx] = 1;
+    accel_window_steps[idx] = 1;
+    accel_last_speed[idx] = -1;
+    return;
+  }
+  while (accel_window_end[idx] <= sim_cycles) {
+    double position = step_count[idx]-1 + 
+      (double)(accel_window_end[idx]-last_step[idx])/(sim_cycles-last_step[idx]);
+    double speed = (position-accel_window_position[idx])*F_CPU/window;
+    if (accel_window_steps[idx] < ACCEL_MIN_STEPS) { 
+      speed = -1; 
+    } else if (accel_last_speed[idx] >= 0) {
+      double acceleration = fabs(speed-accel_last_speed[idx])*F_CPU/window;
+      if (acceleration > max_axis_acceleration[idx]) { max_axis_acceleration[idx] = acceleration; }
+    }
+    accel_last_speed[idx] = speed;
+    accel_window_position[idx] = position;
+    accel_window_steps[idx] = 0;
+    accel_window_end[idx] += window;
+  }
+  accel_window_steps[idx]++;
+}
+
+// Logs every change of the step/direction outputs and counts pulses, taking a step bit leaving
+// its idle level (per the step invert mask) as the start of a pulse.
+static void stepping_port_changed(uint8_t old_port, uint8_t new_port)
+{
+  if (!((old_port ^ new_port) & STEPPING_MASK)) { return; }
+  if (step_trace) {
+    fprintf(step_trace, "%llu %02x\n", (unsigned long long)sim_cycles, new_port & STEPPING_MASK);
+  }
+  uint8_t idle = settings.invert_mask & STEP_MASK;
+  uint8_t started = ((new_port ^ idle) & ~(old_port ^ idle)) & STEP_MASK;
+  uint8_t idx;
+  for (idx=0; idx<N_AXIS; idx++) {
+    if (started & (1<<step_bit[idx])) {
+      if (step_count[idx]) {
+        uint64_t interval = sim_cycles - last_step[idx];
+        if (!min_step_interval[idx] || interval < min_step_interval[idx]) { min_step_interval[idx] = interval; }
+      }
+      step_count[idx]++;
+      measure_acceleration(idx);
+      last_step[idx] = sim_cycles;
+    }
+  }
+}
+
+
+/************** TWI master and MCP23017 slave ****************/
+
+enum { BUS_IDLE, BUS_STARTED, BUS_WRITE, BUS_READ };
+
+static uint8_t twint; // TWINT flag, kept here so firmware writes of TWINT=1 are always visible
+static uint8_t bus_state;
+static uint8_t slave_selected;
+static uint8_t first_write;
+static uint64_t twi_done_at = NEVER;
+static uint8_t twi_status_pending, twdr_pending;
+static uint8_t mcp_reg[MCP23017_NREGS];
+static uint8_t mcp_ptr;
+
+static uint32_t twi_byte_cycles()
+{
+  return(9*(16 + 2*(uint32_t)TWBR*(1 << (2*(TWSR & 3)))));
+}
+
+static void twi_complete(uint8_t status, uint32_t bits)
+{
+  twi_status_pending = status;
+  twi_done_at = sim_cycles + bits*twi_byte_cycles()/9;
+}
+
+static void mcp23017_write(uint8_t data)
+{
+  if (first_write) {
+    mcp_ptr = data % MCP23017_NREGS;
+    first_write = false;
+    return;
+  }
+  if (mcp_ptr == MCP23017_OLATB || mcp_ptr == MCP23017_GPIOB) {
+    if (step_trace) { fprintf(step_trace, "# %llu OLATB %02x\n", (unsigned long long)sim_cycles, data); }
+    mcp_reg[MCP23017_OLATB] = data;
+  } else {
+    mcp_reg[mcp_ptr] = data;
+  }
+  mcp_ptr = (mcp_ptr+1) % MCP23017_NREGS;
+}
+
+static uint8_t mcp23017_read()
+{
+  uint8_t data = mcp_reg[mcp_ptr];
+  // Inputs float high through the pull-ups: no home or limit switch is ever closed.
+  if (mcp_ptr == 0x12 || mcp_ptr == 0x13) { data = mcp_reg[mcp_ptr+2] | mcp_reg[mcp_ptr-0x12]; }
+  mcp_ptr = (mcp_ptr+1) % MCP23017_NREGS;
+  return(data);
+}
+
+// Acts on a firmware write to TWCR that had TWINT set.
+static void twi_command()
+{
+  uint8_t twcr = TWCR;
+  twint = false;
+  if (!(twcr & (1<<TWEN))) { bus_state = BUS_IDLE; return; }
+  if (twcr & (1<<TWSTO)) {
+    bus_state = BUS_IDLE;
+    TWCR &= ~(1<<TWSTO); // The stop condition is executed immediately; TWINT is not set.
+    if (!(twcr & (1<<TWSTA))) { return; }
+  }
+  if (twcr & (1<<TWSTA)) {
+    twi_complete(bus_state == BUS_IDLE ? TW_START : TW_REP_START, 1);
+    bus_state = BUS_STARTED;
+    return;
+  }
+  switch (bus_state) {
+    case BUS_STARTED:
+      slave_selected = ((TWDR >> 1) == MCP23017_ADDR);
+      if (TWDR & TW_READ) {
+        bus_state = BUS_READ;
+        twi_complete(slave_selected ? TW_MR_SLA_ACK : TW_MR_SLA_NACK, 9);
+      } else {
+        bus_state = BUS_WRITE;
+        first_write = true;
+        twi_complete(slave_selected ? TW_MT_SLA_ACK : TW_MT_SLA_NACK, 9);
+      }
+      break;
+    case BUS_WRITE:
+      if (slave_selected) { mcp23017_write(TWDR); }
+      twi_complete(slave_selected ? TW_MT_DATA_ACK : TW_MT_DATA_NACK, 9);
+      break;
+    case BUS_READ:
+      twdr_pending = slave_selected ? mcp23017_read() : 0xff;
+      twi_complete((twcr & (1<<TWEA)) ? TW_MR_DATA_ACK : TW_MR_DATA_NACK, 9);
+      break;
+  }
+}
+
+static void mcp23017_reset()
+{
+  memset(mcp_reg, 0, sizeof(mcp_reg));
+  mcp_reg[0x00] = mcp_reg[0x01] = 0xff; // IODIRA, IODIRB
+}
+
+
+/************** USART and host ****************/
+
+// The host streams the input file like script/stream.py: it tracks the characters of every line
+// not yet acknowledged with 'ok' or 'error' and only sends a line that fits in the RX buffer.
+// Binary frames in the input (see protocol.h) are counted like lines. '$' lines are sent alone, once
+// every line before them is answered and with nothing after them until they are, since storing a
+// setting writes the EEPROM with the serial receive interrupt blocked.
+// With -r it sends the whole file back-to-back with no flow control.
+
+static char *input;
+static size_t input_len, input_pos;
+static uint8_t raw_mode;
+static uint8_t host_started, banner_seen;
+static uint8_t setting_pending; // A '$' line is sent and not answered yet
+static uint16_t pending_len[RX_BUFFER_SIZE];
+static uint16_t pending_head, pending_tail;
+static uint16_t pending_chars;
+static size_t line_start; // Input position of the line being sent
+static uint16_t line_len; // Length of the line being sent, including its newline
+static char response[128];
+static uint8_t response_len;
+static uint64_t last_tx_at, last_rx_at, rx_next_at = NEVER, udre_at = NEVER, tx_shift_end;
+static uint8_t rx_pending, rx_data;
+static uint32_t rx_overruns, responses;
+
+static uint32_t usart_byte_cycles()
+{
+  uint32_t ubrr = ((uint16_t)UBRR0H << 8) | UBRR0L;
+  return(10*((UCSR0A & (1<<U2X0)) ? 8 : 16)*(ubrr+1));
+}
+
+// Skips blank lines so that every line sent draws exactly one response.
+static void host_next_line()
+{
+  while (input_pos < input_len && input[input_pos] == '\n') { input_pos++; }
+  line_start = input_pos;
+  line_len = 0;
+  if (input_pos+1 < input_len && (uint8_t)input[input_pos] == FRAME_START) {
+    line_len = (uint8_t)input[input_pos+1] + 3; // Start, length and CRC bytes
+  } else if (input_pos < input_len) {
+    char *eol = memchr(input+input_pos, '\n', input_len-input_pos);
+    line_len = (eol ? eol-(input+input_pos) : input_len-input_pos) + 1;
+  }
+}
+
+static uint8_t host_may_send()
+{
+  if (!host_started || input_pos >= input_len) { return(false); }
+  if (raw_mode) { return(true); }
+  if (input_pos > line_start) { return(true); } // Mid-line
+  if (setting_pending) { return(false); }
+  if (pending_head == pending_tail) { return(true); } // A line too long for the buffer still goes out
+  if (input[line_start] == '$') { return(false); }
+  return(pending_chars + line_len < RX_BUFFER_SIZE-1);
+}
+
+static void host_schedule()
+{
+  if (rx_next_at == NEVER && host_may_send()) {
+    uint64_t earliest = last_rx_at + usart_byte_cycles();
+    rx_next_at = sim_cycles > earliest ? sim_cycles : earliest;
+  }
+}
+
+static void host_send_byte()
+{
+  if (!raw_mode && input_pos == line_start) {
+    pending_len[pending_head] = line_len;
+    pending_head = (pending_head+1) % RX_BUFFER_SIZE;
+    pending_chars += line_len;
+    if (input[line_start] == '$') { setting_pending = true; }
+  }
+  rx_data = input[input_pos++];
+  last_rx_at = sim_cycles;
+  if (rx_pending) { rx_overruns++; }
+  rx_pending = true;
+  if (input_pos < input_len && input_pos == line_start+line_len) { host_next_line(); }
+  rx_next_at = NEVER;
+  if (host_may_send()) { rx_next_at = sim_cycles + usart_byte_cycles(); }
+}
+
+static void host_receive_byte(uint8_t c)
+{
+  putchar(c);
+  last_tx_at = sim_cycles;
+  if (c == '\r') { return; }
+  if (c != '\n') {
+    if (response_len < sizeof(response)-1) { response[response_len++] = c; }
+    return;
+  }
+  response[response_len] = 0;
+  response_len = 0;
+  if (strstr(response, "Grbl ")) { banner_seen = true; }
+  if (!strncmp(response, "ok", 2) || !strncmp(response, "error", 5)) {
+    responses++;
+    if (pending_head != pending_tail) {
+      pending_chars -= pending_len[pending_tail];
+      pending_tail = (pending_tail+1) % RX_BUFFER_SIZE;
+    }
+    if (pending_head == pending_tail) { setting_pending = false; }
+    host_schedule();
+  }
+}
+
+static void usart_udre_done()
+{
+  uint64_t start = tx_shift_end > sim_cycles ? tx_shift_end : sim_cycles;
+  tx_shift_end = start + usart_byte_cycles();
+  udre_at = start;
+  host_receive_byte(UDR0);
+}
+
+static uint8_t host_finished()
+{
+  return(input_pos >= input_len && pending_head == pending_tail && !rx_pending
+         && rx_buffer_head == rx_buffer_tail);
+}
+
+
+/************** Scheduler ****************/
+
+static uint64_t next_housekeeping;
+static uint64_t interrupts_off_since, settled_since;
+
+static void sim_finish(int status);
+
+static void update_next_event()
+{
+  next_event = next_housekeeping;
+  if (timer0.next_compa < next_event) { next_event = timer0.next_compa; }
+  if (timer0.next_ovf < next_event) { next_event = timer0.next_ovf; }
+  if (timer1.next_compa < next_event) { next_event = timer1.next_compa; }
+  if (timer1.next_ovf < next_event) { next_event = timer1.next_ovf; }
+  if (timer2.next_compa < next_event) { next_event = timer2.next_compa; }
+  if (timer2.next_ovf < next_event) { next_event = timer2.next_ovf; }
+  if (rx_next_at < next_event) { next_event = rx_next_at; }
+  if (twi_done_at < next_event) { next_event = twi_done_at; }
+  // UDRE is level-triggered: once due it is dispatched whenever interrupts allow, so it only
+  // needs an event while still in the future.
+  if ((UCSR0B & (1<<UDRIE0)) && udre_at > sim_cycles && udre_at < next_event) { next_event = udre_at; }
+  if (eeprom_busy_until && eeprom_busy_until < next_event) { next_event = eeprom_busy_until; }
+}
+
+static void housekeeping()
+{
+  next_housekeeping = sim_cycles + HOUSEKEEPING_CYCLES;
+  if (time_limit && sim_cycles >= time_limit) {
+    fprintf(stderr, "sim: time limit reached\n");
+    sim_finish(2);
+  }
+  if (SREG & 0x80) {
+    interrupts_off_since = 0;
+  } else if (!interrupts_off_since) {
+    interrupts_off_since = sim_cycles;
+  } else if (sim_cycles - interrupts_off_since > DEADLOCK_MS*CYCLES_PER_MS) {
+    fprintf(stderr, "sim: interrupts disabled for over %d ms, firmware is hung\n", DEADLOCK_MS);
+    sim_finish(3);
+  }
+  if (!host_started) {
+    if (banner_seen && sim_cycles - last_tx_at > HOST_START_QUIET_MS*CYCLES_PER_MS) {
+      host_started = true;
+      host_next_line();
+      host_schedule();
+    }
+    return;
+  }
+  if (host_finished() && !(UCSR0B & (1<<UDRIE0)) && (sys.state == STATE_IDLE || sys.state == STATE_ALARM)
+      && sim_cycles - last_tx_at > EXIT_SETTLE_MS*CYCLES_PER_MS) {
+    if (!settled_since) { settled_since = sim_cycles; }
+    if (sim_cycles - settled_since > EXIT_SETTLE_MS*CYCLES_PER_MS) { sim_finish(0); }
+  } else {
+    settled_since = 0;
+  }
+}
+
+static uint8_t pending_vector()
+{
+  if ((TIMSK2 & (1<<OCIE2A)) && (TIFR2 & (1<<OCF2A))) { return(V_TIMER2_COMPA); }
+  if ((TIMSK2 & (1<<TOIE2)) && (TIFR2 & (1<<TOV2))) { return(V_TIMER2_OVF); }
+  if ((TIMSK1 & (1<<OCIE1A)) && (TIFR1 & (1<<OCF1A))) { return(V_TIMER1_COMPA); }
+  if ((TIMSK0 & (1<<OCIE0A)) && (TIFR0 & (1<<OCF0A))) { return(V_TIMER0_COMPA); }
+  if ((TIMSK0 & (1<<TOIE0)) && (TIFR0 & (1<<TOV0))) { return(V_TIMER0_OVF); }
+  if ((UCSR0B & (1<<RXCIE0)) && rx_pending) { return(V_USART_RX); }
+  if ((UCSR0B & (1<<UDRIE0)) && sim_cycles >= udre_at) { return(V_USART_UDRE); }
+  if ((TWCR & (1<<TWIE)) && twint) { return(V_TWI); }
+  return(N_VECTORS);
+}
+
+static void acknowledge_vector(uint8_t v)
+{
+  switch (v) {
+    case V_TIMER2_COMPA: TIFR2 &= ~(1<<OCF2A); break;
+    case V_TIMER2_OVF: TIFR2 &= ~(1<<TOV2); break;
+    case V_TIMER1_COMPA: TIFR1 &= ~(1<<OCF1A); break;
+    case V_TIMER0_COMPA: TIFR0 &= ~(1<<OCF0A); break;
+    case V_TIMER0_OVF: TIFR0 &= ~(1<<TOV0); break;
+    case V_USART_RX: UDR0 = rx_data; rx_pending = false; break; // RXC0 clears when the ISR reads UDR0
+  }
+}
+
+#define SHADOW(reg) (*(uint8_t *)((uint8_t *)&shadow + ((uint8_t *)&(reg) - (uint8_t *)&sim_io)))
+
+// Brings the hardware model up to date with the virtual clock and any register writes since the
+// last call. Does not call back into the firmware, so it is never re-entered.
+static void update(void)
+{
+  // Firmware writes to the timer counters
+  if (tcnt0_buf != timer0.returned) { timer_write_count(&timer0, tcnt0_buf); timer0.returned = tcnt0_buf; }
+  if (tcnt1_buf != timer1.returned) { timer_write_count(&timer1, tcnt1_buf); timer1.returned = tcnt1_buf; }
+  if (tcnt2_buf != timer2.returned) { timer_write_count(&timer2, tcnt2_buf); timer2.returned = tcnt2_buf; }
+
+  // Firmware writes to the register file
+  if (memcmp((void *)&sim_io, &shadow, sizeof(shadow))) {
+    if (TCCR0A != shadow.tccr0a || TCCR0B != shadow.tccr0b || OCR0A != shadow.ocr0a) { timer0_reconfigure(); }
+    if (TCCR1A != shadow.tccr1a || TCCR1B != shadow.tccr1b || OCR1A != shadow.ocr1a) { timer1_reconfigure(); }
+    if (TCCR2A != shadow.tccr2a || TCCR2B != shadow.tccr2b || OCR2A != shadow.ocr2a) { timer2_reconfigure(); }
+    if (STEPPING_PORT != SHADOW(STEPPING_PORT)) { stepping_port_changed(SHADOW(STEPPING_PORT), STEPPING_PORT); }
+    if (TWCR & (1<<TWINT)) {
+      TWCR &= ~(1<<TWINT);
+      twi_command();
+    }
+    if ((UCSR0B & (1<<UDRIE0)) && !(shadow.ucsr0b & (1<<UDRIE0))) {
+      if (udre_at == NEVER || udre_at < sim_cycles) { udre_at = sim_cycles; }
+    }
+    if (sim_io.eecr & ((1<<EERE)|(1<<EEPE))) { eeprom_service(); }
+    memcpy(&shadow, (void *)&sim_io, sizeof(shadow));
+  }
+
+  // Hardware events that have fallen due
+  if (sim_cycles >= next_event) {
+    timer_events(&timer0, &TIFR0);
+    timer_events(&timer1, &TIFR1);
+    timer_events(&timer2, &TIFR2);
+    if (sim_cycles >= rx_next_at) {
+      if (UCSR0B & (1<<RXEN0)) { host_send_byte(); } else { rx_next_at += usart_byte_cycles(); }
+    }
+    if (sim_cycles >= twi_done_at) {
+      twi_done_at = NEVER;
+      TWSR = (TWSR & ~TW_STATUS_MASK) | twi_status_pending;
+      if (bus_state == BUS_READ && (twi_status_pending & 0xF0) == 0x50) { TWDR = twdr_pending; }
+      twint = true;
+    }
+    if (eeprom_busy_until && sim_cycles >= eeprom_busy_until) { eeprom_service(); }
+    if (sim_cycles >= next_housekeeping) { housekeeping(); }
+    memcpy(&shadow, (void *)&sim_io, sizeof(shadow));
+  }
+  update_next_event();
+}
+
+// Updates the hardware model, then dispatches pending interrupts while they are enabled. An ISR
+// that re-enables interrupts with sei() gets nested dispatch, as on the real part.
+static void service(void)
+{
+  uint8_t v;
+  update();
+  while ((SREG & 0x80) && (v = pending_vector()) != N_VECTORS) {
+    vector_t *vec = &vectors[v];
+    if (!vec->handler) {
+      fprintf(stderr, "sim: %s enabled but no ISR is defined\n", vec->name);
+      sim_finish(3);
+    }
+    acknowledge_vector(v);
+    uint64_t start = sim_cycles;
+    sim_cycles += VECTOR_OVERHEAD_CYCLES;
+    SREG &= ~0x80;
+    vec->handler();
+    SREG |= 0x80;
+    uint64_t elapsed = sim_cycles - start;
+    vec->count++;
+    vec->total_cycles += elapsed;
+    if (elapsed > vec->max_cycles) { vec->max_cycles = elapsed; }
+    if (v == V_USART_UDRE) { usart_udre_done(); }
+    update();
+  }
+}
+
+// Called by the compiler at the head of every basic block of the firmware.
+void __sanitizer_cov_trace_pc(void)
+{
+  sim_cycles += cycles_per_block;
+  if (sim_cycles >= next_event || memcmp((void *)&sim_io, &shadow, sizeof(shadow)) ||
+      tcnt0_buf != timer0.returned || tcnt1_buf != timer1.returned || tcnt2_buf != timer2.returned) {
+    service();
+  }
+}
+
+void sim_sei(void)
+{
+  SREG |= 0x80;
+  service();
+}
+
+void sim_delay_cycles(uint32_t cycles)
+{
+  uint64_t until = sim_cycles + cycles;
+  while (sim_cycles < until) {
+    uint64_t step = next_event < until ? next_event : until;
+    if (step > sim_cycles) { sim_cycles = step; }
+    service();
+  }
+}
+
+
+/************** Startup and reporting ****************/
+
+static void sim_finish(int status)
+{
+  uint8_t idx;
+  fflush(stdout);
+  fprintf(stderr, "sim: %.6f s virtual time, %llu cycles at %lu Hz, %u cycles per basic block\n",
+    (double)sim_cycles/F_CPU, (unsigned long long)sim_cycles, (unsigned long)F_CPU, cycles_per_block);
+  fprintf(stderr, "sim: %u responses, %u rx overruns, %u rx buffer overflows, %u segment underruns\n", responses,
+    rx_overruns, serial_get_rx_overflow_count(), st_get_segment_underrun_count());
+  for (idx=0; idx<N_AXIS; idx++) {
+    fprintf(stderr, "sim: %c steps %u, position %ld", "XYZ"[idx], step_count[idx], (long)sys.position[idx]);
+    if (min_step_interval[idx]) {
+      fprintf(stderr, ", min step interval %llu cycles (%.0f Hz)", (unsigned long long)min_step_interval[idx],
+        (double)F_CPU/min_step_interval[idx]);
+    }
+    fprintf(stderr, "\n");
+  }
+  for (idx=0; idx<N_AXIS; idx++) {
+    if (max_axis_acceleration[idx] == 0) { continue; }
+    // A single axis never accelerates faster than the block, and the block no faster than either limit.
+    double limit = min(settings.acceleration, settings.max_acceleration[idx])/3600;
+    double acceleration = max_axis_acceleration[idx]/settings.steps_per_mm[idx];
+    fprintf(stderr, "sim: %c max acceleration %.2f mm/s^2, limit %.2f mm/s^2\n", "XYZ"[idx], acceleration, limit);
+    if (accel_tolerance >= 0 && acceleration > limit*(1+accel_tolerance/100)) {
+      fprintf(stderr, "sim: %c acceleration exceeds the limit by more than %g%%\n", "XYZ"[idx], accel_tolerance);
+      if (status == 0) { status = 4; }
+    }
+  }
+  fprintf(stderr, "sim: %-13s %10s %10s %10s\n", "vector", "count", "mean", "max");
+  for (idx=0; idx<N_VECTORS; idx++) {
+    if (vectors[idx].count) {
+      fprintf(stderr, "sim: %-13s %10u %10.1f %10u\n", vectors[idx].name, vectors[idx].count,
+        (double)vectors[idx].total_cycles/vectors[idx].count, vectors[idx].max_cycles);
+    }
+  }
+  if (step_trace) { fclose(step_trace); }
+  eeprom_save();
+  exit(status);
+}
+
+static void usage()
+{
+  fprintf(stderr,
+    "usage: grbl_sim [-t seconds] [-c cycles] [-s step_trace] [-e eeprom_image] [-r] [-a percent] [gcode_file]\n"
+    "  -t  stop after this much virtual time (default 600 s, 0 for no limit)\n"
+    "  -c  CPU cycles charged per basic block (default 5)\n"
+    "  -s  write '<cycle> <hex port>' for every step/direction output change\n"
+    "  -e  load and save the EEPROM contents from this file\n"
+    "  -r  stream the input without flow control instead of character counting\n"
+    "  -a  exit with status 4 if an axis accelerates faster than its limit by more than this percentage\n");
+  exit(1);
+}
+
+static void read_input(FILE *f)
+{
+  size_t size = 4096;
+  input = malloc(size+1);
+  while (!feof(f)) {
+    if (input_len == size) { size *= 2; input = realloc(input, size+1); }
+    input_len += fread(input+input_len, 1, size-input_len, f);
+    if (ferror(f)) { perror("sim: read"); exit(1); }
+  }
+  // Line ends are sent as a single newline; Grbl would take each '\r' as an extra empty line.
+  // Binary frames are copied as they are.
+  size_t i, n = 0, frame_end = 0;
+  for (i=0; i<input_len; i++) {
+    if (i >= frame_end && (uint8_t)input[i] == FRAME_START && i+1 < input_len) {
+      frame_end = i + (uint8_t)input[i+1] + 3;
+    }
+    if (i < frame_end || input[i] != '\r') { input[n++] = input[i]; }
+  }
+  input_len = n;
+  if (input_len && frame_end < input_len && input[input_len-1] != '\n') { input[input_len++] = '\n'; }
+}
+
+int main(int argc, char *argv[])
+{
+  double seconds = 600;
+  int opt;
+  while ((opt = getopt(argc, argv, "t:c:s:e:ra:")) != -1) {
+    switch (opt) {
+      case 't': seconds = atof(optarg); break;
+      case 'c': cycles_per_block = atoi(optarg); break;
+      case 's':
+        step_trace = fopen(optarg, "w");
+        if (!step_trace) { perror(optarg); exit(1); }
+        break;
+      case 'e': eeprom_file = optarg; break;
+      case 'r': raw_mode = true; break;
+      case 'a': accel_tolerance = atof(optarg); break;
+      default: usage();
+    }
+  }
+  if (optind < argc) {
+    FILE *f = fopen(argv[optind], "r");
+    if (!f) { perror(argv[optind]); exit(1); }
+    read_input(f);
+    fclose(f);
+  } else {
+    read_input(stdin);
+  }
+  time_limit = seconds*F_CPU;
+
+  eeprom_load();
+  mcp23017_reset();
+  timer0.max = timer0.top = 0xff;
+  timer1.max = timer1.top = 0xffff;
+  timer2.max = timer2.top = 0xff;
+  timer0_reconfigure();
+  timer1_reconfigure();
+  timer2_reconfigure();
+  UCSR0A = (1<<UDRE0);
+  PINB = PINC = PIND = 0xff; // Inputs idle high through the pull-ups
+  memcpy(&shadow, (void *)&sim_io, sizeof(shadow));
+  update_next_event();
+
+  grbl_main();
+  return(0);
+}
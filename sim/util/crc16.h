@@ -0,0 +1,35 @@
+/*
+  util/crc16.h - CRC shim for the host-native simulator
+  Part of Grbl
+
+  Grbl is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Grbl is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Grbl.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef sim_util_crc16_h
+#define sim_util_crc16_h
+
+#include <inttypes.h>
+
+// The C equivalent given in the avr-libc documentation: CRC-8, polynomial x^8+x^2+x+1.
+static inline uint8_t _crc8_ccitt_update(uint8_t crc, uint8_t data)
+{
+  uint8_t i;
+  crc ^= data;
+  for (i = 0; i < 8; i++) {
+    crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : (crc << 1);
+  }
+  return(crc);
+}
+
+#endif
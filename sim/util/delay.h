@@ -0,0 +1,30 @@
+/*
+  util/delay.h - busy-wait delay shim for the host-native simulator
+  Part of Grbl
+
+  Grbl is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Grbl is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Grbl.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef sim_util_delay_h
+#define sim_util_delay_h
+
+#include <inttypes.h>
+
+// Busy-waits advance virtual time by the requested number of CPU cycles. Interrupts that
+// fall due in the meantime are serviced, as they would be on the real part.
+void sim_delay_cycles(uint32_t cycles);
+#define _delay_ms(ms) sim_delay_cycles((uint32_t)((F_CPU/1000L)*(ms)))
+#define _delay_us(us) sim_delay_cycles((uint32_t)((F_CPU/1000000L)*(us)))
+
+#endif
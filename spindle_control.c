@@ -22,6 +22,8 @@
 #include "settings.h"
 #include "spindle_control.h"
 #include "planner.h"
+#include "motion_control.h"
+#include <avr/interrupt.h>
 
 #ifdef SPINDLE_ON_I2C
 #include "i2c_tcb.h"
@@ -35,11 +37,15 @@ volatile uint8_t spindle_tcb[5];
 // this hack is supposed to help avr-gcc do 8-bit instead of 16-bit ops
 static inline uint8_t only8 (uint8_t x) { return x; }
 
-static uint8_t current_direction;
+static volatile int8_t current_direction; // Spindle state of the outputs
+static volatile int8_t queued_direction;  // Spindle state of the last M3, M4 or M5, once queued motions finish
+static volatile int8_t requested_direction; // Spindle state the stepper interrupt last asked for
 
 void spindle_init()
 {
   current_direction = 0;
+  queued_direction = 0;
+  requested_direction = 0;
 #ifdef SPINDLE_PRESENT
 #ifdef SPINDLE_ON_I2C
   // fill spindle tcb to set output port bit directions
@@ -74,13 +80,13 @@ void spindle_stop()
 #endif
 }
 
-// direction is 1, -1, 0 for M3, M4, M5
-void spindle_run(int8_t direction) //, uint16_t rpm) 
+// Sets the spindle outputs to direction 1, -1, 0 (M3, M4, M5) right away, if they differ. Port outputs
+// are also set from the stepper interrupt, by spindle_request_direction(). I2C writes are only started
+// by the main program, in spindle_run() and spindle_execute(), so they all come from one context.
+static void spindle_set_direction(int8_t direction)
 {
 #ifdef SPINDLE_PRESENT
   if (direction != current_direction) {
-    plan_synchronize();
-    
 #ifdef SPINDLE_ON_I2C
     while(only8(spindle_tcb[0]&TCB_COMPL)) { }; // block if a spindle I2C transaction is pending
     if(direction) {
@@ -108,3 +114,45 @@ void spindle_run(int8_t direction) //, uint16_t rpm)
   }
 #endif
 }
+
+// direction is 1, -1, 0 for M3, M4, M5. The change is queued with the motions: the blocks planned 
+// from now on carry it, and the stepper interrupt sets the outputs when it starts the first of them,
+// or when the motions queued before it finish. So the planner keeps looking ahead across spindle 
+// changes, instead of draining the buffer for each.
+void spindle_run(int8_t direction) //, uint16_t rpm) 
+{
+  if (direction != queued_direction) { mc_line_flush(); } // A held line runs with the old state.
+  uint8_t sreg = SREG;
+  cli(); // The stepper interrupt must not finish the buffer between the check and the queuing.
+  uint8_t buffer_empty = (plan_get_current_block() == NULL);
+  queued_direction = direction;
+  if (buffer_empty) { requested_direction = direction; }
+  SREG = sreg;
+  if (buffer_empty) { spindle_set_direction(direction); }
+}
+
+// Asks for the spindle outputs of a block boundary. Called by the stepper interrupt. Port outputs are
+// set right away. An I2C write is not started here, where the interrupt would have to wait for the 
+// previous one and would race the main program for the TWI queue, but by spindle_execute().
+void spindle_request_direction(int8_t direction)
+{
+  requested_direction = direction;
+#ifndef SPINDLE_ON_I2C
+  spindle_set_direction(direction);
+#endif
+}
+
+// Writes the spindle outputs the stepper interrupt asked for over I2C. Called continuously by the 
+// main program.
+void spindle_execute()
+{
+#ifdef SPINDLE_ON_I2C
+  spindle_set_direction(requested_direction);
+#endif
+}
+
+// Returns the spindle state for the blocks being planned
+int8_t spindle_queued_direction()
+{
+  return(queued_direction);
+}
@@ -28,4 +28,13 @@ void spindle_init();
 void spindle_run(int8_t direction); //, uint16_t rpm);
 void spindle_stop();
 
+// Asks for the spindle outputs at a block boundary. Called by the stepper interrupt.
+void spindle_request_direction(int8_t direction);
+
+// Writes the spindle outputs asked for by the stepper interrupt, if on I2C. Called by the main program.
+void spindle_execute();
+
+// Returns the spindle direction of the last spindle_run(), for the blocks planned after it
+int8_t spindle_queued_direction();
+
 #endif
@@ -36,6 +36,7 @@
 #include "motion_control.h"
 #include "protocol.h"
 #include "limits.h"
+#include "spindle_control.h"
 
 #include "print.h"
 #include <avr/pgmspace.h>
@@ -43,32 +44,93 @@
 
 // Some useful constants
 #define TICKS_PER_MICROSECOND (F_CPU/1000000)
-#define CYCLES_PER_ACCELERATION_TICK ((TICKS_PER_MICROSECOND*1000000)/ACCELERATION_TICKS_PER_SECOND)
 
-// Stepper state variable. Contains running data and trapezoid variables for coordinated motion.
+// Stepper state variable. Contains the bresenham line tracer variables of the block being traced.
 typedef struct {
-  // Used by the bresenham line algorithm
   int32_t counter_x,        // Counter variables for the bresenham line tracer
           counter_y, 
           counter_z;
+  uint32_t steps_x,          // Bresenham increments of the current segment
+           steps_y,
+           steps_z;
   uint32_t event_count;
-  uint32_t step_events_completed;  // The number of step events left in current motion
+  uint16_t segment_ticks;          // The number of interrupts left in the current segment
+  uint16_t step_events_completed;  // The number of step events traced in the current block
+  uint8_t segment_underrun;        // Waiting on an empty segment buffer in mid-cycle
+} stepper_t;
+
+#ifdef ADAPTIVE_MULTI_AXIS_STEP_SMOOTHING
+  // Bresenham resolution, as a power of two, relative to the step events of the block. Segments oversampled
+  // less than this take correspondingly larger Bresenham increments.
+  #define MAX_AMASS_LEVEL 3
+#endif
+
+static stepper_t st;
+static block_t *current_block;  // A pointer to the block currently being traced
+
+// A step segment is a run of step events at one step rate, cut from a block's trapezoid by the main
+// program. The stepper interrupt only loads the segment's timer setting and traces its step events.
+#define SEGMENT_END_OF_BLOCK bit(0) // The last step event of the segment completes its block
+typedef struct {
+  uint16_t n_step;    // Number of step events in the segment
+  uint16_t ceiling;   // Timer 1 compare value for the segment's step rate
+  uint8_t prescaler;  // Timer 1 prescaler for the segment's step rate
+  uint8_t flags;
+  #ifdef ADAPTIVE_MULTI_AXIS_STEP_SMOOTHING
+    uint8_t amass_level; // Stepper interrupts per step event, as a power of two
+  #endif
+} segment_t;
+
+static segment_t segment_buffer[SEGMENT_BUFFER_SIZE];
+static volatile uint8_t segment_buffer_tail; // Index of the segment being traced. Advanced by the interrupt.
+static volatile uint8_t segment_buffer_head; // Index of the next segment to be prepared
+static uint8_t segment_next_head;            // Index of the segment after the head
+static segment_t *current_segment;           // A pointer to the segment currently being traced
+static uint16_t segment_underrun_count;      // Times the segment buffer ran dry in mid-cycle since power-up
 
-  // Used by the trapezoid generator
+// Segment preparation state. Contains the trapezoid generator variables of the block being cut into
+// segments, which may be ahead of the block being traced. Used only by the main program.
+typedef struct {
+  block_t *block;                        // The block being prepared, or NULL to fetch the next one
+  uint16_t step_events_completed;        // The number of step events of the block already in segments
   uint32_t cycles_per_step_event;        // The number of machine cycles between each step event
+  uint16_t ceiling;                      // Timer 1 setting for cycles_per_step_event
+  uint8_t prescaler;
+  #ifdef ADAPTIVE_MULTI_AXIS_STEP_SMOOTHING
+    uint8_t amass_level;                 // Stepper interrupts per step event, as a power of two
+  #endif
   uint32_t trapezoid_tick_cycle_counter; // The cycles since last trapezoid_tick. Used to generate ticks at a steady
                                               // pace without allocating a separate timer
   uint32_t trapezoid_adjusted_rate;      // The current rate of step_events according to the trapezoid generator
   uint32_t min_safe_rate;  // Minimum safe rate for full deceleration rate reduction step. Otherwise halves step_rate.
-} stepper_t;
+  uint8_t hold_complete;   // Feed hold deceleration has been prepared down to a stop
 
-static stepper_t st;
-static block_t *current_block;  // A pointer to the block currently being traced
+  // Used by S-curve acceleration, when settings.jerk is set
+  uint16_t scurve_ticks;   // Length of the acceleration or deceleration phase in trapezoid ticks
+  uint16_t scurve_ramp;    // Trapezoid ticks over which the rate change per tick ramps up and down. Zero if linear.
+  uint16_t scurve_tick;    // Trapezoid ticks into the phase
+  uint8_t scurve_delay;    // The phase starts a tick later
+  uint32_t scurve_change;  // Rate change of the whole phase (step/min)
+  float scurve_gain;       // Rate change per tick, per half tick of ramp
+} prep_t;
+
+static prep_t prep;
+
+// What the trapezoid generator does after the step events of a segment
+#define PREP_HOLD 0           // Feed hold deceleration
+#define PREP_ACCELERATE 1
+#define PREP_DECELERATE_START 2
+#define PREP_DECELERATE 3
+#define PREP_NOMINAL 4        // Snap to the nominal rate
+#define PREP_CRUISE 5
 
 // Used by independent_axis mode (e.g. homing)
 static indep_t_ptr indep_frame;
 bool indep_mode;
 
+// Used by the trapezoid generator in st_prep_buffer()
+static uint32_t cycles_per_acceleration_tick; // CPU cycles between trapezoid ticks, from settings
+
 // Used by the stepper driver interrupt
 static uint8_t step_pulse_time; // Step pulse reset time after step rise
 static uint8_t out_bits;        // The next stepping-bits to be output
@@ -79,6 +141,10 @@ static volatile uint8_t busy;   // True when SIG_OUTPUT_COMPARE1A is being servi
   static uint8_t step_bits;  // Stores out_bits output to complete the step pulse delay
 #endif
 
+#ifdef STEPPER_ISR_TIMING
+  static isr_timing_t isr_timing;
+#endif
+
 //         __________________________
 //        /|                        |\     _________________         ^
 //       / |                        | \   /|               |\        |
@@ -94,9 +160,15 @@ static volatile uint8_t busy;   // True when SIG_OUTPUT_COMPARE1A is being servi
 //  during the first block->accelerate_until step_events_completed, then keeps going at constant speed until 
 //  step_events_completed reaches block->decelerate_after after which it decelerates until the trapezoid generator is reset.
 //  The slope of acceleration is always +/- block->rate_delta and is applied at a constant rate following the midpoint rule
-//  by the trapezoid generator, which is called ACCELERATION_TICKS_PER_SECOND times per second.
+//  by the trapezoid generator, which is called settings.acceleration_ticks times per second.
+//  With a jerk limit set, the generator instead ramps the rate change per tick up to at most rate_delta and back
+//  down during each acceleration and deceleration, for an S-curve speed profile. The planner sizes 
+//  accelerate_until and decelerate_after for these longer phases. See scurve_start() and plan_scurve_steps().
+//  The trapezoid generator runs in the main program, in st_prep_buffer(). It cuts the trapezoid into step segments 
+//  that end at each trapezoid tick, so the stepper interrupt only changes the step rate at segment boundaries.
 
 static void set_step_events_per_minute(uint32_t steps_per_minute);
+static uint32_t step_timer_setting(uint32_t cycles, uint16_t *ceiling, uint8_t *prescaler);
 
 static void set_motion_state_indep(indep_t_ptr it); // forward declaration
 
@@ -127,6 +199,10 @@ void st_wake_up()
       // Set step pulse time. Ad hoc computation from oscilloscope. Uses two's complement.
       step_pulse_time = -(((settings.pulse_microseconds-2)*TICKS_PER_MICROSECOND) >> 3);
     #endif
+    // Initialize the trapezoid tick period. The setting only changes while idle.
+    cycles_per_acceleration_tick = F_CPU/settings.acceleration_ticks;
+    // Have the first step segments ready before the interrupt asks for them
+    if (sys.state == STATE_CYCLE) { st_prep_buffer(); }
     // Enable stepper driver interrupt
     TIMSK1 |= (1<<OCIE1A);
   }
@@ -243,29 +319,61 @@ static inline void test_hard_limits()
     }
   }
 }
-// This function determines an acceleration velocity change every CYCLES_PER_ACCELERATION_TICK by
-// keeping track of the number of elapsed cycles during a de/ac-celeration. The code assumes that 
-// step_events occur significantly more often than the acceleration velocity iterations.
-inline static uint8_t iterate_trapezoid_cycle_counter() 
+// Returns the index of the next segment in the ring buffer
+static uint8_t next_segment_index(uint8_t segment_index) 
 {
-  st.trapezoid_tick_cycle_counter += st.cycles_per_step_event;  
-  if(st.trapezoid_tick_cycle_counter > CYCLES_PER_ACCELERATION_TICK) {
-    st.trapezoid_tick_cycle_counter -= CYCLES_PER_ACCELERATION_TICK;
-    return(true);
-  } else {
-    return(false);
-  }
-}          
+  segment_index++;
+  if (segment_index == SEGMENT_BUFFER_SIZE) { segment_index = 0; }
+  return(segment_index);
+}
 
-// "The Stepper Driver Interrupt" - This timer interrupt is the workhorse of Grbl. It is executed at the rate set with
-// config_step_timer. It pops blocks from the block_buffer and executes them by pulsing the stepper pins appropriately. 
-// It is supported by The Stepper Port Reset Interrupt which it uses to reset the stepper port after each pulse. 
-// The bresenham line tracer algorithm controls all three stepper outputs simultaneously with these two interrupts.
+// Sets the Bresenham increments of the current block for the resolution of the current segment
+static inline void set_segment_steps()
+{
+  #ifdef ADAPTIVE_MULTI_AXIS_STEP_SMOOTHING
+    uint8_t shift = MAX_AMASS_LEVEL - current_segment->amass_level;
+    st.steps_x = (uint32_t)current_block->steps_x << shift;
+    st.steps_y = (uint32_t)current_block->steps_y << shift;
+    st.steps_z = (uint32_t)current_block->steps_z << shift;
+  #else
+    st.steps_x = current_block->steps_x;
+    st.steps_y = current_block->steps_y;
+    st.steps_z = current_block->steps_z;
+  #endif
+}
+
+// Loads the segment at the tail of the segment buffer: its step rate into timer 1 and, if its block is
+// already being traced, its Bresenham increments.
+static inline void load_segment()
+{
+  current_segment = &segment_buffer[segment_buffer_tail];
+  TCCR1B = (TCCR1B & ~(0x07<<CS10)) | (current_segment->prescaler<<CS10);
+  OCR1A = current_segment->ceiling;
+  #ifdef ADAPTIVE_MULTI_AXIS_STEP_SMOOTHING
+    st.segment_ticks = current_segment->n_step << current_segment->amass_level;
+    if (current_block != NULL) { set_segment_steps(); }
+  #else
+    st.segment_ticks = current_segment->n_step;
+  #endif
+}
+
+// "The Stepper Driver Interrupt" - This timer interrupt is the workhorse of Grbl. It is executed at the rate set
+// by the step segments. It pops step segments from the segment buffer and traces their blocks by pulsing the 
+// stepper pins appropriately. It is supported by The Stepper Port Reset Interrupt which it uses to reset the 
+// stepper port after each pulse. The bresenham line tracer algorithm controls all three stepper outputs 
+// simultaneously with these two interrupts.
 ISR(TIMER1_COMPA_vect)
 {        
-  if (busy) { return; } // The busy-flag is used to avoid reentering this interrupt
-  
-  PORTC |= 0x08;  // diagnostic timing test
+  #ifdef STEPPER_ISR_TIMING
+    uint8_t isr_start = TCNT0;
+  #endif
+  uint8_t isr_path = ISR_PATH_STEP; // Which path this interrupt took, for the timing statistics
+  if (busy) { // The busy-flag is used to avoid reentering this interrupt
+    #ifdef STEPPER_ISR_TIMING
+      if (isr_timing.overruns < 0xffff) { isr_timing.overruns++; }
+    #endif
+    return; 
+  }
   
   // Set the direction pins a couple of nanoseconds before we step the steppers
   STEPPING_PORT = (STEPPING_PORT & ~DIRECTION_MASK) | (out_bits & DIRECTION_MASK);
@@ -287,32 +395,51 @@ ISR(TIMER1_COMPA_vect)
   sei();
   out_bits = out_bits0;
 
-  // If there is no current block, attempt to pop one from the buffer
-  if (current_block == NULL && !indep_mode) {
-    // Anything in the buffer? If so, initialize next motion.
-    current_block = plan_get_current_block();
-    if (current_block != NULL) {
-      if (sys.state == STATE_CYCLE) {
-        // During feed hold, do not update rate and trap counter. Keep decelerating.
-        st.trapezoid_adjusted_rate = current_block->initial_rate;
-        set_step_events_per_minute(st.trapezoid_adjusted_rate); // Initialize cycles_per_step_event
-        st.trapezoid_tick_cycle_counter = CYCLES_PER_ACCELERATION_TICK/2; // Start halfway for midpoint rule.
+  // If there is no current segment, attempt to pop one from the buffer
+  if (current_segment == NULL && !indep_mode) {
+    if (segment_buffer_head != segment_buffer_tail) {
+      load_segment();
+      st.segment_underrun = false;
+      isr_path = ISR_PATH_SEGMENT;
+    } else if ((sys.state == STATE_CYCLE || sys.state == STATE_HOLD) && !prep.hold_complete &&
+               plan_get_current_block() != NULL) {
+      // The main program fell behind with motion still to come. Wait one more period of the last
+      // segment's step rate without stepping, rather than going idle, which would stop the axes dead 
+      // and run the idle lock delay in here. The motion resumes with the next segment prepared.
+      if (!st.segment_underrun) {
+        st.segment_underrun = true;
+        if (segment_underrun_count < 0xffff) { segment_underrun_count++; }
       }
-      st.min_safe_rate = current_block->rate_delta + (current_block->rate_delta >> 1); // 1.5 x rate_delta
-      st.counter_x = -(current_block->step_event_count >> 1);
-      st.counter_y = st.counter_x;
-      st.counter_z = st.counter_x;
-      st.event_count = current_block->step_event_count;
-      st.step_events_completed = 0;  
-      out_bits0 = (out_bits0 & ~DIRECTION_MASK)
-                  | ((current_block->direction_bits ^ settings.invert_mask) & DIRECTION_MASK);
-      set_motion_state_block(current_block); // for hard limits
+      isr_path = N_ISR_PATH; // Not timed. No step is traced.
     } else {
+      // The cycle has ended or the feed hold is complete. The main program sorts out which one and
+      // resumes from the traced position.
       st_go_idle();
       bit_true(sys.execute,EXEC_CYCLE_STOP); // Flag main program for cycle end
+      isr_path = N_ISR_PATH; // Not timed. No further step follows, and the idle lock delay runs here.
     }    
   } 
 
+  // If the segment starts a new block, initialize its motion
+  if (current_segment != NULL && current_block == NULL) {
+    current_block = plan_get_current_block();
+    isr_path = ISR_PATH_BLOCK_LOAD;
+    #ifdef ADAPTIVE_MULTI_AXIS_STEP_SMOOTHING
+      st.event_count = (uint32_t)current_block->step_event_count << MAX_AMASS_LEVEL;
+    #else
+      st.event_count = current_block->step_event_count;
+    #endif
+    set_segment_steps();
+    st.counter_x = -(st.event_count >> 1);
+    st.counter_y = st.counter_x;
+    st.counter_z = st.counter_x;
+    out_bits0 = (out_bits0 & ~DIRECTION_MASK)
+                | ((current_block->direction_bits ^ settings.invert_mask) & DIRECTION_MASK);
+    out_bits = out_bits0; // First step of the block must carry the new direction bits
+    set_motion_state_block(current_block); // for hard limits
+    spindle_request_direction(current_block->spindle_direction); // Spindle changes queued with the block
+  }
+
   if (indep_mode) {
     indep_t_ptr it = indep_frame;
     while(it) {
@@ -321,12 +448,12 @@ ISR(TIMER1_COMPA_vect)
       }
       it = it->next_axis;
     }
-  } else if (current_block != NULL) {
-    st.counter_x += current_block->steps_x;
-    st.counter_y += current_block->steps_y;
-    st.counter_z += current_block->steps_z;
+  } else if (current_segment != NULL) {
+    st.counter_x += st.steps_x;
+    st.counter_y += st.steps_y;
+    st.counter_z += st.steps_z;
   }
-  if (current_block != NULL || indep_mode) {
+  if (current_segment != NULL || indep_mode) {
     // Execute step displacement profile by bresenham line algorithm
     // note: unnecessary to set direction here; it is set at new block & retained in out_bits0
 
@@ -354,98 +481,37 @@ ISR(TIMER1_COMPA_vect)
     }
                    
     if(!indep_mode) {      
-      st.step_events_completed++; // Iterate step events
-
-      // While in block steps, check for de/ac-celeration events and execute them accordingly.
-      if (st.step_events_completed < current_block->step_event_count) {
-        if (sys.state == STATE_HOLD) {
-          // Check for and execute feed hold by enforcing a steady deceleration from the moment of 
-          // execution. The rate of deceleration is limited by rate_delta and will never decelerate
-          // faster or slower than in normal operation. If the distance required for the feed hold 
-          // deceleration spans more than one block, the initial rate of the following blocks are not
-          // updated and deceleration is continued according to their corresponding rate_delta.
-          // NOTE: The trapezoid tick cycle counter is not updated intentionally. This ensures that 
-          // the deceleration is smooth regardless of where the feed hold is initiated and if the
-          // deceleration distance spans multiple blocks.
-          if ( iterate_trapezoid_cycle_counter() ) {                    
-            // If deceleration complete, set system flags and shutdown steppers.
-            if (st.trapezoid_adjusted_rate <= current_block->rate_delta) {
-              // Just go idle. Do not NULL current block. The bresenham algorithm variables must
-              // remain intact to ensure the stepper path is exactly the same. Feed hold is still
-              // active and is released after the buffer has been reinitialized.
-              st_go_idle();
-              bit_true(sys.execute,EXEC_CYCLE_STOP); // Flag main program that feed hold is complete.
-            } else {
-              st.trapezoid_adjusted_rate -= current_block->rate_delta;
-              set_step_events_per_minute(st.trapezoid_adjusted_rate);
-            }      
-          }
-          
-        } else {
-          // The trapezoid generator always checks step event location to ensure de/ac-celerations are 
-          // executed and terminated at exactly the right time. This helps prevent over/under-shooting
-          // the target position and speed. 
-          // NOTE: By increasing the ACCELERATION_TICKS_PER_SECOND in config.h, the resolution of the 
-          // discrete velocity changes increase and accuracy can increase as well to a point. Numerical 
-          // round-off errors can effect this, if set too high. This is important to note if a user has 
-          // very high acceleration and/or feedrate requirements for their machine.
-          if (st.step_events_completed < current_block->accelerate_until) {
-            // Iterate cycle counter and check if speeds need to be increased.
-            if ( iterate_trapezoid_cycle_counter() ) {
-              st.trapezoid_adjusted_rate += current_block->rate_delta;
-              if (st.trapezoid_adjusted_rate >= current_block->nominal_rate) {
-                // Reached nominal rate a little early. Cruise at nominal rate until decelerate_after.
-                st.trapezoid_adjusted_rate = current_block->nominal_rate;
-              }
-              set_step_events_per_minute(st.trapezoid_adjusted_rate);
-            }
-          } else if (st.step_events_completed >= current_block->decelerate_after) {
-            // Reset trapezoid tick cycle counter to make sure that the deceleration is performed the
-            // same every time. Reset to CYCLES_PER_ACCELERATION_TICK/2 to follow the midpoint rule for
-            // an accurate approximation of the deceleration curve.
-            if (st.step_events_completed == current_block-> decelerate_after) {
-              st.trapezoid_tick_cycle_counter = CYCLES_PER_ACCELERATION_TICK/2;
-            } else {
-              // Iterate cycle counter and check if speeds need to be reduced.
-              if ( iterate_trapezoid_cycle_counter() ) {  
-                // NOTE: We will only do a full speed reduction if the result is more than the minimum safe 
-                // rate, initialized in trapezoid reset as 1.5 x rate_delta. Otherwise, reduce the speed by
-                // half increments until finished. The half increments are guaranteed not to exceed the 
-                // CNC acceleration limits, because they will never be greater than rate_delta. This catches
-                // small errors that might leave steps hanging after the last trapezoid tick or a very slow
-                // step rate at the end of a full stop deceleration in certain situations. The half rate 
-                // reductions should only be called once or twice per block and create a nice smooth 
-                // end deceleration.
-                if (st.trapezoid_adjusted_rate > st.min_safe_rate) {
-                  st.trapezoid_adjusted_rate -= current_block->rate_delta;
-                } else {
-                  st.trapezoid_adjusted_rate >>= 1; // Bit shift divide by 2
-                }
-                if (st.trapezoid_adjusted_rate < current_block->final_rate) {
-                  // Reached final rate a little early. Cruise to end of block at final rate.
-                  st.trapezoid_adjusted_rate = current_block->final_rate;
-                }
-                set_step_events_per_minute(st.trapezoid_adjusted_rate);
-              }
-            }
-          } else {
-            // No accelerations. Make sure we cruise exactly at the nominal rate.
-            if (st.trapezoid_adjusted_rate != current_block->nominal_rate) {
-              st.trapezoid_adjusted_rate = current_block->nominal_rate;
-              set_step_events_per_minute(st.trapezoid_adjusted_rate);
-            }
-          }
-        }            
-      } else {   
-        // If current block is finished, reset pointer 
-        current_block = NULL;
-        plan_discard_current_block();
+      if (--st.segment_ticks == 0) {
+        st.step_events_completed += current_segment->n_step;
+        if (current_segment->flags & SEGMENT_END_OF_BLOCK) {
+          // If current block is finished, reset pointer 
+          current_block = NULL;
+          plan_discard_current_block();
+          st.step_events_completed = 0;
+          // A spindle change queued after the last motion applies as soon as the motion ends.
+          if (plan_get_current_block() == NULL) { spindle_request_direction(spindle_queued_direction()); }
+        }
+        // Segment finished. The next one is loaded by the next interrupt, after this segment's step rate
+        // has timed the output of the step event just traced.
+        current_segment = NULL;
+        segment_buffer_tail = next_segment_index(segment_buffer_tail);
       }
     }
   }
+  #ifdef STEPPER_ISR_TIMING
+    if (isr_path < N_ISR_PATH) {
+      // Timer0 wraps every 256 ticks, which no interrupt path other than going idle comes near.
+      uint8_t ticks = TCNT0 - isr_start;
+      isr_timing.count[isr_path]++;
+      isr_timing.total[isr_path] += ticks;
+      if (ticks < isr_timing.min[isr_path]) { isr_timing.min[isr_path] = ticks; }
+      if (ticks > isr_timing.max[isr_path]) { isr_timing.max[isr_path] = ticks; }
+      ticks >>= ISR_TIMING_BIN_SHIFT;
+      if (ticks >= N_ISR_TIMING_BIN) { ticks = N_ISR_TIMING_BIN-1; }
+      isr_timing.histogram[ticks]++;
+    }
+  #endif
   busy = false;
-  PORTC &= ~(0x08); // diagnostic timing test
-  
 }
 
 // This interrupt is set up by ISR_TIMER1_COMPAREA when it sets the motor port bits. It resets
@@ -477,8 +543,13 @@ ISR(TIMER2_OVF_vect)
 void st_reset()
 {
   memset(&st, 0, sizeof(st));
+  memset(&prep, 0, sizeof(prep));
   set_step_events_per_minute(MINIMUM_STEPS_PER_MINUTE);
   current_block = NULL;
+  current_segment = NULL;
+  segment_buffer_tail = 0;
+  segment_buffer_head = 0;
+  segment_next_head = 1;
   busy = false;
   indep_mode=false;
   axes_moving = 0;
@@ -495,8 +566,13 @@ void st_init()
   STEPPING_PORT = out_bits0;
   STEPPERS_DISABLE_DDR |= STEPPERS_DISABLE_MASK;
   
-  // for diagnostic timing test
-  DDRC |= 0x08;
+  #ifdef STEPPER_ISR_TIMING
+    // Free-running Timer0 at 1/64 prescaler times the stepper driver interrupt
+    TCCR0A = 0; // Normal operation
+    TCCR0B = (1<<CS01)|(1<<CS00);
+    TIMSK0 = 0; // No interrupts, the counter is only read
+    st_isr_timing_read(NULL);
+  #endif
   
   // waveform generation = 0100 = CTC
   TCCR1B &= ~(1<<WGM13);
@@ -522,50 +598,395 @@ void st_init()
   st_go_idle();
 }
 
-// Configures the prescaler and ceiling of timer 1 to produce the given rate as accurately as possible.
+// Returns the number of times the segment buffer ran dry in mid-cycle since power-up
+uint16_t st_get_segment_underrun_count()
+{
+  uint8_t sreg = SREG;
+  cli(); // The stepper interrupt must not change the count between reading its two bytes.
+  uint16_t count = segment_underrun_count;
+  SREG = sreg;
+  return(count);
+}
+
+#ifdef STEPPER_ISR_TIMING
+// Copies the stepper interrupt timing statistics into timing, unless NULL, and restarts them.
+void st_isr_timing_read(isr_timing_t *timing)
+{
+  uint8_t i;
+  uint8_t sreg_save = SREG;
+  cli(); // The stepper interrupt updates these
+  if (timing != NULL) { memcpy(timing, &isr_timing, sizeof(isr_timing)); }
+  memset(&isr_timing, 0, sizeof(isr_timing));
+  for (i=0; i<N_ISR_PATH; i++) { isr_timing.min[i] = 0xff; }
+  SREG = sreg_save;
+}
+#endif
+
+// Reciprocals 2^31/x of the normalized step rates x = 32768 + 256*i, for i = 0 to 128. The first 
+// entry is clamped to 16 bits.
+static const uint16_t rate_reciprocal[129] PROGMEM = {
+  65535, 65028, 64528, 64035, 63550, 63072, 62602, 62138, 61681, 61231, 60787, 60350,
+  59919, 59494, 59075, 58662, 58254, 57852, 57456, 57065, 56680, 56299, 55924, 55554,
+  55188, 54828, 54471, 54120, 53773, 53431, 53092, 52759, 52429, 52103, 51782, 51464,
+  51150, 50840, 50534, 50231, 49932, 49637, 49345, 49056, 48771, 48489, 48210, 47935,
+  47663, 47393, 47127, 46864, 46603, 46346, 46091, 45839, 45590, 45344, 45100, 44859,
+  44620, 44384, 44151, 43919, 43691, 43464, 43240, 43019, 42799, 42582, 42367, 42154,
+  41943, 41734, 41528, 41323, 41121, 40920, 40721, 40525, 40330, 40137, 39946, 39756,
+  39569, 39383, 39199, 39017, 38836, 38657, 38480, 38304, 38130, 37958, 37787, 37617,
+  37449, 37283, 37118, 36954, 36792, 36631, 36472, 36314, 36158, 36003, 35849, 35696,
+  35545, 35395, 35246, 35099, 34953, 34808, 34664, 34521, 34380, 34239, 34100, 33962,
+  33825, 33689, 33554, 33421, 33288, 33157, 33026, 32897, 32768
+};
+
+// The cycles per minute, F_CPU*60, as a 16-bit mantissa and a power of two
+#if F_CPU*60 < (1UL<<30)
+  #define CYCLES_PER_MINUTE_SHIFT 14
+#else
+  #define CYCLES_PER_MINUTE_SHIFT 15
+#endif
+#define CYCLES_PER_MINUTE_MANTISSA ((F_CPU*60 + (1UL<<(CYCLES_PER_MINUTE_SHIFT-1))) >> CYCLES_PER_MINUTE_SHIFT)
+
+// Converts a step rate to CPU cycles per step event, (F_CPU*60)/steps_per_minute, without a 32-bit 
+// divide. The rate is normalized to x in [32768,65536) by a power of two, its reciprocal interpolated
+// from rate_reciprocal[] and multiplied by the cycles per minute. The result is within 0.007% plus 
+// half a cycle of the exact quotient for all rates from MINIMUM_STEPS_PER_MINUTE up. The trapezoid 
+// generator times its ticks from the returned periods, so the error only scales the step rate slightly.
+static uint32_t step_event_cycles(uint32_t steps_per_minute)
+{
+  int8_t shift = 31 - CYCLES_PER_MINUTE_SHIFT;
+  while (steps_per_minute >= 0x10000) { steps_per_minute >>= 1; shift++; }
+  while (steps_per_minute < 0x8000) { steps_per_minute <<= 1; shift--; }
+  uint8_t i = (steps_per_minute >> 8) - 128;
+  uint16_t r0 = pgm_read_word(&rate_reciprocal[i]);
+  uint16_t r1 = pgm_read_word(&rate_reciprocal[i+1]);
+  uint16_t reciprocal = r0 - (((uint32_t)(r0 - r1)*(steps_per_minute & 0xff)) >> 8);
+  return((((uint32_t)CYCLES_PER_MINUTE_MANTISSA*reciprocal) + (1UL<<(shift-1))) >> shift);
+}
+
+// Computes the prescaler and ceiling of timer 1 that produce the given rate as accurately as possible.
 // Returns the actual number of cycles per interrupt
-static uint32_t config_step_timer(uint32_t cycles) // cycles = desired clock ticks per interrupt
+static uint32_t step_timer_setting(uint32_t cycles, uint16_t *ceiling, uint8_t *prescaler) // cycles = desired clock ticks per interrupt
 {
-  uint16_t ceiling;
-  uint8_t prescaler;
   uint32_t actual_cycles;
   if (cycles <= 0xffffL) {
-    ceiling = cycles;
-    prescaler = 1; // prescaler: 0
-    actual_cycles = ceiling;
+    *ceiling = cycles;
+    *prescaler = 1; // prescaler: 0
+    actual_cycles = *ceiling;
   } else if (cycles <= 0x7ffffL) {
-    ceiling = cycles >> 3;
-    prescaler = 2; // prescaler: 8
-    actual_cycles = ceiling * 8L;
+    *ceiling = cycles >> 3;
+    *prescaler = 2; // prescaler: 8
+    actual_cycles = *ceiling * 8L;
   } else if (cycles <= 0x3fffffL) {
-    ceiling =  cycles >> 6;
-    prescaler = 3; // prescaler: 64
-    actual_cycles = ceiling * 64L;
+    *ceiling =  cycles >> 6;
+    *prescaler = 3; // prescaler: 64
+    actual_cycles = *ceiling * 64L;
   } else if (cycles <= 0xffffffL) {
-    ceiling =  (cycles >> 8);
-    prescaler = 4; // prescaler: 256
-    actual_cycles = ceiling * 256L;
+    *ceiling =  (cycles >> 8);
+    *prescaler = 4; // prescaler: 256
+    actual_cycles = *ceiling * 256L;
   } else if (cycles <= 0x3ffffffL) {
-    ceiling = (cycles >> 10);
-    prescaler = 5; // prescaler: 1024
-    actual_cycles = ceiling * 1024L;    
+    *ceiling = (cycles >> 10);
+    *prescaler = 5; // prescaler: 1024
+    actual_cycles = *ceiling * 1024L;    
   } else {
     // Okay, that was slower than we actually go. Just set the slowest speed
-    ceiling = 0xffff;
-    prescaler = 5;
+    *ceiling = 0xffff;
+    *prescaler = 5;
     actual_cycles = 0xffff * 1024;
   }
+  return(actual_cycles);
+}
+
+// Configures timer 1 directly for the given rate. Used outside of step segments, by the independent-axis 
+// moves and at reset.
+static void set_step_events_per_minute(uint32_t steps_per_minute) 
+{
+  uint16_t ceiling;
+  uint8_t prescaler;
+  if (steps_per_minute < MINIMUM_STEPS_PER_MINUTE) { steps_per_minute = MINIMUM_STEPS_PER_MINUTE; }
+  step_timer_setting(step_event_cycles(steps_per_minute), &ceiling, &prescaler);
   // Set prescaler
   TCCR1B = (TCCR1B & ~(0x07<<CS10)) | (prescaler<<CS10);
   // Set ceiling
   OCR1A = ceiling;
-  return(actual_cycles);
 }
 
-static void set_step_events_per_minute(uint32_t steps_per_minute) 
+// Sets the step rate of the segments being prepared
+static void set_prep_step_events_per_minute(uint32_t steps_per_minute) 
 {
   if (steps_per_minute < MINIMUM_STEPS_PER_MINUTE) { steps_per_minute = MINIMUM_STEPS_PER_MINUTE; }
-  st.cycles_per_step_event = config_step_timer((TICKS_PER_MICROSECOND*1000000*60)/steps_per_minute);
+  uint32_t cycles = step_event_cycles(steps_per_minute);
+  #ifdef ADAPTIVE_MULTI_AXIS_STEP_SMOOTHING
+    // The slower the step events, the more stepper interrupts per step event.
+    if (cycles < AMASS_LEVEL1) { prep.amass_level = 0; }
+    else if (cycles < AMASS_LEVEL2) { prep.amass_level = 1; }
+    else if (cycles < AMASS_LEVEL3) { prep.amass_level = 2; }
+    else { prep.amass_level = 3; }
+    prep.cycles_per_step_event = step_timer_setting(cycles >> prep.amass_level, &prep.ceiling, 
+                                                    &prep.prescaler) << prep.amass_level;
+  #else
+    prep.cycles_per_step_event = step_timer_setting(cycles, &prep.ceiling, &prep.prescaler);
+  #endif
+}
+
+// Starts an S-curve acceleration or deceleration from rate_from to rate_to (step/min) over the given 
+// step events, as planned by plan_scurve_steps(). The rate change per tick ramps up over the first R ticks,
+// holds for M-R ticks and ramps down over the last R ticks, N = R+M in all. Its half tick weights 1, 3, .., 
+// 2R-1, 2R, .., 2R, 2R-1, .., 1 sum to 2*R*M, so the peak rate change per tick is the change/M and the jerk
+// the change/(R*M). R and M are rounded up from the shortest ramp and hold within rate_delta and the jerk 
+// limit, and M is then stretched to the whole ticks that the step events span at the mean of the two 
+// rates. An acceleration that ends early cruises at its peak. A deceleration must not run out of step events
+// before it is done, nor reach its final rate before them, so it starts later by the fraction of a tick 
+// that the step events span at rate_from. Phases longer than 0xffff ticks stay linear.
+static void scurve_start(block_t *block, uint32_t rate_from, uint32_t rate_to, uint32_t steps)
+{
+  prep.scurve_tick = 0;
+  prep.scurve_ramp = 0;
+  prep.scurve_delay = false;
+  uint32_t rate_change = (rate_to > rate_from) ? rate_to-rate_from : rate_from-rate_to;
+  if (settings.jerk <= 0 || rate_change == 0) { return; } 
+  float jerk = plan_scurve_jerk(block);
+  uint32_t ramp = ceil(min(block->rate_delta/jerk, sqrt(rate_change/jerk)));
+  if (ramp == 0) { ramp = 1; }
+  float steps_per_tick = ((float)rate_from+rate_to)/(120.0*settings.acceleration_ticks);
+  float ticks = floor(steps/steps_per_tick);
+  if (ticks > 0xffff) { return; }
+  uint32_t hold_end = max(ramp, ceil((float)rate_change/block->rate_delta));
+  hold_end = max(hold_end, ceil(rate_change/(jerk*ramp)));
+  if (ramp+hold_end > 0xffff) { return; } 
+  if (ramp+hold_end <= ticks) {
+    hold_end = ticks-ramp;
+    if (rate_from > rate_to) {
+      uint32_t delay = (steps-ticks*steps_per_tick)*(60.0*settings.acceleration_ticks)/rate_from*
+                       cycles_per_acceleration_tick;
+      if (prep.trapezoid_tick_cycle_counter < delay) {
+        prep.trapezoid_tick_cycle_counter += cycles_per_acceleration_tick;
+        prep.scurve_delay = true;
+      }
+      prep.trapezoid_tick_cycle_counter -= delay;
+    }
+  }
+  prep.scurve_ticks = ramp+hold_end;
+  prep.scurve_ramp = ramp;
+  prep.scurve_change = rate_change;
+  prep.scurve_gain = (float)rate_change/(2.0*ramp*hold_end);
+}
+
+// Returns the rate change of the S-curve phase over its first ticks, rounded to the nearest step/min.
+static uint32_t scurve_change_until(uint16_t tick)
+{
+  if (tick >= prep.scurve_ticks) { return(prep.scurve_change); }
+  uint16_t ramp = prep.scurve_ramp;
+  float weight; // Sum of the half tick weights of the ticks
+  if (tick <= ramp) { weight = (float)tick*tick; }
+  else if (tick <= prep.scurve_ticks-ramp) { weight = (float)ramp*(2*tick-ramp); }
+  else {
+    uint16_t ticks_left = prep.scurve_ticks-tick;
+    weight = 2.0*ramp*(prep.scurve_ticks-ramp) - (float)ticks_left*ticks_left;
+  }
+  return(min(prep.scurve_change, floor(prep.scurve_gain*weight + 0.5)));
+}
+
+// Returns the S-curve rate change for the next trapezoid tick of the phase. Zero once the phase is done.
+// The changes add up to exactly the rate change of the phase.
+static uint32_t scurve_rate_change()
+{
+  if (prep.scurve_delay) { prep.scurve_delay = false; return(0); }
+  if (prep.scurve_tick >= prep.scurve_ticks) { return(0); }
+  prep.scurve_tick++;
+  return(scurve_change_until(prep.scurve_tick) - scurve_change_until(prep.scurve_tick-1));
+}
+
+// Cuts the trapezoids of the planned blocks into step segments until the segment buffer is full. Each
+// segment ends where the trapezoid generator changes the step rate, at the end of its block, or after
+// at most one trapezoid tick of cruising. This is the trapezoid generator that formerly ran in the stepper
+// interrupt, iterated a whole segment at a time: the step rates and the step events at which they change
+// are the same.
+void st_prep_buffer()
+{
+  while (segment_buffer_tail != segment_next_head && !prep.hold_complete) {
+    // If there is no block being prepared, attempt to fetch one from the planner
+    if (prep.block == NULL) {
+      prep.block = plan_get_prep_block();
+      if (prep.block == NULL) { return; } // Nothing more to prepare
+      if (sys.state == STATE_CYCLE) {
+        // During feed hold, do not update rate and trap counter. Keep decelerating.
+        prep.trapezoid_adjusted_rate = prep.block->initial_rate;
+        set_prep_step_events_per_minute(prep.trapezoid_adjusted_rate); // Initialize cycles_per_step_event
+        prep.trapezoid_tick_cycle_counter = cycles_per_acceleration_tick/2; // Start halfway for midpoint rule.
+        // The acceleration ends at the nominal rate or, if the block is too short, where it meets the 
+        // deceleration (v^2 = v0^2 + 2*a*d, or the S-curve phase the planner fitted into accelerate_until).
+        float peak_rate;
+        if (settings.jerk > 0 && prep.block->initial_rate < prep.block->nominal_rate) {
+          peak_rate = plan_scurve_reachable_rate(prep.block, prep.block->initial_rate, 
+                                                 prep.block->nominal_rate, prep.block->accelerate_until);
+        } else {
+          peak_rate = sqrt((float)prep.block->initial_rate*prep.block->initial_rate + 
+            2.0*prep.block->rate_delta*(60.0*settings.acceleration_ticks)*prep.block->accelerate_until);
+        }
+        peak_rate = max(min(peak_rate, prep.block->nominal_rate), prep.block->initial_rate);
+        if (prep.block->decelerate_after == 0 && prep.block->initial_rate > prep.block->final_rate) {
+          // Decelerates from the first step event, so there is no decelerate_after step to start at.
+          scurve_start(prep.block, prep.block->initial_rate, prep.block->final_rate, prep.block->step_event_count);
+        } else {
+          scurve_start(prep.block, prep.block->initial_rate, peak_rate, prep.block->accelerate_until);
+        }
+      }
+      prep.min_safe_rate = prep.block->rate_delta + (prep.block->rate_delta >> 1); // 1.5 x rate_delta
+      prep.step_events_completed = 0;
+    }
+    block_t *block = prep.block;
+    
+    // Step events of this segment until the next trapezoid tick, which occurs on the step event that 
+    // brings the tick cycle counter past cycles_per_acceleration_tick.
+    uint32_t tick_steps;
+    if (prep.trapezoid_tick_cycle_counter >= cycles_per_acceleration_tick) { tick_steps = 1; }
+    else { 
+      tick_steps = (cycles_per_acceleration_tick-prep.trapezoid_tick_cycle_counter)/prep.cycles_per_step_event + 1; 
+    }
+
+    // Determine the segment length from the trapezoid phase of its first step event. The phase holds for 
+    // every step event of the segment.
+    uint16_t step = prep.step_events_completed+1;
+    uint32_t n_step;
+    uint8_t phase;
+    if (sys.state == STATE_HOLD) {
+      phase = PREP_HOLD;
+      n_step = tick_steps;
+    } else if (step < block->accelerate_until) {
+      phase = PREP_ACCELERATE;
+      n_step = min(tick_steps, block->accelerate_until-step);
+    } else if (step == block->decelerate_after) {
+      phase = PREP_DECELERATE_START;
+      n_step = 1;
+    } else if (step > block->decelerate_after) {
+      phase = PREP_DECELERATE;
+      n_step = tick_steps;
+    } else if (prep.trapezoid_adjusted_rate != block->nominal_rate) {
+      phase = PREP_NOMINAL;
+      n_step = 1;
+    } else {
+      phase = PREP_CRUISE;
+      n_step = min(cycles_per_acceleration_tick/prep.cycles_per_step_event + 1, block->decelerate_after-step);
+    }
+    
+    // The trapezoid generator runs after every step event of the segment, except the last one of the block.
+    uint16_t steps_remaining = block->step_event_count - prep.step_events_completed;
+    uint16_t iterations = n_step;
+    segment_t *segment = &segment_buffer[segment_buffer_head];
+    segment->flags = 0;
+    if (n_step >= steps_remaining) {
+      n_step = steps_remaining;
+      iterations = n_step-1;
+      segment->flags = SEGMENT_END_OF_BLOCK;
+      prep.block = NULL;
+      plan_discard_prep_block();
+    }
+    segment->n_step = n_step;
+    segment->ceiling = prep.ceiling;
+    segment->prescaler = prep.prescaler;
+    #ifdef ADAPTIVE_MULTI_AXIS_STEP_SMOOTHING
+      segment->amass_level = prep.amass_level;
+    #endif
+    prep.step_events_completed += n_step;
+    
+    // Hand the segment to the stepper interrupt
+    segment_buffer_head = segment_next_head;
+    segment_next_head = next_segment_index(segment_buffer_head);
+
+    // Update the trapezoid generator for the step events after the segment. Only the last iteration of
+    // a segment can reach a trapezoid tick.
+    if (iterations == 0) { continue; }
+    switch (phase) {
+      case PREP_HOLD: case PREP_ACCELERATE: case PREP_DECELERATE:
+        // The step events of a segment span a known time, so advance the velocity profile by every
+        // trapezoid tick that elapsed during it. Step events slower than the ticks then receive all of
+        // their rate changes at once, rather than one per step event lagging behind the profile.
+        prep.trapezoid_tick_cycle_counter += iterations*prep.cycles_per_step_event;
+        if (prep.trapezoid_tick_cycle_counter <= cycles_per_acceleration_tick) { break; }
+        while (prep.trapezoid_tick_cycle_counter > cycles_per_acceleration_tick) {
+          prep.trapezoid_tick_cycle_counter -= cycles_per_acceleration_tick;
+          if (phase == PREP_HOLD) {
+            // Check for and execute feed hold by enforcing a steady deceleration from the moment of 
+            // execution. The rate of deceleration is limited by rate_delta and will never decelerate
+            // faster or slower than in normal operation. If the distance required for the feed hold 
+            // deceleration spans more than one block, the initial rate of the following blocks are not
+            // updated and deceleration is continued according to their corresponding rate_delta.
+            // NOTE: The trapezoid tick cycle counter is not updated intentionally. This ensures that 
+            // the deceleration is smooth regardless of where the feed hold is initiated and if the
+            // deceleration distance spans multiple blocks.
+            if (prep.trapezoid_adjusted_rate <= block->rate_delta) {
+              // Deceleration complete. The stepper interrupt goes idle after this segment, leaving the 
+              // bresenham algorithm variables intact to ensure the stepper path is exactly the same. Feed 
+              // hold is still active and is released after the buffer has been reinitialized.
+              prep.hold_complete = true;
+              break;
+            }
+            prep.trapezoid_adjusted_rate -= block->rate_delta;
+          } else if (phase == PREP_ACCELERATE) {
+            if (prep.trapezoid_adjusted_rate > block->nominal_rate) {
+              // Entered above a nominal rate lowered by the feed override. Slow down to it first.
+              if (prep.trapezoid_adjusted_rate > block->nominal_rate + block->rate_delta) {
+                prep.trapezoid_adjusted_rate -= block->rate_delta;
+              } else {
+                prep.trapezoid_adjusted_rate = block->nominal_rate;
+              }
+            } else {
+              if (prep.scurve_ramp) { prep.trapezoid_adjusted_rate += scurve_rate_change(); }
+              else { prep.trapezoid_adjusted_rate += block->rate_delta; }
+              if (prep.trapezoid_adjusted_rate >= block->nominal_rate) {
+                // Reached nominal rate a little early. Cruise at nominal rate until decelerate_after.
+                prep.trapezoid_adjusted_rate = block->nominal_rate;
+              }
+            }
+          } else {
+            // NOTE: We will only do a full speed reduction if the result is more than the minimum safe 
+            // rate, initialized in trapezoid reset as 1.5 x rate_delta. Otherwise, reduce the speed by
+            // half increments until finished. The half increments are guaranteed not to exceed the 
+            // CNC acceleration limits, because they will never be greater than rate_delta. This catches
+            // small errors that might leave steps hanging after the last trapezoid tick or a very slow
+            // step rate at the end of a full stop deceleration in certain situations. The half rate 
+            // reductions should only be called once or twice per block and create a nice smooth 
+            // end deceleration.
+            if (prep.scurve_ramp) {
+              uint32_t rate_change = scurve_rate_change();
+              if (prep.trapezoid_adjusted_rate > block->final_rate + rate_change) { 
+                prep.trapezoid_adjusted_rate -= rate_change; 
+              } else {
+                prep.trapezoid_adjusted_rate = block->final_rate;
+              }
+            } else if (prep.trapezoid_adjusted_rate > prep.min_safe_rate) {
+              prep.trapezoid_adjusted_rate -= block->rate_delta;
+            } else {
+              prep.trapezoid_adjusted_rate >>= 1; // Bit shift divide by 2
+            }
+            if (prep.trapezoid_adjusted_rate < block->final_rate) {
+              // Reached final rate a little early. Cruise to end of block at final rate.
+              prep.trapezoid_adjusted_rate = block->final_rate;
+            }
+          }
+        }
+        set_prep_step_events_per_minute(prep.trapezoid_adjusted_rate);
+        break;
+      case PREP_DECELERATE_START:
+        // Reset trapezoid tick cycle counter to make sure that the deceleration is performed the
+        // same every time. Reset to half a tick to follow the midpoint rule for
+        // an accurate approximation of the deceleration curve.
+        prep.trapezoid_tick_cycle_counter = cycles_per_acceleration_tick/2;
+        if (prep.trapezoid_adjusted_rate > block->final_rate) {
+          scurve_start(block, prep.trapezoid_adjusted_rate, block->final_rate, 
+                       block->step_event_count - block->decelerate_after);
+        } else {
+          scurve_start(block, 0, 0, 0);
+        }
+        break;
+      case PREP_NOMINAL:
+        // No accelerations. Make sure we cruise exactly at the nominal rate.
+        prep.trapezoid_adjusted_rate = block->nominal_rate;
+        set_prep_step_events_per_minute(prep.trapezoid_adjusted_rate);
+        break;
+    }
+  }
 }
 
 // Planner external interface to start stepper interrupt and execute the blocks in queue. Called
@@ -590,22 +1011,47 @@ void st_feed_hold()
   }
 }
 
-// Reinitializes the cycle plan and stepper system after a feed hold for a resume. Called by 
-// runtime command execution in the main program, ensuring that the planner re-plans safely.
+// Replans the buffered motions for a changed feed or rapid override. The block being prepared is replanned from
+// the rate the segment generator reached, so the change takes effect after the prepared segments. During
+// a feed hold, the resume applies it instead. Called by runtime command execution in the main program.
+void st_update_overrides()
+{
+  if (sys.state == STATE_HOLD) { return; }
+  if (sys.state == STATE_CYCLE && prep.block != NULL) {
+    plan_update_overrides(prep.step_events_completed, prep.trapezoid_adjusted_rate);
+    prep.scurve_ramp = 0; // The acceleration left, if any, is no longer the one the S-curve was fitted to.
+  } else {
+    plan_update_overrides(0, 0);
+  }
+}
+
+// Reinitializes the cycle plan and stepper system after the stepper interrupt has gone idle: after a feed 
+// hold for a resume, or at the end of a cycle. Called by runtime command execution in the main program,
+// ensuring that the planner re-plans safely.
 // NOTE: Bresenham algorithm variables are still maintained through both the planner and stepper
 // cycle reinitializations. The stepper path should continue exactly as if nothing has happened.
 // Only the planner de/ac-celerations profiles and stepper rates have been updated.
 void st_cycle_reinitialize()
 {
-  if (current_block != NULL) {
-    // Replan buffer from the feed hold stop location.
-    plan_cycle_reinitialize(current_block->step_event_count - st.step_events_completed);
-    // Update initial rate and timers after feed hold.
-    st.trapezoid_adjusted_rate = 0; // Resumes from rest
-    set_step_events_per_minute(st.trapezoid_adjusted_rate);
-    st.trapezoid_tick_cycle_counter = CYCLES_PER_ACCELERATION_TICK/2; // Start halfway for midpoint rule.
+  // Discard any segments prepared since the stepper interrupt stopped. They are prepared again from 
+  // the traced position.
+  segment_buffer_head = segment_buffer_tail;
+  segment_next_head = next_segment_index(segment_buffer_head);
+  current_segment = NULL;
+  memset(&prep, 0, sizeof(prep));
+  
+  block_t *block = plan_get_current_block();
+  if (block != NULL) {
+    // Replan buffer from the stop location. The first segment resumes from rest.
+    plan_cycle_reinitialize(block->step_event_count - st.step_events_completed);
     st.step_events_completed = 0;
-    sys.state = STATE_QUEUED;
+    if (sys.state == STATE_HOLD) {
+      sys.state = STATE_QUEUED;
+    } else {
+      // More motion was queued just as the cycle ended. Resume right away.
+      sys.state = STATE_QUEUED;
+      if (sys.auto_start) { st_cycle_start(); }
+    }
   } else {
     sys.state = STATE_IDLE;
   }
@@ -26,9 +26,14 @@
 #include <avr/io.h>
 #include <avr/sleep.h>
 #include <stdbool.h>
+#include "config.h"
 
 typedef struct indep_t *indep_t_ptr;
 
+// The number of step segments prepared ahead of the stepper interrupt
+#ifndef SEGMENT_BUFFER_SIZE
+  #define SEGMENT_BUFFER_SIZE 6
+#endif
 
 
 // Initialize and setup the stepper motor subsystem
@@ -52,11 +57,45 @@ void st_cycle_reinitialize();
 // Initiates a feed hold of the running program
 void st_feed_hold();
 
+// Replans the buffered motions for a changed feed or rapid override
+void st_update_overrides();
+
+// Fills the step segment buffer from the planned blocks. Called continuously by the main program.
+void st_prep_buffer();
+
+// Returns the number of times the segment buffer ran dry in mid-cycle since power-up
+uint16_t st_get_segment_underrun_count();
+
 // Start an independent-axis move
 void st_indep_start(indep_t_ptr frame);
 
 void inline disable_steppers();
 
+// Stepper driver interrupt paths, timed separately when STEPPER_ISR_TIMING is enabled
+#define ISR_PATH_BLOCK_LOAD 0 // A new block was loaded from the planner
+#define ISR_PATH_SEGMENT 1    // A new step segment set the step rate
+#define ISR_PATH_STEP 2       // Bresenham step only
+#define N_ISR_PATH 3
+
+#ifdef STEPPER_ISR_TIMING
+  #define N_ISR_TIMING_BIN 8
+  #define ISR_TIMING_BIN_SHIFT 2 // Histogram bin width is 4 Timer0 ticks (16us)
+  #define ISR_TIMING_USEC_PER_TICK (64.0*1000000/F_CPU)
+
+  // Stepper interrupt execution time statistics, in Timer0 ticks
+  typedef struct {
+    uint32_t count[N_ISR_PATH];
+    uint32_t total[N_ISR_PATH];
+    uint8_t min[N_ISR_PATH];
+    uint8_t max[N_ISR_PATH];
+    uint32_t histogram[N_ISR_TIMING_BIN];
+    uint16_t overruns;  // Step interrupts that found the previous one still running
+  } isr_timing_t;
+
+  // Copies the stepper interrupt timing statistics and restarts them
+  void st_isr_timing_read(isr_timing_t *timing);
+#endif
+
 extern uint8_t out_bits0;
 extern bool indep_mode;
 